@@ -0,0 +1,129 @@
+#ifndef MAP_MERGE_DISTRIBUTED_H_
+#define MAP_MERGE_DISTRIBUTED_H_
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <map_merge_3d/map_merging.h>
+
+namespace map_merge_3d
+{
+/**
+ * @addtogroup map_merging
+ * @{
+ */
+
+/**
+ * @brief Pool of processes registering pairs of maps
+ * @details Registration of pairs of maps from scratch dominates the
+ * estimation when many maps are merged. The pool distributes these
+ * registrations to worker processes, either local processes spawned by the
+ * pool or map_merge_worker processes listening on unix domain sockets. Features
+ * of each map are sent to each worker only once and cached by the worker
+ * under the content hash of the map.
+ *
+ * A worker that disconnects, fails to answer within the timeout or violates
+ * the protocol is dropped and its pair is retried with another worker. Pairs
+ * that failed repeatedly or could not be sent to any worker are registered in
+ * the calling process. Dropped workers are respawned or reconnected when the
+ * next batch of pairs is registered, except local workers forked without
+ * exec.
+ *
+ * The pool is not thread-safe.
+ */
+class RegistrationWorkers
+{
+public:
+  /**
+   * @brief Starts local workers and connects to remote ones
+   * @details Workers that cannot be started or connected are skipped and
+   * retried by the next registerPairs.
+   *
+   * @param endpoints paths of unix domain sockets of running map_merge_worker
+   * processes
+   * @param local_workers number of worker processes to spawn
+   * @param timeout maximum time in seconds a worker may take to register one
+   * pair
+   * @param worker_executable path to map_merge_worker executed for local
+   * workers. If empty, local workers are forked from the current process
+   * without exec, which is only safe before the process starts threads
+   * (OpenMP included). Such workers are therefore not respawned once they
+   * die. Processes running other threads, e.g. ROS nodes, must set it.
+   */
+  RegistrationWorkers(const std::vector<std::string> &endpoints,
+                      size_t local_workers, double timeout,
+                      const std::string &worker_executable = "");
+  ~RegistrationWorkers();
+  RegistrationWorkers(const RegistrationWorkers &) = delete;
+  RegistrationWorkers &operator=(const RegistrationWorkers &) = delete;
+
+  /**
+   * @brief Number of live workers
+   */
+  size_t size() const;
+
+  /**
+   * @brief Registers pairs of maps with estimatePairTransform
+   * @details Results are the same as if pairs were registered locally one by
+   * one.
+   *
+   * @param features features of maps with descriptors computed for all maps in
+   * pairs
+   * @param pairs pairs (source, target) of indices to features
+   * @param params parameters for estimation
+   * @param is_cancelled polled while waiting for workers
+   * @throws EstimationCancelled if the estimation was cancelled. Busy workers
+   * are dropped in that case.
+   *
+   * @return estimates source -> target in the order of pairs
+   */
+  std::vector<TransformEstimate>
+  registerPairs(const std::vector<MapFeatures> &features,
+                const std::vector<std::pair<size_t, size_t>> &pairs,
+                const MapMergingParams &params,
+                const std::function<bool()> &is_cancelled = {});
+
+private:
+  struct Worker {
+    // socket path of a remote worker, empty for local workers
+    std::string endpoint;
+    // process of a local worker, 0 if not running
+    int pid = 0;
+    // connection to the worker, -1 if the worker is dead
+    int fd = -1;
+    // parameters the worker was configured with
+    std::string params;
+    // hashes of features cached by the worker
+    std::unordered_set<uint64_t> features;
+  };
+
+  std::vector<Worker> workers_;
+  double timeout_;
+  std::string worker_executable_;
+  uint64_t next_job_;
+
+  void start(Worker &worker);
+  void drop(Worker &worker);
+  bool dispatch(Worker &worker, uint64_t job, size_t source, size_t target,
+                const std::vector<MapFeatures> &features,
+                const std::string &params);
+};
+
+/**
+ * @brief Serves registration requests of RegistrationWorkers
+ * @details Runs in the worker process until the connection is closed.
+ *
+ * @param fd connected socket, closed on return
+ * @throws std::runtime_error if the protocol is violated
+ */
+void serveRegistrationWorker(int fd);
+
+///@} group map_merging
+
+}  // namespace map_merge_3d
+
+#endif  // MAP_MERGE_DISTRIBUTED_H_
@@ -0,0 +1,82 @@
+#ifndef MAP_MERGE_ESTIMATION_WORKER_H_
+#define MAP_MERGE_ESTIMATION_WORKER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace map_merge_3d
+{
+/**
+ * @addtogroup node
+ * @{
+ */
+
+/**
+ * @brief Runs estimation jobs in a dedicated thread
+ * @details Requests are coalesced: at most one job runs at a time and at most
+ * one job is pending. A new request replaces the pending job, so the latest
+ * request always wins and no duplicate work is queued. The running job can be
+ * asked to stop early through its cancellation flag. This class is
+ * thread-safe.
+ */
+class EstimationWorker
+{
+public:
+  /**
+   * @brief Job executed by the worker
+   * @details Job should poll cancelled flag and return early when it is set.
+   * Job must not throw.
+   */
+  typedef std::function<void(const std::atomic<bool> &cancelled)> Job;
+
+  EstimationWorker();
+  ~EstimationWorker();
+  EstimationWorker(const EstimationWorker &) = delete;
+  EstimationWorker &operator=(const EstimationWorker &) = delete;
+
+  /**
+   * @brief Schedules job to run after the running job finishes
+   * @details Replaces previously pending job.
+   *
+   * @param job job to run
+   * @param cancel_running whether to cancel the running job, so that the new
+   * job starts as soon as possible
+   */
+  void request(Job job, bool cancel_running = false);
+
+  /**
+   * @brief Cancels the running job and drops the pending job
+   */
+  void cancel();
+
+  /**
+   * @brief Whether a job is running or pending
+   */
+  bool busy() const;
+
+  /**
+   * @brief Blocks until there is no running or pending job
+   */
+  void waitIdle() const;
+
+private:
+  void run();
+
+  mutable std::mutex mutex_;
+  std::condition_variable wakeup_;
+  mutable std::condition_variable idle_;
+  Job pending_;
+  bool running_;
+  bool stop_;
+  std::atomic<bool> cancelled_;
+  std::thread thread_;
+};
+
+///@} group node
+
+}  // namespace map_merge_3d
+
+#endif  // MAP_MERGE_ESTIMATION_WORKER_H_
@@ -0,0 +1,76 @@
+#ifndef MAP_MERGE_EVALUATION_H_
+#define MAP_MERGE_EVALUATION_H_
+
+#include <string>
+#include <vector>
+
+#include <Eigen/Core>
+
+namespace map_merge_3d
+{
+/**
+ * @defgroup evaluation Evaluation
+ * @brief Comparing estimated transforms with the ground truth.
+ * @details Functions to store ground-truth transforms and to evaluate accuracy
+ * of the transforms estimated by estimateMapsTransforms.
+ * @{
+ */
+
+/**
+ * @brief Loads transforms from text file
+ * @details File contains 4x4 matrices in row-major order, one matrix for each
+ * map. Numbers are separated by whitespace, lines starting with `#` are
+ * ignored.
+ *
+ * @param file_name file to read
+ * @return loaded transforms
+ * @throws std::runtime_error if the file could not be read or is malformed
+ */
+std::vector<Eigen::Matrix4f> loadTransforms(const std::string &file_name);
+
+/**
+ * @brief Saves transforms to text file
+ * @details Format is compatible with loadTransforms.
+ *
+ * @param file_name file to write
+ * @param transforms transforms to save
+ * @throws std::runtime_error if the file could not be written
+ */
+void saveTransforms(const std::string &file_name,
+                    const std::vector<Eigen::Matrix4f> &transforms);
+
+/**
+ * @brief Accuracy of the estimated transforms
+ * @details Rotation errors are in radians, translation errors in the units of
+ * the maps.
+ */
+struct TransformsError {
+  /// number of maps with valid transform
+  size_t merged = 0;
+  double mean_rotation = 0.0;
+  double max_rotation = 0.0;
+  double mean_translation = 0.0;
+  double max_translation = 0.0;
+};
+
+/**
+ * @brief Compares estimated transforms with the ground truth
+ * @details Estimated transforms are relative to an arbitrary reference map,
+ * while the ground truth is usually relative to some world frame. Errors are
+ * therefore computed on relative transforms between the first merged map and
+ * each of the other merged maps. Maps with zero transform are skipped.
+ *
+ * @param estimated transforms from estimateMapsTransforms
+ * @param ground_truth transforms map -> world for each map
+ * @return errors of the estimated transforms
+ * @throws std::runtime_error if the sizes are not the same
+ */
+TransformsError
+evaluateTransforms(const std::vector<Eigen::Matrix4f> &estimated,
+                   const std::vector<Eigen::Matrix4f> &ground_truth);
+
+///@} group evaluation
+
+}  // namespace map_merge_3d
+
+#endif  // MAP_MERGE_EVALUATION_H_
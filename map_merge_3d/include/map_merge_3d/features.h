@@ -1,6 +1,8 @@
 #ifndef MAP_MERGE_FEATURES_H_
 #define MAP_MERGE_FEATURES_H_
 
+#include <vector>
+
 #include <map_merge_3d/enum.h>
 #include <map_merge_3d/typedefs.h>
 
@@ -17,7 +19,8 @@ namespace map_merge_3d
 
 /// @cond DOXYGEN_SKIP
 // define this for dispatch
-#define DESCRIPTORS_NAMES_ PFH, PFHRGB, FPFH, RSD, SHOT, SC3D
+#define DESCRIPTORS_NAMES_                                                     \
+  PFH, PFHRGB, FPFH, RSD, SHOT, SC3D, FAST_PFH, FAST_FPFH
 /// @endcond DOXYGEN_SKIP
 
 // define enum class Descriptor + string conversions
@@ -33,25 +36,39 @@ ENUM_CLASS(Descriptor, DESCRIPTORS_NAMES_);
  */
 PointCloudPtr downSample(const PointCloudConstPtr &input, double resolution);
 
+// define enum class OutlierFilter + string conversions
+ENUM_CLASS(OutlierFilter, RADIUS, VOXEL_GRID);
+
 /**
  * @brief Removes outliers from the pointcloud
- * @details Outliers with small number of neighbours will be removed.
+ * @details Outliers with small number of neighbours will be removed. RADIUS
+ * counts neighbours exactly with a radius search for each point. VOXEL_GRID
+ * counts points in cells of a voxel grid with cells of half the radius, the
+ * neighbourhood of a point are the cells whose centres are within the radius
+ * from the centre of its cell. This approximates the sphere well enough to
+ * remove statistically the same points in linear time.
  *
  * @param input input pointcloud
  * @param radius Area where neighbours will be counted
  * @param min_neighbours Minimal number of neighbours for the point to be kept
+ * @param method method of counting neighbours
  * @return filtered pointcloud
  */
 PointCloudPtr removeOutliers(const PointCloudConstPtr &input, double radius,
-                             int min_neighbours);
+                             int min_neighbours,
+                             OutlierFilter method = OutlierFilter::RADIUS);
 
 // define enum class Keypoint + string conversions
-ENUM_CLASS(Keypoint, SIFT, HARRIS);
+ENUM_CLASS(Keypoint, SIFT, HARRIS, FAST_SIFT);
 
 /**
  * @brief Detects keypoints in the pointcloud
  * @details Normals are used only for geometric keypoints (HARRIS). SIFT
- * keypoints requires valid colour information with points.
+ * keypoints requires valid colour information with points. FAST_SIFT detects
+ * the same keypoints as SIFT, extrema of the difference of Gaussians of point
+ * intensities in the scale space. Octaves are built by voxel downsampling,
+ * the neighbourhood of each point is searched once per octave and shared by
+ * all scales and by the extrema search, responses are computed in parallel.
  *
  * @param points input pointcloud
  * @param normals normals for input
@@ -60,12 +77,18 @@ ENUM_CLASS(Keypoint, SIFT, HARRIS);
  * @param radius area used for keypoint detection around each point
  * @param resolution smallest scale of the scale pyramid if the detector uses
  * one
+ * @param threads number of threads for FAST_SIFT, 0 for one thread per
+ * hardware thread
+ * @param scales if not null, set to the scale of each keypoint relative to
+ * resolution. Scale of SIFT keypoints is the standard deviation of the
+ * Gaussian they were detected at, HARRIS keypoints have all scale 1.
  * @return pointcloud of keypoints
  */
 PointCloudPtr detectKeypoints(const PointCloudConstPtr &points,
                               const SurfaceNormalsPtr &normals, Keypoint type,
                               double threshold, double radius,
-                              double resolution);
+                              double resolution, int threads = 1,
+                              std::vector<float> *scales = nullptr);
 
 /**
  * @brief Compute local feature descriptors around each keypoint.
@@ -78,24 +101,52 @@ PointCloudPtr detectKeypoints(const PointCloudConstPtr &points,
  * @param keypoints input detected keypoints, where descriptors will be computed
  * @param descriptor descriptor type to extract
  * @param feature_radius search radius for descriptors
+ * @param threads number of threads, 0 for one thread per hardware thread.
+ * Descriptors without parallel estimator in PCL are computed for chunks of
+ * keypoints in parallel.
+ * @return cloud of local descriptors
+ */
+LocalDescriptorsPtr computeLocalDescriptors(const PointCloudConstPtr &points,
+                                            const SurfaceNormalsPtr &normals,
+                                            const PointCloudPtr &keypoints,
+                                            Descriptor descriptor,
+                                            double feature_radius,
+                                            int threads = 1);
+
+/**
+ * @brief Compute local feature descriptors with radius adapted to the scale
+ * of keypoints.
+ * @details The same as computeLocalDescriptors, but descriptors of each
+ * keypoint are computed with radius feature_radius * scale. Keypoints are
+ * reordered by scale.
+ *
+ * @param points input pointcloud
+ * @param normals input normals for the cloud
+ * @param keypoints input detected keypoints, where descriptors will be computed
+ * @param descriptor descriptor type to extract
+ * @param feature_radius search radius for descriptors of scale 1
+ * @param threads number of threads, 0 for one thread per hardware thread
+ * @param scales relative scale of each keypoint as returned by detectKeypoints
  * @return cloud of local descriptors
  */
 LocalDescriptorsPtr computeLocalDescriptors(const PointCloudConstPtr &points,
                                             const SurfaceNormalsPtr &normals,
                                             const PointCloudPtr &keypoints,
                                             Descriptor descriptor,
-                                            double feature_radius);
+                                            double feature_radius, int threads,
+                                            const std::vector<float> &scales);
 
 /**
  * @brief Estimate cloud surface normals
  *
  * @param input input cloud
  * @param radius local neighbourhood size for estimating normals
+ * @param threads number of threads, 0 for one thread per hardware thread
  *
  * @return cloud of computed normals
  */
 SurfaceNormalsPtr computeSurfaceNormals(const PointCloudConstPtr &input,
-                                        double radius);
+                                        double radius, int threads = 1);
 
 ///@} group features
 
@@ -0,0 +1,233 @@
+#ifndef MAP_MERGE_INSTRUMENTATION_H_
+#define MAP_MERGE_INSTRUMENTATION_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace map_merge_3d
+{
+/**
+ * @defgroup instrumentation Instrumentation
+ * @brief Lightweight tracing of the merging pipeline.
+ * @details Records wall time, memory and counters (points, keypoints,
+ * correspondences, ...) for individual stages of the pipeline. Recorded events
+ * can be exported as Chrome trace JSON (viewable in chrome://tracing or
+ * Perfetto) or aggregated to per-stage statistics. Tracing is disabled by
+ * default and costs only a check of an atomic flag when disabled.
+ * @{
+ */
+
+/**
+ * @brief One recorded execution of a pipeline stage
+ * @details Times are in microseconds since the tracer was created, memory in
+ * bytes.
+ */
+struct TraceEvent {
+  std::string name;
+  std::string category;
+  int64_t start = 0;
+  int64_t duration = 0;
+  uint32_t thread = 0;
+  /// change of the resident memory during the stage
+  int64_t rss_delta = 0;
+  /// peak resident memory during the stage above the memory at its start
+  int64_t peak_rss = 0;
+  /// counters attached to the stage e.g. number of points
+  std::vector<std::pair<std::string, double>> counters;
+};
+
+/**
+ * @brief Aggregated statistics for all executions of one stage
+ * @details Times are in milliseconds, memory in bytes. Counters are summed
+ * over all calls.
+ */
+struct StageStatistics {
+  std::string name;
+  size_t calls = 0;
+  double total_time = 0.0;
+  double max_time = 0.0;
+  /// maximum over all calls
+  int64_t peak_rss = 0;
+  std::vector<std::pair<std::string, double>> counters;
+};
+
+/**
+ * @brief Collects trace events from all threads
+ * @details This class is thread-safe. Keeps at most capacity events, the
+ * oldest events are dropped.
+ */
+class Tracer
+{
+public:
+  Tracer();
+
+  /**
+   * @brief Tracer used by the library functions
+   */
+  static Tracer &global();
+
+  void setEnabled(bool enabled)
+  {
+    enabled_ = enabled;
+  }
+  bool isEnabled() const
+  {
+    return enabled_;
+  }
+  void setCapacity(size_t capacity);
+
+  /**
+   * @brief Time elapsed since the creation of the tracer in microseconds
+   */
+  int64_t now() const;
+
+  void record(TraceEvent event);
+  /**
+   * @brief Records a standalone counter sample (e.g. queue length)
+   */
+  void counter(const std::string &name, double value);
+  void clear();
+
+  std::vector<TraceEvent> events() const;
+  /**
+   * @brief Events recorded since the previous call with the same cursor
+   *
+   * @param cursor position in the stream of events, starts at 0 and is
+   * advanced past the returned events. Events dropped due to capacity are
+   * skipped.
+   */
+  std::vector<TraceEvent> events(uint64_t &cursor) const;
+  /**
+   * @brief Aggregates events that started at or after since
+   *
+   * @param since time in microseconds, see now()
+   * @return statistics ordered by the first occurrence of the stage
+   */
+  std::vector<StageStatistics> statistics(int64_t since = 0) const;
+  /**
+   * @brief Aggregates events of one thread that started at or after since
+   * @details Cycles of the pipeline run on their own threads, this separates
+   * concurrently running cycles.
+   *
+   * @param since time in microseconds, see now()
+   * @param thread id of the thread, see currentThread()
+   */
+  std::vector<StageStatistics> statistics(int64_t since,
+                                          uint32_t thread) const;
+  /**
+   * @brief Writes all events in Chrome trace event format (JSON)
+   */
+  void writeChromeTrace(std::ostream &stream) const;
+
+  /**
+   * @brief Id of the calling thread used in trace events
+   */
+  static uint32_t currentThread();
+
+private:
+  friend class ScopedTimer;
+
+  std::atomic<bool> enabled_;
+  std::chrono::steady_clock::time_point epoch_;
+  mutable std::mutex mutex_;
+  size_t capacity_;
+  std::deque<TraceEvent> events_;
+  // number of events recorded since creation, including dropped ones
+  uint64_t recorded_;
+
+  // peaks of running stages. peak resident memory of the process is reset
+  // when a stage starts, so the peak is tracked for each running stage
+  std::mutex stages_mutex_;
+  std::vector<int64_t *> stage_peaks_;
+  // false if the peak can't be reset, current memory is used instead
+  bool peak_reset_;
+
+  void beginStage(int64_t &rss, int64_t &peak);
+  void endStage(int64_t &rss, int64_t &peak);
+};
+
+/**
+ * @brief Streams trace events to a file in Chrome trace format
+ * @details Appends only events recorded since the last write. Uses the JSON
+ * array format, which trace viewers open even without the closing bracket, so
+ * the file is usable while the node is running. This class is thread-safe.
+ */
+class ChromeTraceWriter
+{
+public:
+  explicit ChromeTraceWriter(const std::string &path);
+  ~ChromeTraceWriter();
+
+  /**
+   * @brief Appends events recorded by the tracer since the last write
+   */
+  void write(const Tracer &tracer);
+
+private:
+  std::mutex mutex_;
+  std::ofstream stream_;
+  uint64_t cursor_;
+  bool empty_;
+};
+
+/**
+ * @brief Records execution of the enclosing scope as a trace event
+ * @details Records to Tracer::global(). Does nothing if the tracer is not
+ * enabled at the construction. Name and category must outlive the timer.
+ * Memory is measured for the whole process, stages running concurrently are
+ * included. Resets peak resident memory of the process.
+ */
+class ScopedTimer
+{
+public:
+  ScopedTimer(const char *name, const char *category = "map_merge");
+  ~ScopedTimer();
+  ScopedTimer(const ScopedTimer &) = delete;
+  ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+  /**
+   * @brief Attaches counter to the recorded event
+   */
+  void addCounter(const char *name, double value);
+
+private:
+  const char *name_;
+  const char *category_;
+  bool active_;
+  int64_t start_;
+  int64_t rss_start_;
+  int64_t peak_rss_;
+  std::vector<std::pair<std::string, double>> counters_;
+};
+
+/**
+ * @brief Current resident memory of the process in bytes or 0 if unknown
+ */
+int64_t residentMemory();
+
+/**
+ * @brief Peak resident memory of the process in bytes or 0 if unknown
+ */
+int64_t peakResidentMemory();
+
+/**
+ * @brief Resets peak resident memory to the current resident memory
+ * @details Supported only on Linux.
+ *
+ * @return true if the peak was reset
+ */
+bool resetPeakResidentMemory();
+
+///@} group instrumentation
+
+}  // namespace map_merge_3d
+
+#endif  // MAP_MERGE_INSTRUMENTATION_H_
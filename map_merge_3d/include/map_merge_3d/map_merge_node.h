@@ -2,15 +2,25 @@
 #define MAP_MERGE_MAP_MERGE_NODE_H_
 
 #include <atomic>
-#include <forward_list>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
 #include <mutex>
+#include <set>
 #include <thread>
 #include <unordered_map>
 
+#include <geometry_msgs/PoseStamped.h>
 #include <ros/ros.h>
 #include <tf2_ros/transform_broadcaster.h>
 
+#include <map_merge_3d/estimation_worker.h>
+#include <map_merge_3d/instrumentation.h>
 #include <map_merge_3d/map_merging.h>
+#include <map_merge_3d/multi_resolution_map.h>
+#include <map_merge_3d/state_store.h>
+#include <map_merge_3d/tiled_map.h>
 #include <map_merge_3d/typedefs.h>
 
 namespace map_merge_3d
@@ -26,19 +36,53 @@ namespace map_merge_3d
 /**
  * @brief ROS node class.
  * @details Runs robot discovery, transforms estimation and map compositing at
- * predefined rates (from ROS parameters). Does not spin on its own.
+ * predefined rates (from ROS parameters). Does not spin on its own, except for
+ * the transforms estimation, which runs in its own thread. Estimation can be
+ * alternatively triggered by significant changes of maps instead of the fixed
+ * rate.
  *
  */
 class MapMerge3d
 {
 private:
   struct MapSubscription {
+    // index of the map in discovery order
+    size_t index = 0;
     // protects map
     std::mutex mutex;
+    // whole map, built from chunks when needed
     PointCloudConstPtr map;
+    // map as received, either single whole map or accumulated updates
+    MapCompositor::MapChunks chunks;
     ros::Subscriber map_sub;
+    ros::Subscriber map_updates_sub;
+    // number of leading chunks downsampled to fit to memory budget. updates
+    // are appended after them
+    size_t downsampled_chunks = 0;
+    // map was dropped to fit to memory budget. updates are ignored until the
+    // next whole map, they would build a map without its history
+    bool evicted = false;
+    // current map extent. maintained only for change-triggered estimation
+    size_t points = 0;
+    Eigen::Vector3f min = Eigen::Vector3f::Zero();
+    Eigen::Vector3f max = Eigen::Vector3f::Zero();
+    // map extent when this map last triggered estimation
+    size_t trigger_points = 0;
+    Eigen::Vector3f trigger_min = Eigen::Vector3f::Zero();
+    Eigen::Vector3f trigger_max = Eigen::Vector3f::Zero();
   };
 
+  // immutable state of maps and transforms shared with readers
+  struct Snapshot {
+    // chunks of each map in discovery order
+    std::vector<MapCompositor::MapChunks> maps;
+    // frame of each map, empty if the map was not received yet
+    std::vector<std::string> frame_ids;
+    // transforms from the last estimation. may be shorter than maps
+    std::vector<Eigen::Matrix4f> transforms;
+  };
+  typedef std::shared_ptr<const Snapshot> SnapshotPtr;
+
   ros::NodeHandle node_;
 
   /* node parameters */
@@ -46,43 +90,141 @@ private:
   double discovery_rate_;
   double estimation_rate_;
   std::string robot_map_topic_;
+  std::string robot_map_updates_topic_;
   std::string robot_namespace_;
   std::string world_frame_;
+  std::string trace_file_;
+  bool publish_diagnostics_;
+  bool cancel_stale_estimation_;
+  // change-triggered estimation
+  bool estimate_on_change_;
+  double change_points_ratio_;
+  double change_bbox_growth_;
+  double change_delay_;
+  // memory budget for maps in MB
+  double max_maps_memory_;
+  double budget_resolution_;
+  // tiled output
+  double tile_size_;
+  double roi_radius_;
+  // persisted estimation state
+  std::string state_file_;
+  // robot whose map is the reference frame, empty for automatic selection
+  std::string reference_robot_;
   // compositing & estimation parameters
   MapMergingParams map_merge_params_;
+  // caches maps contributions to the merged map
+  MapCompositor compositor_;
 
   // publishing
   ros::Publisher merged_map_publisher_;
+  ros::Publisher diagnostics_publisher_;
+  // nullptr if trace_file_ is empty
+  std::unique_ptr<ChromeTraceWriter> trace_writer_;
+  ros::Publisher tiles_publisher_;
+  ros::Publisher roi_publisher_;
+  ros::Subscriber roi_subscriber_;
+  // coarser levels of detail of the merged map
+  std::vector<ros::Publisher> lod_publishers_;
   // periodical callbacks
   ros::Timer compositing_timer_;
   ros::Timer discovery_timer_;
   ros::Timer estimation_timer_;
+  // one-shot timer delaying change-triggered estimation
+  ros::Timer change_timer_;
+  std::mutex change_timer_mutex_;
+  bool change_pending_;
+  // used only from compositing. nullptr if levels of detail are disabled
+  std::unique_ptr<MultiResolutionMap> multi_resolution_map_;
+  // each finer level of detail is published this many times less often
+  int lod_publish_ratio_;
+  // whether level of detail changed since it was published, level 0 is the
+  // merged map. used only from compositing
+  std::vector<bool> lod_changed_;
+  uint64_t compositing_cycles_;
+  // merged map split to tiles. nullptr if tiles are disabled
+  std::unique_ptr<TiledMap> tiled_map_;
+  // protects tiled_map_, pending_tiles_ and region of interest
+  std::mutex tiled_map_mutex_;
+  // changed tiles and tiles for new subscribers that were not published yet
+  std::set<TiledMap::TileKey> pending_tiles_;
+  bool has_roi_;
+  Eigen::Vector3f roi_center_;
   // transforms for tf
   std::vector<geometry_msgs::TransformStamped> tf_transforms_;
   tf2_ros::TransformBroadcaster tf_publisher_;
   std::thread tf_thread_;             //  tf needs it own thread
-  std::atomic_flag tf_current_flag_;  // whether tf_transforms_ are up to date
-                                      // with transforms_
+  // snapshot tf_transforms_ were computed from
+  SnapshotPtr tf_snapshot_;
+  std::atomic<bool> tf_thread_running_;
 
-  // maps robots namespaces to maps. does not own
+  // maps robots namespaces to maps. does not own. written only by discovery,
+  // other threads read it under subscriptions_mutex_
   std::unordered_map<std::string, MapSubscription*> robots_;
-  // owns maps -- iterator safe
-  std::forward_list<MapSubscription> subscriptions_;
+  // owns maps -- iterator safe. maps are ordered by discovery
+  std::list<MapSubscription> subscriptions_;
   size_t subscriptions_size_;
   std::mutex subscriptions_mutex_;
-  // estimated transforms between maps
-  std::vector<Eigen::Matrix4f> transforms_;
-  std::mutex transforms_mutex_;
+  // serializes enforcing of the memory budget
+  std::mutex budget_mutex_;
+  // current snapshot. accessed only through std::atomic_load/atomic_store
+  SnapshotPtr snapshot_;
+  // serializes writers of snapshot_
+  std::mutex snapshot_mutex_;
+  // used only by estimation worker
+  EstimationContext estimation_context_;
+  // state saved by the previous run. used only by estimation worker
+  std::unique_ptr<StateStore> state_store_;
+  // content of maps in the last saved state. used only by estimation worker
+  std::vector<uint64_t> saved_state_;
+
+  // runs estimation outside of ROS callbacks. must be destroyed first as
+  // the running estimation uses other members
+  EstimationWorker estimation_worker_;
 
   std::string robotNameFromTopic(const std::string& topic);
   bool isRobotMapTopic(const ros::master::TopicInfo& topic);
   void mapUpdate(const PointCloud::ConstPtr& msg,
                  MapSubscription& subscription);
+  void mapDeltaUpdate(const PointCloud::ConstPtr& msg,
+                      MapSubscription& subscription);
+  void mapChanged(bool new_map, bool significant);
+  void enforceMemoryBudget();
+  SnapshotPtr getSnapshot() const;
+  void updateSnapshot(const std::function<void(Snapshot&)>& update);
+  void snapshotMap(const MapSubscription& subscription);
   void publishTF();
+  bool composeMergedMap();
+  bool isLevelDue(size_t level) const;
+  void publishTiles(const PointCloud& merged_map);
+  void publishROI();
+  void roiUpdate(const geometry_msgs::PoseStampedConstPtr& msg);
+  void estimateTransforms(const std::atomic<bool>& cancelled);
+  void saveState();
+  bool isSignificantChange(const PointCloud& update, bool replace,
+                           MapSubscription& subscription);
+  void scheduleEstimation();
+  void publishStatistics(const std::string& cycle_name, int64_t cycle_start,
+                         double cycle_duration, double cycle_period);
 
 public:
+  /**
+   * @brief Creates node using global and private node handles
+   */
   MapMerge3d();
 
+  /**
+   * @brief Creates node with given node handles
+   * @details Used when running inside of a nodelet manager.
+   *
+   * @param node node handle for topics
+   * @param private_nh node handle for parameters
+   */
+  MapMerge3d(const ros::NodeHandle& node, const ros::NodeHandle& private_nh);
+  ~MapMerge3d();
+  MapMerge3d(const MapMerge3d&) = delete;
+  MapMerge3d& operator=(const MapMerge3d&) = delete;
+
   /**
    * @brief Initiates discovery of new robots (maps) under current ROS core.
    * @details When new maps topics are found, there are added for merging. This
@@ -98,22 +240,26 @@ public:
   void mapCompositing();
 
   /**
-   * @brief Estimates transformations between maps
-   * @details This function is thread-safe
+   * @brief Requests estimation of transformations between maps
+   * @details Estimation runs asynchronously in a dedicated thread. At most one
+   * estimation runs at a time, requests made during a running estimation are
+   * coalesced into one estimation that runs after the current one finishes.
+   * This function is thread-safe and does not block.
    */
   void transformsEstimation();
 
   /**
    * @brief Get currently stored maps
    * @details This function is thread-safe
-   * @return all currently received maps
+   * @return all currently received maps. Maps that were not received yet are
+   * empty.
    */
   std::vector<PointCloudConstPtr> getMaps();
 
   /**
    * @brief Get currently stored transforms. For each map there should be a
    * transform between map and global reference frame.
-   * @details This function is thread-safe
+   * @details This function is thread-safe and does not block.
    * @return all currently estimated transforms. Zero Matrix if transform could
    * not be estimated.
    */
@@ -1,10 +1,18 @@
 #ifndef MAP_MERGE_MAP_MERGING_H_
 #define MAP_MERGE_MAP_MERGING_H_
 
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <ostream>
+#include <stdexcept>
+#include <unordered_map>
+
+#include <Eigen/Geometry>
 
 #include <map_merge_3d/features.h>
 #include <map_merge_3d/matching.h>
+#include <map_merge_3d/submaps.h>
 #include <map_merge_3d/typedefs.h>
 
 #include <ros/ros.h>
@@ -42,6 +50,25 @@ struct MapMergingParams {
   double transform_epsilon = 1e-2;
   double confidence_threshold = 0.0;
   double output_resolution = 0.05;
+  bool tracking = false;
+  double tracking_score_ratio = 2.0;
+  int pose_graph_iterations = 20;
+  double pose_graph_kernel_width = inlier_threshold;
+  bool filter_inconsistent_loops = true;
+  double loop_translation_tolerance = inlier_threshold;
+  double loop_rotation_tolerance = 0.1;
+  bool prune_implied_pairs = false;
+  bool keep_reference_frame = true;
+  double transform_translation_tolerance = output_resolution * 0.5;
+  double transform_rotation_tolerance = 0.001;
+  double submap_size = 0.0;
+  double submap_overlap = descriptor_radius * 4.0;
+  OutlierFilter outliers_filter = OutlierFilter::RADIUS;
+  int feature_threads = 0;
+  bool adaptive_descriptor_radius = false;
+  int submap_candidates = 8;
+  double submap_translation_tolerance = inlier_threshold;
+  double submap_rotation_tolerance = 0.1;
 
   /**
    * @brief Sources parameters from command line arguments
@@ -70,10 +97,80 @@ struct MapMergingParams {
 };
 std::ostream &operator<<(std::ostream &stream, const MapMergingParams &params);
 
+/**
+ * @brief Features extracted from one input cloud for the registration
+ */
+struct MapFeatures {
+  /// cloud the features were computed from
+  PointCloudConstPtr source;
+  /// content hash of source, see cloudHash
+  uint64_t hash = 0;
+  /// cloud downsampled to the registration resolution without outliers
+  PointCloudPtr cloud;
+  /// empty when features were computed submap by submap
+  SurfaceNormalsPtr normals;
+  PointCloudPtr keypoints;
+  LocalDescriptorsPtr descriptors;
+  /// parts of the map registered separately when
+  /// MapMergingParams::submap_size is set. Computed only when needed.
+  std::vector<Submap> submaps;
+};
+
+class RegistrationWorkers;
+
+/**
+ * @brief Additional inputs and outputs of estimateMapsTransforms
+ * @details Holds intermediate results of the estimation that might be useful
+ * to inspect the estimation process. When the same context is reused for
+ * repeated estimations, features of clouds that did not change are reused
+ * together with pairwise estimates between them. Context can be persisted
+ * with StateStore.
+ */
+struct EstimationContext {
+  /// pairwise estimates computed during the estimation. Indices in the
+  /// estimates refer to indices of the input clouds.
+  std::vector<TransformEstimate> pairwise_estimates;
+  /// features of the input clouds. Features are recomputed only for clouds
+  /// that are not the same object as the source of the cached features.
+  /// Clear when estimation parameters change.
+  std::vector<MapFeatures> features;
+  /// global transforms from the last estimation. Used as initial guesses for
+  /// tracking when MapMergingParams::tracking is enabled.
+  std::vector<Eigen::Matrix4f> transforms;
+  /// index of the cloud used as the reference frame by the last estimation,
+  /// NO_REFERENCE if no cloud was merged. Kept by the next estimation when
+  /// MapMergingParams::keep_reference_frame is enabled.
+  size_t reference_frame = NO_REFERENCE;
+  /// index of the cloud to use as the reference frame whenever it is merged
+  /// with other clouds, NO_REFERENCE to select the reference automatically
+  size_t pinned_reference_frame = NO_REFERENCE;
+  /// polled during the estimation. If it returns true, the estimation is
+  /// aborted with EstimationCancelled exception.
+  std::function<bool()> is_cancelled;
+  /// registers pairs of maps from scratch in worker processes when there are
+  /// any live workers. Set to distribute the estimation.
+  std::shared_ptr<RegistrationWorkers> workers;
+
+  /// no reference frame selected
+  static const size_t NO_REFERENCE;
+};
+
+/**
+ * @brief Thrown when the estimation was cancelled through EstimationContext
+ */
+class EstimationCancelled : public std::runtime_error
+{
+public:
+  EstimationCancelled() : std::runtime_error("estimation cancelled")
+  {
+  }
+};
+
 /**
  * @brief Estimate transformations between n pointclouds
  * @details Estimation is based on overlapping space. One of the pointclouds
- * will be selected as the reference frame for all the transformations.
+ * will be selected as the reference frame for all the transformations. The
+ * center of the maximum spanning tree of pairwise estimates is selected.
  *
  * @param clouds input pointclouds
  * @param params parameters for estimation
@@ -86,6 +183,69 @@ std::vector<Eigen::Matrix4f>
 estimateMapsTransforms(const std::vector<PointCloudConstPtr> &clouds,
                        const MapMergingParams &params);
 
+/**
+ * @brief Estimate transformations between n pointclouds
+ * @details The same as estimateMapsTransforms, but stores intermediate results
+ * in the context. The estimation can be cancelled through the context.
+ *
+ * The reference frame is the pinned reference frame of the context if set,
+ * otherwise the reference frame of the previous estimation if
+ * MapMergingParams::keep_reference_frame is set. Transforms that changed less
+ * than MapMergingParams::transform_translation_tolerance and
+ * MapMergingParams::transform_rotation_tolerance since the previous
+ * estimation in the same reference frame are returned exactly as before, so
+ * that consumers can skip maps with unchanged transforms by comparing them.
+ *
+ * @param clouds input pointclouds
+ * @param params parameters for estimation
+ * @param context receives pairwise estimates with registration statistics
+ * @throws EstimationCancelled if the estimation was cancelled
+ *
+ * @return Estimated transformations pointcloud -> reference frame for each
+ * input pointcloud. If the transformation could not estimated, the
+ * transformation will be zero matrix for the respective pointcloud.
+ */
+std::vector<Eigen::Matrix4f>
+estimateMapsTransforms(const std::vector<PointCloudConstPtr> &clouds,
+                       const MapMergingParams &params,
+                       EstimationContext &context);
+
+/**
+ * @brief Estimates transform between two maps from scratch
+ * @details Feature-based registration used by estimateMapsTransforms for pairs
+ * of maps that cannot be tracked. Registers submaps against submaps when
+ * MapMergingParams::submap_size is set, submaps of both maps must be computed
+ * then. Only MapMergingParams::submap_candidates pairs of submaps with most
+ * keypoint matches are registered.
+ *
+ * @param source features of the source map
+ * @param target features of the target map
+ * @param params parameters for estimation
+ * @param is_cancelled polled during the registration of submaps
+ * @throws EstimationCancelled if the estimation was cancelled
+ *
+ * @return estimate source -> target. Indices of the estimate are zero.
+ */
+TransformEstimate
+estimatePairTransform(const MapFeatures &source, const MapFeatures &target,
+                      const MapMergingParams &params,
+                      const std::function<bool()> &is_cancelled = {});
+
+/**
+ * @brief Checks whether the global transform of a map changed
+ * @details Compares the relative transform between previous and current
+ * transform. Zero transforms are considered equal only to each other.
+ *
+ * @param previous previous transform map -> reference frame
+ * @param current current transform map -> reference frame
+ * @param translation_tolerance maximum translation of the relative transform
+ * @param rotation_tolerance maximum rotation angle of the relative transform
+ * @return true if the transform changed more than tolerances
+ */
+bool transformChanged(const Eigen::Matrix4f &previous,
+                      const Eigen::Matrix4f &current,
+                      double translation_tolerance, double rotation_tolerance);
+
 /**
  * @brief Composes the global map
  * @details Pointclouds with zero transformation will be skipped.
@@ -100,6 +260,115 @@ PointCloudPtr composeMaps(const std::vector<PointCloudConstPtr> &clouds,
                           const std::vector<Eigen::Matrix4f> &transforms,
                           double resolution);
 
+/**
+ * @brief Composes the global map incrementally
+ * @details Keeps contribution of each map to the global map between calls.
+ * Only maps with changed transform or content are processed again. Maps can be
+ * given in chunks, if the map grows by appending new chunks, only new chunks
+ * are processed. Contributions are kept as sums of points in voxels of the
+ * output grid, so the result is the same as composing all points at once.
+ */
+class MapCompositor
+{
+public:
+  /// map given as a sequence of immutable chunks of points
+  typedef std::vector<PointCloudConstPtr> MapChunks;
+
+  /**
+   * @brief Creates compositor
+   *
+   * @param resolution resolution of the output pointcloud
+   */
+  explicit MapCompositor(double resolution);
+
+  /**
+   * @brief Composes the global map
+   * @details The same as composeMaps, but reuses the work from previous calls.
+   * Map is considered unchanged if it is the same object as in the previous
+   * call.
+   *
+   * @param clouds input clouds
+   * @param transforms estimated transformations between input clouds
+   * @return the global map or nullptr if the input is empty
+   */
+  PointCloudPtr compose(const std::vector<PointCloudConstPtr> &clouds,
+                        const std::vector<Eigen::Matrix4f> &transforms);
+
+  /**
+   * @brief Composes the global map from maps given in chunks
+   * @details Chunks already processed in previous calls are skipped as long
+   * as the chunks from the previous call are prefix of the current chunks.
+   *
+   * @param maps input maps in chunks
+   * @param transforms estimated transformations between input maps
+   * @return the global map or nullptr if the input is empty. The same cloud
+   * as in the previous call if nothing changed.
+   */
+  PointCloudPtr compose(const std::vector<MapChunks> &maps,
+                        const std::vector<Eigen::Matrix4f> &transforms);
+
+  /**
+   * @brief Drops all cached contributions
+   */
+  void clear();
+
+  /**
+   * @brief Region where the global map changed in the last compose call
+   * @details Points of the global map outside of the region are the same as
+   * in the previous call. Empty if nothing changed.
+   */
+  const Eigen::AlignedBox3f &changedRegion() const
+  {
+    return changed_region_;
+  }
+
+private:
+  struct VoxelKey {
+    int x;
+    int y;
+    int z;
+
+    bool operator==(const VoxelKey &other) const
+    {
+      return x == other.x && y == other.y && z == other.z;
+    }
+  };
+  struct VoxelKeyHash {
+    size_t operator()(const VoxelKey &key) const
+    {
+      return size_t(key.x) * 73856093u ^ size_t(key.y) * 19349663u ^
+             size_t(key.z) * 83492791u;
+    }
+  };
+  /// sums of points in a voxel, the output point is their centroid
+  struct Voxel {
+    Eigen::Vector3d position = Eigen::Vector3d::Zero();
+    Eigen::Vector4d colour = Eigen::Vector4d::Zero();
+    size_t count = 0;
+  };
+  typedef std::unordered_map<VoxelKey, Voxel, VoxelKeyHash> Voxels;
+
+  struct Contribution {
+    MapChunks chunks;
+    Eigen::Matrix4f transform = Eigen::Matrix4f::Zero();
+    Voxels voxels;
+    Eigen::AlignedBox3f bounds;
+  };
+
+  double resolution_;
+  std::vector<Contribution> contributions_;
+  // sum of all contributions
+  Voxels voxels_;
+  // result of the last call
+  PointCloudPtr result_;
+  Eigen::AlignedBox3f changed_region_;
+  // contributions dropped by clear()
+  Eigen::AlignedBox3f cleared_region_;
+
+  void addPoints(Contribution &contribution, const PointCloud &points);
+  void removeContribution(Contribution &contribution);
+};
+
 ///@} group map_merging
 
 }  // namespace map_merge_3d
@@ -1,6 +1,8 @@
 #ifndef MAP_MERGE_MATCHING_H_
 #define MAP_MERGE_MATCHING_H_
 
+#include <ostream>
+
 #include <map_merge_3d/enum.h>
 #include <map_merge_3d/typedefs.h>
 
@@ -102,6 +104,66 @@ Eigen::Matrix4f estimateTransformICP(const PointCloudPtr &source_points,
 // defines enum class EstimationMethod + string conversions
 ENUM_CLASS(EstimationMethod, MATCHING, SAC_IA);
 
+/**
+ * @brief Result of the pairwise registration
+ * @details Besides the estimated transformation holds quality metrics and wall
+ * times of individual stages of the registration. Times are in milliseconds.
+ * Stages that were not run have zero time.
+ */
+struct RegistrationResult {
+  /// estimated transform or zero matrix if it could not be estimated
+  Eigen::Matrix4f transform = Eigen::Matrix4f::Zero();
+  /// number of feature correspondences (MATCHING only)
+  size_t correspondences = 0;
+  /// number of correspondences consistent with initial transform (MATCHING
+  /// only)
+  size_t inliers = 0;
+  /// number of iterations performed by ICP
+  int icp_iterations = 0;
+  /// whether ICP converged
+  bool icp_converged = false;
+  /// euclidean score of the final transform, see transformScore
+  double score = 0.0;
+
+  double matching_time = 0.0;
+  double initial_alignment_time = 0.0;
+  double refinement_time = 0.0;
+  double scoring_time = 0.0;
+
+  /**
+   * @brief Total time spent in the registration
+   */
+  double totalTime() const
+  {
+    return matching_time + initial_alignment_time + refinement_time +
+           scoring_time;
+  }
+};
+std::ostream &operator<<(std::ostream &stream,
+                         const RegistrationResult &result);
+
+/**
+ * @brief Represents transformation estimate between 2 clouds
+ */
+struct TransformEstimate {
+  TransformEstimate() = default;
+  TransformEstimate(size_t source_idx_, size_t target_idx_)
+    : source_idx(source_idx_), target_idx(target_idx_)
+  {
+  }
+
+  size_t source_idx;  // source cloud index
+  size_t target_idx;
+
+  Eigen::Matrix4f transform;
+  double confidence = 0.0;
+  /// details of the registration that produced transform
+  RegistrationResult registration;
+  /// score of the last global registration of the pair, tracked estimates
+  /// keep the score of the registration they started from
+  double global_score = 0.0;
+};
+
 /**
  * @brief Estimate transformation between two pointclouds
  * @details Uses extracted features to estimate rigid transformation. First the
@@ -123,10 +185,11 @@ ENUM_CLASS(EstimationMethod, MATCHING, SAC_IA);
  * @param max_iterations maximum iterations for RANSAC
  * @param matching_k number of nearest descriptors to consider for matching
  * @param transform_epsilon the smallest change allowed until ICP convergence.
- * @return estimated rigid transform between source and target pointclouds or
- * zero matrix if the transformation could not be estimated
+ * @return registration result with estimated rigid transform between source
+ * and target pointclouds (zero matrix if the transformation could not be
+ * estimated) and statistics of the registration. Score is not computed.
  */
-Eigen::Matrix4f estimateTransform(
+RegistrationResult estimateTransform(
     const PointCloudPtr &source_points, const PointCloudPtr &source_keypoints,
     const LocalDescriptorsPtr &source_descriptors,
     const PointCloudPtr &target_points, const PointCloudPtr &target_keypoints,
@@ -134,6 +197,31 @@ Eigen::Matrix4f estimateTransform(
     bool refine, double inlier_threshold, double max_correspondence_distance,
     int max_iterations, size_t matching_k, double transform_epsilon);
 
+/**
+ * @brief Refine known transformation between two pointclouds
+ * @details Runs only ICP starting from the initial guess, no features are
+ * needed. Suitable for tracking transformation that is already approximately
+ * known, e.g. from the previous estimation.
+ *
+ * @param source_points Source pointcloud
+ * @param target_points Target pointcloud
+ * @param initial_guess approximate transformation between source and target
+ * @param inlier_threshold Threshold for outliers rejection in ICP
+ * @param max_correspondence_distance Maximum distance for a matched points to
+ * be considered the same point
+ * @param max_iterations maximum iterations for ICP
+ * @param transform_epsilon the smallest change allowed until ICP convergence.
+ * @return registration result with refined transform and ICP statistics.
+ * Score is not computed.
+ */
+RegistrationResult refineTransform(const PointCloudPtr &source_points,
+                                   const PointCloudPtr &target_points,
+                                   const Eigen::Matrix4f &initial_guess,
+                                   double inlier_threshold,
+                                   double max_correspondence_distance,
+                                   int max_iterations,
+                                   double transform_epsilon);
+
 /**
  * @brief Computes euclidean distance between two pointclouds.
  * @details Computes a euclidean score for an estimated transformation. Because
@@ -0,0 +1,103 @@
+#ifndef MAP_MERGE_MULTI_RESOLUTION_MAP_H_
+#define MAP_MERGE_MULTI_RESOLUTION_MAP_H_
+
+#include <vector>
+
+#include <pcl/octree/octree_search.h>
+
+#include <map_merge_3d/typedefs.h>
+
+namespace map_merge_3d
+{
+/**
+ * @addtogroup map_merging
+ * @{
+ */
+
+/**
+ * @brief Global map with multiple levels of detail
+ * @details Level 0 is the map at the base resolution, each following level
+ * has twice the voxel size of the previous one. Voxel grids of all levels
+ * are aligned to the origin, so the voxels of level k+1 are exactly octree
+ * parents of voxels of level k and each level is a centroid of its children.
+ * Levels can be searched spatially through octrees built on demand.
+ */
+class MultiResolutionMap
+{
+public:
+  /**
+   * @brief Creates empty map
+   *
+   * @param resolution resolution of the finest level
+   * @param levels number of levels including the finest one
+   */
+  MultiResolutionMap(double resolution, size_t levels);
+
+  /**
+   * @brief Replaces the map
+   * @details Coarser levels are computed from the finest level.
+   *
+   * @param map map at the finest resolution, already voxelized to
+   * resolution
+   */
+  void update(const PointCloudPtr &map);
+
+  /**
+   * @brief Number of levels
+   */
+  size_t levels() const
+  {
+    return levels_.size();
+  }
+
+  /**
+   * @brief Voxel size of the level
+   */
+  double resolution(size_t level) const;
+
+  /**
+   * @brief The finest level that is at most as detailed as required
+   *
+   * @param resolution required resolution
+   * @return level with voxel size at least resolution or the coarsest level
+   */
+  size_t levelForResolution(double resolution) const;
+
+  /**
+   * @brief Map at the level of detail
+   *
+   * @param level level index, 0 is the finest
+   * @return map at the level, empty map if update was not called yet
+   */
+  PointCloudConstPtr level(size_t level) const;
+
+  /**
+   * @brief Points within radius around center at the level of detail
+   * @details Octree of the level is built on the first query after update.
+   * Not thread-safe.
+   *
+   * @param center center of the query
+   * @param radius radius of the query
+   * @param level level index, 0 is the finest
+   * @return found points
+   */
+  PointCloudPtr radiusSearch(const Eigen::Vector3f &center, double radius,
+                             size_t level);
+
+private:
+  typedef pcl::octree::OctreePointCloudSearch<PointT> Octree;
+
+  struct Level {
+    PointCloudPtr points;
+    Octree::Ptr octree;
+  };
+
+  double resolution_;
+  std::vector<Level> levels_;
+};
+
+///@} group map_merging
+
+}  // namespace map_merge_3d
+
+#endif  // MAP_MERGE_MULTI_RESOLUTION_MAP_H_
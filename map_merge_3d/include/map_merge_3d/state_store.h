@@ -0,0 +1,114 @@
+#ifndef MAP_MERGE_STATE_STORE_H_
+#define MAP_MERGE_STATE_STORE_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <map_merge_3d/map_merging.h>
+#include <map_merge_3d/typedefs.h>
+
+namespace map_merge_3d
+{
+/**
+ * @addtogroup map_merging
+ * @{
+ */
+
+/**
+ * @brief Computes hash of the map content
+ * @details FNV-1a over coordinates and colour of all points. Used to recognise
+ * the same map across runs.
+ *
+ * @param cloud input map
+ * @return content hash
+ */
+uint64_t cloudHash(const PointCloud &cloud);
+
+/**
+ * @brief Estimation state persisted on disk
+ * @details Stores features of maps and pairwise estimates between them from
+ * EstimationContext, so that a restarted estimation does not need to compute
+ * them again. Maps are identified by their content hash, estimates by hashes
+ * of both maps.
+ *
+ * The file is versioned and is valid only for the same registration
+ * parameters it was saved with. All records are 8-byte aligned, the file is
+ * memory-mapped when loaded and only records of maps that are actually
+ * restored are read.
+ */
+class StateStore
+{
+public:
+  /// version of the file format
+  static const uint32_t VERSION;
+
+  /**
+   * @brief Opens saved state
+   * @details Throws std::runtime_error if the file cannot be read, has
+   * incompatible version or was saved with different parameters.
+   *
+   * @param path file saved by save
+   * @param params registration parameters of the current estimation
+   */
+  StateStore(const std::string &path, const MapMergingParams &params);
+  ~StateStore();
+  StateStore(const StateStore &) = delete;
+  StateStore &operator=(const StateStore &) = delete;
+
+  /**
+   * @brief Number of maps in the store
+   */
+  size_t size() const
+  {
+    return maps_.size();
+  }
+
+  /**
+   * @brief Restores features and estimates of known maps to the context
+   * @details Features are restored for clouds that have no current features
+   * in the context and whose content matches a stored map. Pairwise estimates
+   * are restored between maps with matching content, unless the context
+   * already has an estimate for the pair. Intended to be called before
+   * estimateMapsTransforms with the same clouds.
+   *
+   * @param clouds input clouds of the next estimation
+   * @param context context of the next estimation
+   * @return number of maps with restored features
+   */
+  size_t restore(const std::vector<PointCloudConstPtr> &clouds,
+                 EstimationContext &context) const;
+
+  /**
+   * @brief Saves features and estimates from the context
+   * @details The file is replaced atomically. Throws std::runtime_error if
+   * the file cannot be written.
+   *
+   * @param path output file
+   * @param params registration parameters the context was computed with
+   * @param context context after estimateMapsTransforms
+   */
+  static void save(const std::string &path, const MapMergingParams &params,
+                   const EstimationContext &context);
+
+private:
+  class MappedFile;
+  struct StoredEstimate {
+    uint64_t source_hash;
+    uint64_t target_hash;
+    TransformEstimate estimate;
+  };
+
+  std::unique_ptr<MappedFile> file_;
+  // content hash -> offset of the map record in the file
+  std::unordered_map<uint64_t, size_t> maps_;
+  std::vector<StoredEstimate> estimates_;
+};
+
+///@} group map_merging
+
+}  // namespace map_merge_3d
+
+#endif  // MAP_MERGE_STATE_STORE_H_
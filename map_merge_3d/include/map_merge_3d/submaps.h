@@ -0,0 +1,113 @@
+#ifndef MAP_MERGE_SUBMAPS_H_
+#define MAP_MERGE_SUBMAPS_H_
+
+#include <utility>
+#include <vector>
+
+#include <map_merge_3d/matching.h>
+#include <map_merge_3d/typedefs.h>
+
+namespace map_merge_3d
+{
+/**
+ * @addtogroup map_merging
+ * @{
+ */
+
+/**
+ * @brief Part of a map registered separately
+ * @details Keypoints and descriptors are the subset of the map's keypoints
+ * and descriptors that lie in the submap. Points of the submap are extracted
+ * only when the submap is registered, see extractSubmapCloud.
+ */
+struct Submap {
+  /// cell of the submap in the grid of submaps
+  int x = 0;
+  int y = 0;
+  /// indices of keypoints of the map in the submap
+  std::vector<size_t> keypoint_indices;
+  PointCloudPtr keypoints;
+  LocalDescriptorsPtr descriptors;
+};
+
+/**
+ * @brief Splits registration features of a map to overlapping submaps
+ * @details Submaps are square columns of submap_size x submap_size meters in
+ * the horizontal plane, aligned with the origin the same way as tiles of
+ * TiledMap. Each submap is extended by overlap meters to all sides, so that
+ * an area seen by two maps is fully contained in some pair of submaps.
+ *
+ * @param keypoints keypoints of the map
+ * @param descriptors descriptors of keypoints, one per keypoint
+ * @param submap_size size of the submap side in meters
+ * @param overlap extension of each submap in meters
+ * @param min_keypoints submaps with fewer keypoints are dropped as too small
+ * to be registered
+ * @return submaps ordered by their position in the grid
+ */
+std::vector<Submap>
+partitionToSubmaps(const PointCloudConstPtr &keypoints,
+                   const LocalDescriptorsConstPtr &descriptors,
+                   double submap_size, double overlap,
+                   size_t min_keypoints = 10);
+
+/**
+ * @brief Points of the map in the submap including its overlap
+ *
+ * @param cloud registration cloud of the map
+ * @param submap submap from partitionToSubmaps
+ * @param submap_size the same as for partitionToSubmaps
+ * @param overlap the same as for partitionToSubmaps
+ * @return points of the submap
+ */
+PointCloudPtr extractSubmapCloud(const PointCloudConstPtr &cloud,
+                                 const Submap &submap, double submap_size,
+                                 double overlap);
+
+/**
+ * @brief Selects pairs of submaps worth registering
+ * @details Each correspondence between keypoints of two maps votes for all
+ * pairs of submaps containing its keypoints. Submaps of overlapping areas
+ * share many correspondences, so only the most voted pairs are registered.
+ *
+ * @param source_submaps submaps of the source map
+ * @param target_submaps submaps of the target map
+ * @param correspondences correspondences between keypoints of the maps
+ * @param max_pairs maximum number of returned pairs
+ * @param min_votes pairs with fewer votes can't determine a transform
+ * @return pairs of indices to source_submaps and target_submaps, the most
+ * voted first
+ */
+std::vector<std::pair<size_t, size_t>>
+selectSubmapPairs(const std::vector<Submap> &source_submaps,
+                  const std::vector<Submap> &target_submaps,
+                  const Correspondences &correspondences, size_t max_pairs,
+                  size_t min_votes = 3);
+
+/**
+ * @brief Aggregates estimates between submaps of two maps
+ * @details Each estimate is supported by all estimates with a similar
+ * transform, weighted by their inliers. Wrong matches of repetitive
+ * structures usually disagree with each other, so the estimate with the
+ * largest support is returned. Inliers and correspondences of the result are
+ * summed over the supporting estimates and its score is their weighted mean
+ * score, so the confidence is the same measure as for whole maps.
+ *
+ * @param submap_estimates estimates between pairs of submaps
+ * @param translation_tolerance maximum translation difference of similar
+ * transforms
+ * @param rotation_tolerance maximum rotation angle difference of similar
+ * transforms
+ * @return the best supported estimate, zero transform with zero confidence if
+ * there are no valid estimates. Indices are copied from the estimate.
+ */
+TransformEstimate
+aggregateSubmapEstimates(const std::vector<TransformEstimate> &submap_estimates,
+                         double translation_tolerance,
+                         double rotation_tolerance);
+
+///@} group map_merging
+
+}  // namespace map_merge_3d
+
+#endif  // MAP_MERGE_SUBMAPS_H_
@@ -0,0 +1,109 @@
+#ifndef MAP_MERGE_SYNTHETIC_H_
+#define MAP_MERGE_SYNTHETIC_H_
+
+#include <vector>
+
+#include <map_merge_3d/typedefs.h>
+
+namespace map_merge_3d
+{
+/**
+ * @defgroup synthetic Synthetic maps
+ * @brief Generating synthetic multi-robot maps with known ground truth.
+ * @details Procedural scenes can be cut into overlapping partial maps as they
+ * would be produced by multiple robots. Each partial map is expressed in its
+ * own frame given by a random rigid transform and can be degraded by noise,
+ * density variation and colour changes. Useful for reproducible testing and
+ * benchmarking without real robot data.
+ * @{
+ */
+
+/**
+ * @brief Parameters of the procedural scene
+ * @details Scene is a rectangular area with walls on the borders and randomly
+ * placed coloured boxes. Units are meters.
+ */
+struct SceneParams {
+  double size_x = 20.0;
+  double size_y = 20.0;
+  double height = 3.0;
+  /// number of boxes per square meter
+  double obstacles_density = 0.1;
+  /// total number of points in the scene
+  size_t points = 1000000;
+  unsigned seed = 42;
+};
+
+/**
+ * @brief Generates procedural scene
+ *
+ * @param params scene parameters
+ * @return scene pointcloud starting at the origin
+ */
+PointCloudPtr generateScene(const SceneParams &params);
+
+/**
+ * @brief Parameters for cutting a scene into partial maps
+ */
+struct PartialMapsParams {
+  /// number of partial maps
+  size_t maps = 2;
+  /// size of the square area covered by each map
+  double map_size = 10.0;
+  /// overlap between neighbouring maps as a fraction of map_size
+  double overlap = 0.5;
+  /// standard deviation of gaussian noise added to points positions
+  double noise = 0.01;
+  /// each map keeps randomly between (1 - density_variation) and 1 of points
+  double density_variation = 0.3;
+  /// standard deviation of the brightness change of the whole map
+  double colour_variation = 10.0;
+  /// maximum rotation of the map frame around the vertical axis
+  double max_rotation = 3.14159265358979323846;
+  /// maximum rotation of the map frame around the horizontal axes
+  double max_tilt = 0.0;
+  /// maximum translation of the map frame along each horizontal axis
+  double max_translation = 10.0;
+  unsigned seed = 42;
+};
+
+/**
+ * @brief Partial maps with ground truth
+ */
+struct PartialMaps {
+  /// maps in their own frames
+  std::vector<PointCloudPtr> maps;
+  /// transforms map -> scene frame for each map
+  std::vector<Eigen::Matrix4f> ground_truth;
+};
+
+/**
+ * @brief Scene size needed to cut the requested number of partial maps
+ * @details Maps are placed on a regular grid. Returned scene params have size
+ * set to fit the grid, other members are copied from scene.
+ *
+ * @param scene base scene parameters
+ * @param params partial maps parameters
+ * @return scene parameters with adjusted size
+ */
+SceneParams sceneForPartialMaps(const SceneParams &scene,
+                                const PartialMapsParams &params);
+
+/**
+ * @brief Cuts scene into overlapping partial maps
+ * @details Maps are cut on a regular grid starting at the minimum of the scene
+ * bounding box, neighbouring maps overlap by overlap fraction. Maps outside of
+ * the scene are empty.
+ *
+ * @param scene input scene, can be generated or loaded
+ * @param params partial maps parameters
+ * @return partial maps and their ground truth transforms
+ */
+PartialMaps generatePartialMaps(const PointCloudConstPtr &scene,
+                                const PartialMapsParams &params);
+
+///@} group synthetic
+
+}  // namespace map_merge_3d
+
+#endif  // MAP_MERGE_SYNTHETIC_H_
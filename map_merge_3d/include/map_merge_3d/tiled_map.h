@@ -0,0 +1,109 @@
+#ifndef MAP_MERGE_TILED_MAP_H_
+#define MAP_MERGE_TILED_MAP_H_
+
+#include <cstdint>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <Eigen/Geometry>
+
+#include <map_merge_3d/typedefs.h>
+
+namespace map_merge_3d
+{
+/**
+ * @addtogroup map_merging
+ * @{
+ */
+
+/**
+ * @brief Global map split to square tiles in the horizontal plane
+ * @details Tiles are columns of tile_size x tile_size meters, tile (0, 0)
+ * starts at the origin. Keeps track of the content of each tile, so that
+ * tiles changed by the last update can be published separately.
+ */
+class TiledMap
+{
+public:
+  /// tile coordinates (x, y) in the tile grid
+  typedef std::pair<int, int> TileKey;
+
+  /**
+   * @brief Creates empty tiled map
+   *
+   * @param tile_size size of the tile side in meters
+   */
+  explicit TiledMap(double tile_size);
+
+  /**
+   * @brief Replaces content of the map
+   * @details Tiles that contain no points after the update are removed.
+   *
+   * @param map new map
+   * @return tiles that were added, removed or whose content changed
+   */
+  std::vector<TileKey> update(const PointCloud &map);
+
+  /**
+   * @brief Replaces content of the map in the changed region
+   * @details Only tiles intersecting the region in the horizontal plane are
+   * rebuilt, other tiles are kept. Points of the map outside of the region
+   * must be the same as in the previous update.
+   *
+   * @param map new map
+   * @param region region where the map changed, see
+   * MapCompositor::changedRegion()
+   * @return tiles that were added, removed or whose content changed
+   */
+  std::vector<TileKey> update(const PointCloud &map,
+                              const Eigen::AlignedBox3f &region);
+
+  /**
+   * @brief Points of the tile
+   *
+   * @param key tile coordinates
+   * @return tile points or nullptr if the tile does not exist
+   */
+  PointCloudConstPtr tile(const TileKey &key) const;
+
+  /**
+   * @brief Tile containing the point
+   */
+  TileKey tileKey(float x, float y) const;
+
+  /**
+   * @brief All tiles of the map
+   */
+  std::vector<TileKey> tiles() const;
+
+  /**
+   * @brief Points in the region of interest
+   * @details Region is a vertical cylinder, only tiles intersecting the
+   * region are searched.
+   *
+   * @param center center of the region
+   * @param radius radius of the region in the horizontal plane
+   * @return points within radius from center in the horizontal plane
+   */
+  PointCloudPtr regionOfInterest(const Eigen::Vector3f &center,
+                                 double radius) const;
+
+private:
+  struct Tile {
+    PointCloudPtr points;
+    uint64_t hash;
+  };
+
+  double tile_size_;
+  std::map<TileKey, Tile> tiles_;
+
+  std::vector<TileKey> updateTiles(const PointCloud &map,
+                                   const Eigen::AlignedBox3f *region);
+};
+
+///@} group map_merging
+
+}  // namespace map_merge_3d
+
+#endif  // MAP_MERGE_TILED_MAP_H_
@@ -9,15 +9,24 @@
 
 #include <pcl/features/3dsc.h>
 #include <pcl/features/fpfh.h>
+#include <pcl/features/fpfh_omp.h>
 #include <pcl/features/pfh.h>
 #include <pcl/features/pfhrgb.h>
 #include <pcl/features/rsd.h>
 #include <pcl/features/shot.h>
+#include <pcl/features/shot_omp.h>
+
+#include "fast_pfh.h"
 
 /*
 When addding support for a new descriptor: Add descriptor to Descriptor enum in
 features.h (though DESCRIPTORS_NAMES_) and declare below required types using
 DECLARE_DESCRIPTOR_TYPE. Let the rest be worked out by the macro/template magic.
+Estimators are declared with their namespace.
+
+Parallel estimator must support setNumberOfThreads. Descriptors without a
+parallel estimator in PCL declare the single-threaded estimator again, they are
+parallelized over chunks of keypoints.
 */
 
 namespace map_merge_3d
@@ -25,27 +34,42 @@ namespace map_merge_3d
 // put implementation under anonymous namespace to protect *DescriptorType types
 namespace
 {
-#define DECLARE_DESCRIPTOR_TYPE(type, point_type, estimator, name_)            \
+#define DECLARE_DESCRIPTOR_TYPE(type, point_type, estimator,                   \
+                                parallel_estimator, name_)                     \
   struct type##DescriptorType {                                                \
     typedef pcl::point_type PointType;                                         \
-    typedef pcl::estimator<PointT, NormalT, PointType> Estimator;              \
+    typedef estimator<PointT, NormalT, PointType> Estimator;                   \
+    typedef parallel_estimator<PointT, NormalT, PointType> ParallelEstimator;  \
     constexpr const static auto name = #name_;                                 \
     constexpr const static Descriptor descriptor = Descriptor::type;           \
   };
 
-// all descriptors must also define their signature, estimator and field name in
-// PointCloud2 here
-DECLARE_DESCRIPTOR_TYPE(PFH, PFHSignature125, PFHEstimation, pfh)
-DECLARE_DESCRIPTOR_TYPE(PFHRGB, PFHRGBSignature250, PFHRGBEstimation, pfhrgb)
-DECLARE_DESCRIPTOR_TYPE(FPFH, FPFHSignature33, FPFHEstimation, fpfh)
+// all descriptors must also define their signature, estimators and field name
+// in PointCloud2 here
+DECLARE_DESCRIPTOR_TYPE(PFH, PFHSignature125, pcl::PFHEstimation,
+                        pcl::PFHEstimation, pfh)
+DECLARE_DESCRIPTOR_TYPE(PFHRGB, PFHRGBSignature250, pcl::PFHRGBEstimation,
+                        pcl::PFHRGBEstimation, pfhrgb)
+DECLARE_DESCRIPTOR_TYPE(FPFH, FPFHSignature33, pcl::FPFHEstimation,
+                        pcl::FPFHEstimationOMP, fpfh)
 // RIFT uses intensity gradients
-// DECLARE_DESCRIPTOR_TYPE(RIFT, Histogram<32>, RIFTEstimation, rift)
-DECLARE_DESCRIPTOR_TYPE(RSD, PrincipalRadiiRSD, RSDEstimation, r_min)
+// DECLARE_DESCRIPTOR_TYPE(RIFT, Histogram<32>, pcl::RIFTEstimation,
+//                         pcl::RIFTEstimation, rift)
+DECLARE_DESCRIPTOR_TYPE(RSD, PrincipalRadiiRSD, pcl::RSDEstimation,
+                        pcl::RSDEstimation, r_min)
 // SHOT color descriptor has better performance
-// DECLARE_DESCRIPTOR_TYPE(SHOT, SHOT352, SHOTEstimation, shot)
-DECLARE_DESCRIPTOR_TYPE(SHOT, SHOT1344, SHOTColorEstimation, shot)
-DECLARE_DESCRIPTOR_TYPE(SC3D, ShapeContext1980, ShapeContext3DEstimation,
-                        shape_context)
+// DECLARE_DESCRIPTOR_TYPE(SHOT, SHOT352, pcl::SHOTEstimation,
+//                         pcl::SHOTEstimationOMP, shot)
+DECLARE_DESCRIPTOR_TYPE(SHOT, SHOT1344, pcl::SHOTColorEstimation,
+                        pcl::SHOTColorEstimationOMP, shot)
+DECLARE_DESCRIPTOR_TYPE(SC3D, ShapeContext1980, pcl::ShapeContext3DEstimation,
+                        pcl::ShapeContext3DEstimation, shape_context)
+// native implementations of PFH and FPFH, they share signatures and field
+// names with PCL implementations
+DECLARE_DESCRIPTOR_TYPE(FAST_PFH, PFHSignature125, FastPFHEstimation,
+                        FastPFHEstimationOMP, pfh)
+DECLARE_DESCRIPTOR_TYPE(FAST_FPFH, FPFHSignature33, FastFPFHEstimation,
+                        FastFPFHEstimationOMP, fpfh)
 
 #undef DECLARE_DESCRIPTOR_TYPE
 // holds all *DescriptorType
@@ -0,0 +1,601 @@
+#include <map_merge_3d/distributed.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <map_merge_3d/submaps.h>
+
+#include "serialization.h"
+
+namespace map_merge_3d
+{
+/*
+Protocol between RegistrationWorkers and workers. Each message is a header
+followed by the payload serialized the same way as the state file. The
+coordinator sends PARAMS, FEATURES and FORGET without a reply, each REGISTER
+is answered by RESULT or ERROR with the same job id.
+*/
+enum class Message : uint32_t {
+  PARAMS = 1,    // text of MapMergingParams
+  FEATURES = 2,  // hash, cloud, keypoints, descriptors
+  FORGET = 3,    // hash
+  REGISTER = 4,  // job, source hash, target hash
+  RESULT = 5,    // job, estimate
+  ERROR = 6,     // job, error message
+};
+
+struct MessageHeader {
+  uint32_t type;
+  uint32_t reserved;
+  uint64_t size;
+};
+
+// a pair is registered locally after failing with this many workers
+static const size_t MAX_ATTEMPTS = 2;
+// waiting for workers is interrupted this often to check for cancellation
+static const int POLL_INTERVAL_MS = 100;
+// replies carry one estimate or an error message
+static const uint64_t MAX_REPLY_SIZE = uint64_t(1) << 20;
+// requests carry features of one map
+static const uint64_t MAX_REQUEST_SIZE = uint64_t(1) << 34;
+
+typedef std::chrono::steady_clock Clock;
+
+static bool sendAll(int fd, const char *data, size_t size)
+{
+  while (size > 0) {
+    // do not get killed by SIGPIPE if the other side is gone
+    const ssize_t sent = ::send(fd, data, size, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += sent;
+    size -= size_t(sent);
+  }
+  return true;
+}
+
+static bool receiveAll(int fd, char *data, size_t size)
+{
+  while (size > 0) {
+    const ssize_t received = ::recv(fd, data, size, 0);
+    if (received < 0 && errno == EINTR) {
+      continue;
+    }
+    if (received <= 0) {
+      return false;
+    }
+    data += received;
+    size -= size_t(received);
+  }
+  return true;
+}
+
+static bool sendMessage(int fd, Message type, const std::string &payload)
+{
+  MessageHeader header;
+  header.type = uint32_t(type);
+  header.reserved = 0;
+  header.size = payload.size();
+  return sendAll(fd, reinterpret_cast<const char *>(&header), sizeof(header)) &&
+         sendAll(fd, payload.data(), payload.size());
+}
+
+/* fails on messages larger than max_size, the size comes from the other side */
+static bool receiveMessage(int fd, Message &type, std::string &payload,
+                           uint64_t max_size)
+{
+  MessageHeader header;
+  if (!receiveAll(fd, reinterpret_cast<char *>(&header), sizeof(header)) ||
+      header.size > max_size) {
+    return false;
+  }
+  type = Message(header.type);
+  payload.resize(header.size);
+  return receiveAll(fd, &payload[0], payload.size());
+}
+
+/* parameters as text parsed by MapMergingParams::fromCommandLine */
+static std::string paramsText(const MapMergingParams &params)
+{
+  std::ostringstream stream;
+  stream.precision(std::numeric_limits<double>::max_digits10);
+  stream << params;
+  return stream.str();
+}
+
+static MapMergingParams parseParams(const std::string &text)
+{
+  // "name: value" lines to "--name value" arguments
+  std::vector<std::string> arguments = {"map_merge_worker"};
+  std::istringstream stream(text);
+  std::string line;
+  while (std::getline(stream, line)) {
+    const size_t separator = line.find(": ");
+    if (separator == std::string::npos) {
+      continue;
+    }
+    arguments.push_back("--" + line.substr(0, separator));
+    arguments.push_back(line.substr(separator + 2));
+  }
+  std::vector<char *> argv;
+  for (auto &argument : arguments) {
+    argv.push_back(&argument[0]);
+  }
+  return MapMergingParams::fromCommandLine(int(argv.size()), argv.data());
+}
+
+static void setTimeout(int fd, double timeout)
+{
+  timeval time;
+  time.tv_sec = time_t(timeout);
+  time.tv_usec = suseconds_t((timeout - double(time.tv_sec)) * 1e6);
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &time, sizeof(time));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &time, sizeof(time));
+}
+
+RegistrationWorkers::RegistrationWorkers(
+    const std::vector<std::string> &endpoints, size_t local_workers,
+    double timeout, const std::string &worker_executable)
+  : timeout_(timeout), worker_executable_(worker_executable), next_job_(0)
+{
+  if (!(timeout > 0.)) {
+    throw std::invalid_argument("RegistrationWorkers: timeout must be "
+                                "positive");
+  }
+
+  workers_.resize(endpoints.size() + local_workers);
+  for (size_t i = 0; i < endpoints.size(); ++i) {
+    workers_[i].endpoint = endpoints[i];
+  }
+  for (auto &worker : workers_) {
+    start(worker);
+  }
+}
+
+RegistrationWorkers::~RegistrationWorkers()
+{
+  for (auto &worker : workers_) {
+    drop(worker);
+  }
+}
+
+size_t RegistrationWorkers::size() const
+{
+  return size_t(std::count_if(workers_.begin(), workers_.end(),
+                              [](const Worker &w) { return w.fd >= 0; }));
+}
+
+void RegistrationWorkers::start(Worker &worker)
+{
+  worker.params.clear();
+  worker.features.clear();
+
+  if (!worker.endpoint.empty()) {
+    sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (worker.endpoint.size() >= sizeof(address.sun_path)) {
+      return;
+    }
+    std::strcpy(address.sun_path, worker.endpoint.c_str());
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      return;
+    }
+    if (::connect(fd, reinterpret_cast<sockaddr *>(&address),
+                  sizeof(address)) != 0) {
+      ::close(fd);
+      return;
+    }
+    worker.fd = fd;
+    setTimeout(worker.fd, timeout_);
+    return;
+  }
+
+  int fds[2];
+  if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+    return;
+  }
+  // the child of a threaded process may only call async-signal-safe functions
+  // before exec
+  const std::string fd = std::to_string(fds[1]);
+  const pid_t pid = ::fork();
+  if (pid < 0) {
+    ::close(fds[0]);
+    ::close(fds[1]);
+    return;
+  }
+  if (pid == 0) {
+    // worker process
+    ::close(fds[0]);
+    if (!worker_executable_.empty()) {
+      ::fcntl(fds[1], F_SETFD, 0);
+      ::execl(worker_executable_.c_str(), worker_executable_.c_str(), "--fd",
+              fd.c_str(), static_cast<char *>(nullptr));
+      ::_exit(127);
+    }
+    for (const auto &other : workers_) {
+      if (other.fd >= 0) {
+        ::close(other.fd);
+      }
+    }
+    try {
+      serveRegistrationWorker(fds[1]);
+    } catch (...) {
+      ::_exit(1);
+    }
+    ::_exit(0);
+  }
+  ::close(fds[1]);
+  worker.pid = pid;
+  worker.fd = fds[0];
+  setTimeout(worker.fd, timeout_);
+}
+
+void RegistrationWorkers::drop(Worker &worker)
+{
+  if (worker.fd >= 0) {
+    ::close(worker.fd);
+    worker.fd = -1;
+  }
+  if (worker.pid > 0) {
+    ::kill(worker.pid, SIGKILL);
+    ::waitpid(worker.pid, nullptr, 0);
+    worker.pid = 0;
+  }
+  worker.params.clear();
+  worker.features.clear();
+}
+
+bool RegistrationWorkers::dispatch(Worker &worker, uint64_t job, size_t source,
+                                   size_t target,
+                                   const std::vector<MapFeatures> &features,
+                                   const std::string &params)
+{
+  // worker drops all features when parameters change
+  if (worker.params != params) {
+    if (!sendMessage(worker.fd, Message::PARAMS, params)) {
+      return false;
+    }
+    worker.params = params;
+    worker.features.clear();
+  }
+
+  for (size_t i : {source, target}) {
+    const MapFeatures &map = features[i];
+    if (worker.features.count(map.hash)) {
+      continue;
+    }
+    std::ostringstream stream;
+    Writer writer(stream);
+    writer.pod<uint64_t>(map.hash);
+    writeCloud(writer, map.cloud.get());
+    writeCloud(writer, map.keypoints.get());
+    writeDescriptors(writer, map.descriptors.get());
+    if (!sendMessage(worker.fd, Message::FEATURES, stream.str())) {
+      return false;
+    }
+    worker.features.insert(map.hash);
+  }
+
+  std::ostringstream stream;
+  Writer writer(stream);
+  writer.pod<uint64_t>(job);
+  writer.pod<uint64_t>(features[source].hash);
+  writer.pod<uint64_t>(features[target].hash);
+  return sendMessage(worker.fd, Message::REGISTER, stream.str());
+}
+
+std::vector<TransformEstimate> RegistrationWorkers::registerPairs(
+    const std::vector<MapFeatures> &features,
+    const std::vector<std::pair<size_t, size_t>> &pairs,
+    const MapMergingParams &params, const std::function<bool()> &is_cancelled)
+{
+  auto check_cancelled = [&is_cancelled]() {
+    if (is_cancelled && is_cancelled()) {
+      throw EstimationCancelled();
+    }
+  };
+
+  // workers forked without exec are not respawned, this process already runs
+  // threads
+  for (auto &worker : workers_) {
+    if (worker.fd < 0 &&
+        (!worker.endpoint.empty() || !worker_executable_.empty())) {
+      drop(worker);
+      start(worker);
+    }
+  }
+
+  // free features of maps that are gone or changed
+  std::unordered_set<uint64_t> current;
+  for (const auto &map : features) {
+    current.insert(map.hash);
+  }
+  for (auto &worker : workers_) {
+    std::vector<uint64_t> stale;
+    for (uint64_t hash : worker.features) {
+      if (!current.count(hash)) {
+        stale.push_back(hash);
+      }
+    }
+    for (uint64_t hash : stale) {
+      std::ostringstream stream;
+      Writer writer(stream);
+      writer.pod<uint64_t>(hash);
+      if (worker.fd >= 0 &&
+          !sendMessage(worker.fd, Message::FORGET, stream.str())) {
+        drop(worker);
+      }
+      worker.features.erase(hash);
+    }
+  }
+
+  struct Assignment {
+    bool busy = false;
+    size_t pair = 0;
+    uint64_t job = 0;
+    Clock::time_point deadline;
+  };
+  std::vector<Assignment> assignments(workers_.size());
+  std::vector<TransformEstimate> results(pairs.size());
+  std::vector<size_t> attempts(pairs.size(), 0);
+  std::deque<size_t> queue;
+  for (size_t k = 0; k < pairs.size(); ++k) {
+    queue.push_back(k);
+  }
+  // pairs registered in this process
+  std::vector<size_t> local;
+
+  const std::string params_text = paramsText(params);
+  auto fail = [&](size_t w) {
+    drop(workers_[w]);
+    Assignment &assignment = assignments[w];
+    if (!assignment.busy) {
+      return;
+    }
+    assignment.busy = false;
+    if (++attempts[assignment.pair] < MAX_ATTEMPTS) {
+      queue.push_back(assignment.pair);
+    } else {
+      local.push_back(assignment.pair);
+    }
+  };
+  // whether the message answers the assignment
+  auto answer = [&](size_t w, Message type, const std::string &payload) {
+    Assignment &assignment = assignments[w];
+    Reader reader(payload.data(), payload.size());
+    if (reader.pod<uint64_t>() != assignment.job) {
+      return false;
+    }
+    if (type == Message::RESULT) {
+      uint64_t source_hash, target_hash;
+      TransformEstimate estimate =
+          readEstimate(reader, source_hash, target_hash);
+      estimate.source_idx = pairs[assignment.pair].first;
+      estimate.target_idx = pairs[assignment.pair].second;
+      results[assignment.pair] = estimate;
+    } else if (type == Message::ERROR) {
+      // registration failed in the worker, reproduce the failure locally
+      local.push_back(assignment.pair);
+    } else {
+      return false;
+    }
+    assignment.busy = false;
+    return true;
+  };
+
+  try {
+    for (;;) {
+      check_cancelled();
+
+      for (size_t w = 0; w < workers_.size() && !queue.empty(); ++w) {
+        if (workers_[w].fd < 0 || assignments[w].busy) {
+          continue;
+        }
+        Assignment &assignment = assignments[w];
+        assignment.busy = true;
+        assignment.pair = queue.front();
+        assignment.job = next_job_++;
+        assignment.deadline =
+            Clock::now() + std::chrono::duration_cast<Clock::duration>(
+                               std::chrono::duration<double>(timeout_));
+        queue.pop_front();
+        const auto &pair = pairs[assignment.pair];
+        if (!dispatch(workers_[w], assignment.job, pair.first, pair.second,
+                      features, params_text)) {
+          fail(w);
+        }
+      }
+
+      std::vector<pollfd> fds;
+      std::vector<size_t> polled;
+      Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(
+                                                      POLL_INTERVAL_MS);
+      for (size_t w = 0; w < workers_.size(); ++w) {
+        if (!assignments[w].busy) {
+          continue;
+        }
+        pollfd fd;
+        fd.fd = workers_[w].fd;
+        fd.events = POLLIN;
+        fd.revents = 0;
+        fds.push_back(fd);
+        polled.push_back(w);
+        deadline = std::min(deadline, assignments[w].deadline);
+      }
+      if (fds.empty()) {
+        if (queue.empty()) {
+          break;
+        }
+        if (size() == 0) {
+          // no workers left
+          local.insert(local.end(), queue.begin(), queue.end());
+          queue.clear();
+          break;
+        }
+        continue;
+      }
+
+      const auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+          deadline - Clock::now());
+      const int64_t wait_ms = std::max<int64_t>(0, wait.count() + 1);
+      const int ready = ::poll(fds.data(), fds.size(), int(wait_ms));
+      if (ready < 0 && errno != EINTR) {
+        throw std::runtime_error(std::string("registerPairs: poll failed: ") +
+                                 std::strerror(errno));
+      }
+
+      const Clock::time_point now = Clock::now();
+      for (size_t i = 0; i < fds.size(); ++i) {
+        const size_t w = polled[i];
+        if (ready > 0 && fds[i].revents != 0) {
+          Message type;
+          std::string payload;
+          bool answered = false;
+          try {
+            answered = receiveMessage(workers_[w].fd, type, payload,
+                                      MAX_REPLY_SIZE) &&
+                       answer(w, type, payload);
+          } catch (const std::exception &) {
+            // truncated or malformed answer
+          }
+          if (!answered) {
+            fail(w);
+          }
+        } else if (now >= assignments[w].deadline) {
+          fail(w);
+        }
+      }
+    }
+  } catch (const EstimationCancelled &) {
+    // busy workers would answer stale jobs
+    for (size_t w = 0; w < workers_.size(); ++w) {
+      if (assignments[w].busy) {
+        assignments[w].busy = false;
+        drop(workers_[w]);
+      }
+    }
+    throw;
+  }
+
+  std::sort(local.begin(), local.end());
+  for (size_t k : local) {
+    check_cancelled();
+    const size_t i = pairs[k].first;
+    const size_t j = pairs[k].second;
+    results[k] = estimatePairTransform(features[i], features[j], params,
+                                       is_cancelled);
+    results[k].source_idx = i;
+    results[k].target_idx = j;
+  }
+
+  return results;
+}
+
+void serveRegistrationWorker(int fd)
+{
+  // closes the connection on return
+  struct Connection {
+    int fd;
+    ~Connection()
+    {
+      ::close(fd);
+    }
+  } connection{fd};
+
+  MapMergingParams params;
+  std::unordered_map<uint64_t, MapFeatures> features;
+  Message type;
+  std::string payload;
+  while (receiveMessage(connection.fd, type, payload, MAX_REQUEST_SIZE)) {
+    Reader reader(payload.data(), payload.size());
+    switch (type) {
+      case Message::PARAMS:
+        params = parseParams(payload);
+        features.clear();
+        break;
+      case Message::FEATURES: {
+        const uint64_t hash = reader.pod<uint64_t>();
+        MapFeatures &map = features[hash];
+        map.hash = hash;
+        map.cloud = readCloud<PointT>(reader);
+        map.keypoints = readCloud<PointT>(reader);
+        map.descriptors = readDescriptors(reader);
+        if (!map.cloud || !map.keypoints || !map.descriptors) {
+          throw std::runtime_error("serveRegistrationWorker: received "
+                                   "incomplete features");
+        }
+        map.submaps.clear();
+        if (params.submap_size > 0. && !map.keypoints->empty()) {
+          map.submaps =
+              partitionToSubmaps(map.keypoints, map.descriptors,
+                                 params.submap_size, params.submap_overlap);
+        }
+        break;
+      }
+      case Message::FORGET:
+        features.erase(reader.pod<uint64_t>());
+        break;
+      case Message::REGISTER: {
+        const uint64_t job = reader.pod<uint64_t>();
+        const uint64_t source = reader.pod<uint64_t>();
+        const uint64_t target = reader.pod<uint64_t>();
+        TransformEstimate estimate;
+        std::string error;
+        try {
+          auto source_features = features.find(source);
+          auto target_features = features.find(target);
+          if (source_features == features.end() ||
+              target_features == features.end()) {
+            throw std::runtime_error("features of the map were not received");
+          }
+          estimate = estimatePairTransform(source_features->second,
+                                           target_features->second, params);
+        } catch (const std::exception &e) {
+          error = e.what();
+        }
+
+        std::ostringstream stream;
+        Writer writer(stream);
+        writer.pod<uint64_t>(job);
+        if (error.empty()) {
+          writeEstimate(writer, source, target, estimate);
+        } else {
+          writer.pod<uint64_t>(error.size());
+          writer.bytes(error.data(), error.size());
+        }
+        if (!sendMessage(connection.fd,
+                         error.empty() ? Message::RESULT : Message::ERROR,
+                         stream.str())) {
+          return;
+        }
+        break;
+      }
+      default:
+        throw std::runtime_error("serveRegistrationWorker: unknown message");
+    }
+  }
+}
+
+}  // namespace map_merge_3d
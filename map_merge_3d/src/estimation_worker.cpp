@@ -0,0 +1,86 @@
+#include <map_merge_3d/estimation_worker.h>
+
+namespace map_merge_3d
+{
+EstimationWorker::EstimationWorker()
+  : running_(false), stop_(false), cancelled_(false)
+{
+  thread_ = std::thread([this]() { run(); });
+}
+
+EstimationWorker::~EstimationWorker()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+    pending_ = nullptr;
+    cancelled_ = true;
+  }
+  wakeup_.notify_all();
+  thread_.join();
+}
+
+void EstimationWorker::request(Job job, bool cancel_running)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_ = std::move(job);
+    if (cancel_running && running_) {
+      cancelled_ = true;
+    }
+  }
+  wakeup_.notify_all();
+}
+
+void EstimationWorker::cancel()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  pending_ = nullptr;
+  if (running_) {
+    cancelled_ = true;
+  } else {
+    // dropping the pending job made the worker idle
+    idle_.notify_all();
+  }
+}
+
+bool EstimationWorker::busy() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return running_ || pending_;
+}
+
+void EstimationWorker::waitIdle() const
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  idle_.wait(lock, [this]() { return !running_ && !pending_; });
+}
+
+void EstimationWorker::run()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    wakeup_.wait(lock, [this]() { return stop_ || pending_; });
+    if (stop_) {
+      break;
+    }
+
+    Job job = std::move(pending_);
+    pending_ = nullptr;
+    running_ = true;
+    cancelled_ = false;
+
+    lock.unlock();
+    job(cancelled_);
+    lock.lock();
+
+    running_ = false;
+    if (!pending_) {
+      idle_.notify_all();
+    }
+  }
+  running_ = false;
+  idle_.notify_all();
+}
+
+}  // namespace map_merge_3d
@@ -0,0 +1,112 @@
+#include <map_merge_3d/evaluation.h>
+
+#include <algorithm>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+#include <Eigen/Geometry>
+
+namespace map_merge_3d
+{
+std::vector<Eigen::Matrix4f> loadTransforms(const std::string &file_name)
+{
+  std::ifstream file(file_name);
+  if (!file) {
+    throw std::runtime_error("loadTransforms: unable to open " + file_name);
+  }
+
+  std::vector<float> numbers;
+  std::string line;
+  while (std::getline(file, line)) {
+    if (!line.empty() && line[0] == '#') {
+      continue;
+    }
+    std::istringstream line_stream(line);
+    float number;
+    while (line_stream >> number) {
+      numbers.push_back(number);
+    }
+    if (!line_stream.eof()) {
+      throw std::runtime_error("loadTransforms: invalid number in " +
+                               file_name);
+    }
+  }
+  if (numbers.size() % 16 != 0) {
+    throw std::runtime_error("loadTransforms: " + file_name +
+                             " does not contain whole 4x4 matrices");
+  }
+
+  std::vector<Eigen::Matrix4f> transforms;
+  for (size_t i = 0; i < numbers.size(); i += 16) {
+    transforms.emplace_back(
+        Eigen::Map<Eigen::Matrix<float, 4, 4, Eigen::RowMajor>>(&numbers[i]));
+  }
+
+  return transforms;
+}
+
+void saveTransforms(const std::string &file_name,
+                    const std::vector<Eigen::Matrix4f> &transforms)
+{
+  std::ofstream file(file_name);
+  file.precision(std::numeric_limits<float>::max_digits10);
+  file << "# 4x4 transform for each map" << std::endl;
+  for (const auto &transform : transforms) {
+    file << transform << std::endl << std::endl;
+  }
+  if (!file) {
+    throw std::runtime_error("saveTransforms: unable to write " + file_name);
+  }
+}
+
+TransformsError
+evaluateTransforms(const std::vector<Eigen::Matrix4f> &estimated,
+                   const std::vector<Eigen::Matrix4f> &ground_truth)
+{
+  if (estimated.size() != ground_truth.size()) {
+    throw std::runtime_error("evaluateTransforms: estimated and ground truth "
+                             "transforms must have the same size.");
+  }
+
+  TransformsError result;
+  auto reference =
+      std::find_if(estimated.begin(), estimated.end(),
+                   [](const Eigen::Matrix4f &t) { return !t.isZero(); });
+  if (reference == estimated.end()) {
+    return result;
+  }
+  const size_t r = size_t(std::distance(estimated.begin(), reference));
+  const Eigen::Matrix4f estimated_reference_inv = estimated[r].inverse();
+  const Eigen::Matrix4f ground_truth_reference_inv = ground_truth[r].inverse();
+
+  result.merged = 1;
+  for (size_t i = r + 1; i < estimated.size(); ++i) {
+    if (estimated[i].isZero()) {
+      continue;
+    }
+    // map i -> reference map
+    const Eigen::Matrix4f relative = estimated_reference_inv * estimated[i];
+    const Eigen::Matrix4f expected = ground_truth_reference_inv * ground_truth[i];
+    const Eigen::Matrix4f error = expected.inverse() * relative;
+
+    const double rotation =
+        Eigen::AngleAxisf(Eigen::Matrix3f(error.block<3, 3>(0, 0))).angle();
+    const double translation = error.block<3, 1>(0, 3).norm();
+
+    ++result.merged;
+    result.mean_rotation += rotation;
+    result.mean_translation += translation;
+    result.max_rotation = std::max(result.max_rotation, rotation);
+    result.max_translation = std::max(result.max_translation, translation);
+  }
+  if (result.merged > 1) {
+    result.mean_rotation /= double(result.merged - 1);
+    result.mean_translation /= double(result.merged - 1);
+  }
+
+  return result;
+}
+
+}  // namespace map_merge_3d
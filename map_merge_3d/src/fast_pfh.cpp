@@ -0,0 +1,217 @@
+#include "fast_pfh.h"
+
+#include <cfloat>
+#include <cmath>
+
+namespace map_merge_3d
+{
+// columns of PairFeatures::columns_
+enum Column {
+  DX,
+  DY,
+  DZ,
+  // normal of the neighbour, replaced by the normal of the target point
+  TARGET_X,
+  TARGET_Y,
+  TARGET_Z,
+  // normal of the source point
+  SOURCE_X,
+  SOURCE_Y,
+  SOURCE_Z,
+  V_X,
+  V_Y,
+  V_Z,
+  W_X,
+  W_Y,
+  W_Z,
+  LENGTH,
+  ANGLE1,
+  ANGLE2,
+  V_NORM,
+  VALID,
+  F1,
+  F2,
+  F3,
+  ATAN_A,
+  ATAN_S,
+  COLUMNS_COUNT
+};
+
+PairFeatures::PairFeatures(const OrientedPoints &cloud) : cloud_(cloud)
+{
+}
+
+/* atan2 for arrays, vectorized by Eigen unlike std::atan2. Maximum error is
+ * 2e-6 rad, far below the width of histogram bins. */
+template <typename Y, typename X, typename A, typename S, typename Out>
+static void atan2(const Y &y, const X &x, A &&a, S &&s, Out &&out)
+{
+  // atan on [0, 1]
+  a = x.abs().min(y.abs()) / x.abs().max(y.abs()).max(FLT_MIN);
+  s = a.square();
+  out = a * (0.99997726f +
+             s * (-0.33262347f +
+                  s * (0.19354346f +
+                       s * (-0.11643287f +
+                            s * (0.05265332f + s * -0.01172120f)))));
+  out = (y.abs() > x.abs()).select(float(M_PI_2) - out, out);
+  out = (x < 0.f).select(float(M_PI) - out, out);
+  out = (y < 0.f).select(-out, out);
+}
+
+void PairFeatures::computeBins(int point, const int *neighbours,
+                               Eigen::Index size, int bins)
+{
+  if (columns_.rows() < size) {
+    columns_.resize(size, COLUMNS_COUNT);
+    bins_.resize(size, 3);
+  }
+  auto column = [this, size](Column c) { return columns_.col(c).head(size); };
+  auto dx = column(DX), dy = column(DY), dz = column(DZ);
+  auto tx = column(TARGET_X), ty = column(TARGET_Y), tz = column(TARGET_Z);
+  auto sx = column(SOURCE_X), sy = column(SOURCE_Y), sz = column(SOURCE_Z);
+  auto vx = column(V_X), vy = column(V_Y), vz = column(V_Z);
+  auto wx = column(W_X), wy = column(W_Y), wz = column(W_Z);
+  auto length = column(LENGTH), angle1 = column(ANGLE1),
+       angle2 = column(ANGLE2), v_norm = column(V_NORM), valid = column(VALID);
+  auto f1 = column(F1), f2 = column(F2), f3 = column(F3);
+
+  // gather neighbours
+  const float x = cloud_.x[point], y = cloud_.y[point], z = cloud_.z[point];
+  const float nx = cloud_.normal_x[point], ny = cloud_.normal_y[point],
+              nz = cloud_.normal_z[point];
+  const bool point_finite = cloud_.finite[size_t(point)];
+  for (Eigen::Index i = 0; i < size; ++i) {
+    const int q = neighbours[i];
+    dx[i] = cloud_.x[q] - x;
+    dy[i] = cloud_.y[q] - y;
+    dz[i] = cloud_.z[q] - z;
+    tx[i] = cloud_.normal_x[q];
+    ty[i] = cloud_.normal_y[q];
+    tz[i] = cloud_.normal_z[q];
+    valid[i] = point_finite && cloud_.finite[size_t(q)] ? 1.f : 0.f;
+  }
+
+  /* see pcl::computePairFeatures */
+  length = (dx.square() + dy.square() + dz.square()).sqrt();
+  angle1 = (nx * dx + ny * dy + nz * dz) / length;
+  angle2 = (tx * dx + ty * dy + tz * dz) / length;
+  // the point whose normal is closer to the line between points is the
+  // source, this makes features symmetric
+  const auto swap = angle1.abs() < angle2.abs();
+  sx = swap.select(tx, nx);
+  sy = swap.select(ty, ny);
+  sz = swap.select(tz, nz);
+  tx = swap.select(nx, tx);
+  ty = swap.select(ny, ty);
+  tz = swap.select(nz, tz);
+  f3 = swap.select(-angle2, angle1);
+  dx = swap.select(-dx, dx);
+  dy = swap.select(-dy, dy);
+  dz = swap.select(-dz, dz);
+
+  // Darboux frame u = source normal, v = d x u, w = u x v
+  vx = dy * sz - dz * sy;
+  vy = dz * sx - dx * sz;
+  vz = dx * sy - dy * sx;
+  v_norm = (vx.square() + vy.square() + vz.square()).sqrt();
+  valid = (length > 0.f && v_norm > 0.f).select(valid, 0.f);
+  vx /= v_norm;
+  vy /= v_norm;
+  vz /= v_norm;
+  wx = sy * vz - sz * vy;
+  wy = sz * vx - sx * vz;
+  wz = sx * vy - sy * vx;
+
+  f2 = vx * tx + vy * ty + vz * tz;
+  // angle of target normal in u, w coordinates
+  atan2(wx * tx + wy * ty + wz * tz, sx * tx + sy * ty + sz * tz,
+        column(ATAN_A), column(ATAN_S), f1);
+
+  // pairs with invalid normals are skipped as well
+  valid = (f1.isFinite() && f2.isFinite() && f3.isFinite()).select(valid, 0.f);
+
+  // normalize features to bins, features of invalid pairs may be NaN
+  const float scale = float(bins);
+  f1 = (valid > 0.f).select(f1, 0.f);
+  f2 = (valid > 0.f).select(f2, 0.f);
+  f3 = (valid > 0.f).select(f3, 0.f);
+  bins_.col(0).head(size) =
+      (scale * ((f1 + float(M_PI)) * float(0.5 / M_PI))).floor().cast<int>();
+  bins_.col(1).head(size) = (scale * ((f2 + 1.f) * 0.5f)).floor().cast<int>();
+  bins_.col(2).head(size) = (scale * ((f3 + 1.f) * 0.5f)).floor().cast<int>();
+  bins_.topRows(size) = bins_.topRows(size).max(0).min(bins - 1);
+  for (int c = 0; c < 3; ++c) {
+    bins_.col(c).head(size) =
+        (valid > 0.f).select(bins_.col(c).head(size), -1);
+  }
+}
+
+void PairFeatures::computePFH(const std::vector<int> &neighbours,
+                              float *histogram)
+{
+  std::fill_n(histogram, PFH_BINS * PFH_BINS * PFH_BINS, 0.f);
+  const size_t size = neighbours.size();
+  if (size < 2) {
+    return;
+  }
+
+  // each unordered pair once
+  const float increment = 100.f / float(size * (size - 1) / 2);
+  for (size_t i = 1; i < size; ++i) {
+    computeBins(neighbours[i], neighbours.data(), Eigen::Index(i), PFH_BINS);
+    for (Eigen::Index j = 0; j < Eigen::Index(i); ++j) {
+      if (bins_(j, 0) < 0) {
+        continue;
+      }
+      histogram[bins_(j, 0) + PFH_BINS * bins_(j, 1) +
+                PFH_BINS * PFH_BINS * bins_(j, 2)] += increment;
+    }
+  }
+}
+
+void PairFeatures::computeSPFH(int point, const std::vector<int> &neighbours,
+                               float *histogram)
+{
+  std::fill_n(histogram, 3 * SPFH_BINS, 0.f);
+  const Eigen::Index size = Eigen::Index(neighbours.size());
+  // point itself is in neighbours, but does not form a valid pair
+  const float increment = 100.f / float(size - 1);
+  computeBins(point, neighbours.data(), size, SPFH_BINS);
+  for (Eigen::Index i = 0; i < size; ++i) {
+    if (bins_(i, 0) < 0) {
+      continue;
+    }
+    histogram[bins_(i, 0)] += increment;
+    histogram[SPFH_BINS + bins_(i, 1)] += increment;
+    histogram[2 * SPFH_BINS + bins_(i, 2)] += increment;
+  }
+}
+
+void weightSPFHSignatures(
+    const Eigen::Matrix<float, Eigen::Dynamic, 3 * SPFH_BINS,
+                        Eigen::RowMajor> &table,
+    const std::vector<int> &rows, const std::vector<int> &neighbours,
+    const std::vector<float> &distances, float *histogram)
+{
+  Eigen::Map<Eigen::Matrix<float, 1, 3 * SPFH_BINS>> fpfh(histogram);
+  fpfh.setZero();
+  for (size_t i = 0; i < neighbours.size(); ++i) {
+    // the point itself, weight would be infinite
+    if (distances[i] == 0.f) {
+      continue;
+    }
+    fpfh += table.row(rows[size_t(neighbours[i])]) * (1.f / distances[i]);
+  }
+
+  // each feature histogram sums up to 100
+  for (int f = 0; f < 3; ++f) {
+    auto feature = fpfh.segment<SPFH_BINS>(f * SPFH_BINS);
+    const float sum = feature.sum();
+    if (sum != 0.f) {
+      feature *= 100.f / sum;
+    }
+  }
+}
+
+}  // namespace map_merge_3d
@@ -0,0 +1,301 @@
+#ifndef MAP_MERGE_FAST_PFH_H_
+#define MAP_MERGE_FAST_PFH_H_
+
+/*
+Native PFH and FPFH estimators. They compute the same descriptors as
+pcl::PFHEstimation and pcl::FPFHEstimation, but pair features of one point with
+all its neighbours are computed at once on arrays, so that Eigen can vectorize
+them. FPFH computes the SPFH of every surface point in the neighbourhoods of
+keypoints exactly once into a table shared by all keypoints, neighbourhoods of
+keypoints are searched only once.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <thread>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include <pcl/common/point_tests.h>
+#include <pcl/features/feature.h>
+#include <pcl/point_cloud.h>
+
+namespace map_merge_3d
+{
+// bins per pair feature of PFH, histogram has PFH_BINS^3 bins
+static const int PFH_BINS = 5;
+// bins per pair feature of SPFH and FPFH, histogram has 3 * SPFH_BINS bins
+static const int SPFH_BINS = 11;
+
+/* surface points with normals in structure-of-arrays layout */
+struct OrientedPoints {
+  Eigen::ArrayXf x, y, z;
+  Eigen::ArrayXf normal_x, normal_y, normal_z;
+  // pairs with non-finite points are skipped
+  std::vector<bool> finite;
+};
+
+template <typename PointInT, typename PointNT>
+void copyOrientedPoints(const pcl::PointCloud<PointInT>& points,
+                        const pcl::PointCloud<PointNT>& normals,
+                        OrientedPoints& output)
+{
+  const Eigen::Index size = Eigen::Index(points.size());
+  output.x.resize(size);
+  output.y.resize(size);
+  output.z.resize(size);
+  output.normal_x.resize(size);
+  output.normal_y.resize(size);
+  output.normal_z.resize(size);
+  output.finite.resize(points.size());
+  for (Eigen::Index i = 0; i < size; ++i) {
+    const PointInT& point = points[size_t(i)];
+    const PointNT& normal = normals[size_t(i)];
+    output.x[i] = point.x;
+    output.y[i] = point.y;
+    output.z[i] = point.z;
+    output.normal_x[i] = normal.normal_x;
+    output.normal_y[i] = normal.normal_y;
+    output.normal_z[i] = normal.normal_z;
+    output.finite[size_t(i)] = pcl::isFinite(point);
+  }
+}
+
+/* computes histograms of pair features (see pcl::computePairFeatures). Holds
+ * working memory, use one instance per thread. */
+class PairFeatures
+{
+public:
+  explicit PairFeatures(const OrientedPoints& cloud);
+
+  /* PFH histogram over all pairs of points in the neighbourhood, output has
+   * PFH_BINS^3 bins */
+  void computePFH(const std::vector<int>& neighbours, float* histogram);
+  /* SPFH histogram over pairs of point with its neighbours, output has
+   * 3 * SPFH_BINS bins */
+  void computeSPFH(int point, const std::vector<int>& neighbours,
+                   float* histogram);
+
+private:
+  const OrientedPoints& cloud_;
+  // one column per intermediate result, rows are pairs
+  Eigen::ArrayXXf columns_;
+  // bins of pair features, -1 for invalid pairs
+  Eigen::ArrayXXi bins_;
+
+  void computeBins(int point, const int* neighbours, Eigen::Index size,
+                   int bins);
+};
+
+/* FPFH histogram of a point as the weighted sum of SPFH histograms of its
+ * neighbours. Rows of table are SPFH histograms, rows maps surface points to
+ * rows in the table. */
+void weightSPFHSignatures(
+    const Eigen::Matrix<float, Eigen::Dynamic, 3 * SPFH_BINS,
+                        Eigen::RowMajor>& table,
+    const std::vector<int>& rows, const std::vector<int>& neighbours,
+    const std::vector<float>& distances, float* histogram);
+
+/* the same interface as pcl::PFHEstimation and pcl::PFHEstimationOMP */
+template <typename PointInT, typename PointNT, typename PointOutT>
+class FastPFHEstimation
+  : public pcl::FeatureFromNormals<PointInT, PointNT, PointOutT>
+{
+public:
+  typedef typename pcl::Feature<PointInT, PointOutT>::PointCloudOut
+      PointCloudOut;
+
+  using pcl::Feature<PointInT, PointOutT>::feature_name_;
+  using pcl::Feature<PointInT, PointOutT>::indices_;
+  using pcl::Feature<PointInT, PointOutT>::input_;
+  using pcl::Feature<PointInT, PointOutT>::search_parameter_;
+  using pcl::Feature<PointInT, PointOutT>::surface_;
+  using pcl::FeatureFromNormals<PointInT, PointNT, PointOutT>::normals_;
+
+  FastPFHEstimation() : threads_(1)
+  {
+    feature_name_ = "FastPFHEstimation";
+  }
+
+  /* 0 for one thread per hardware thread */
+  void setNumberOfThreads(unsigned threads)
+  {
+    threads_ = threads > 0 ? threads
+                           : std::max(1u, std::thread::hardware_concurrency());
+  }
+
+protected:
+  unsigned threads_;
+
+  void computeFeature(PointCloudOut& output) override
+  {
+    static_assert(sizeof(output[0].histogram) ==
+                      PFH_BINS * PFH_BINS * PFH_BINS * sizeof(float),
+                  "PFH signature must have PFH_BINS^3 bins");
+    OrientedPoints cloud;
+    copyOrientedPoints(*surface_, *normals_, cloud);
+
+    const int size = int(indices_->size());
+#pragma omp parallel num_threads(int(threads_))
+    {
+      PairFeatures features(cloud);
+      std::vector<int> neighbours;
+      std::vector<float> distances;
+#pragma omp for schedule(dynamic, 16)
+      for (int i = 0; i < size; ++i) {
+        const int index = (*indices_)[size_t(i)];
+        float* histogram = output[size_t(i)].histogram;
+        if (!pcl::isFinite((*input_)[size_t(index)]) ||
+            this->searchForNeighbors(size_t(index), search_parameter_,
+                                     neighbours, distances) == 0) {
+          std::fill_n(histogram, PFH_BINS * PFH_BINS * PFH_BINS,
+                      std::numeric_limits<float>::quiet_NaN());
+          continue;
+        }
+        features.computePFH(neighbours, histogram);
+      }
+    }
+
+    output.is_dense =
+        std::all_of(output.begin(), output.end(), [](const PointOutT& p) {
+          return std::isfinite(p.histogram[0]);
+        });
+  }
+};
+
+template <typename PointInT, typename PointNT, typename PointOutT>
+class FastPFHEstimationOMP
+  : public FastPFHEstimation<PointInT, PointNT, PointOutT>
+{
+public:
+  explicit FastPFHEstimationOMP(unsigned threads = 0)
+  {
+    this->setNumberOfThreads(threads);
+  }
+};
+
+/* the same interface as pcl::FPFHEstimation and pcl::FPFHEstimationOMP */
+template <typename PointInT, typename PointNT, typename PointOutT>
+class FastFPFHEstimation
+  : public pcl::FeatureFromNormals<PointInT, PointNT, PointOutT>
+{
+public:
+  typedef typename pcl::Feature<PointInT, PointOutT>::PointCloudOut
+      PointCloudOut;
+
+  using pcl::Feature<PointInT, PointOutT>::feature_name_;
+  using pcl::Feature<PointInT, PointOutT>::indices_;
+  using pcl::Feature<PointInT, PointOutT>::input_;
+  using pcl::Feature<PointInT, PointOutT>::search_parameter_;
+  using pcl::Feature<PointInT, PointOutT>::surface_;
+  using pcl::FeatureFromNormals<PointInT, PointNT, PointOutT>::normals_;
+
+  FastFPFHEstimation() : threads_(1)
+  {
+    feature_name_ = "FastFPFHEstimation";
+  }
+
+  /* 0 for one thread per hardware thread */
+  void setNumberOfThreads(unsigned threads)
+  {
+    threads_ = threads > 0 ? threads
+                           : std::max(1u, std::thread::hardware_concurrency());
+  }
+
+protected:
+  unsigned threads_;
+
+  void computeFeature(PointCloudOut& output) override
+  {
+    static_assert(sizeof(output[0].histogram) ==
+                      3 * SPFH_BINS * sizeof(float),
+                  "FPFH signature must have 3 * SPFH_BINS bins");
+    OrientedPoints cloud;
+    copyOrientedPoints(*surface_, *normals_, cloud);
+
+    // neighbourhoods of keypoints are used both to find points needing SPFH
+    // and to weight SPFH
+    const int size = int(indices_->size());
+    std::vector<std::vector<int>> neighbours(indices_->size());
+    std::vector<std::vector<float>> distances(indices_->size());
+#pragma omp parallel for schedule(dynamic, 16) num_threads(int(threads_))
+    for (int i = 0; i < size; ++i) {
+      const int index = (*indices_)[size_t(i)];
+      if (!pcl::isFinite((*input_)[size_t(index)]) ||
+          this->searchForNeighbors(size_t(index), search_parameter_,
+                                   neighbours[size_t(i)],
+                                   distances[size_t(i)]) == 0) {
+        neighbours[size_t(i)].clear();
+      }
+    }
+
+    // one row of SPFH table for each surface point in some neighbourhood
+    std::vector<int> rows(surface_->size(), -1);
+    for (const auto& keypoint_neighbours : neighbours) {
+      for (int point : keypoint_neighbours) {
+        rows[size_t(point)] = 0;
+      }
+    }
+    std::vector<int> table_points;
+    for (size_t point = 0; point < rows.size(); ++point) {
+      if (rows[point] == 0) {
+        rows[point] = int(table_points.size());
+        table_points.push_back(int(point));
+      }
+    }
+
+    Eigen::Matrix<float, Eigen::Dynamic, 3 * SPFH_BINS, Eigen::RowMajor> table(
+        Eigen::Index(table_points.size()), 3 * SPFH_BINS);
+    table.setZero();
+    const int table_size = int(table_points.size());
+#pragma omp parallel num_threads(int(threads_))
+    {
+      PairFeatures features(cloud);
+      std::vector<int> point_neighbours;
+      std::vector<float> point_distances;
+#pragma omp for schedule(dynamic, 64)
+      for (int row = 0; row < table_size; ++row) {
+        const int point = table_points[size_t(row)];
+        if (this->searchForNeighbors(*surface_, size_t(point),
+                                     search_parameter_, point_neighbours,
+                                     point_distances) > 0) {
+          features.computeSPFH(point, point_neighbours, table.row(row).data());
+        }
+      }
+    }
+
+#pragma omp parallel for schedule(dynamic, 16) num_threads(int(threads_))
+    for (int i = 0; i < size; ++i) {
+      float* histogram = output[size_t(i)].histogram;
+      if (neighbours[size_t(i)].empty()) {
+        std::fill_n(histogram, 3 * SPFH_BINS,
+                    std::numeric_limits<float>::quiet_NaN());
+        continue;
+      }
+      weightSPFHSignatures(table, rows, neighbours[size_t(i)],
+                           distances[size_t(i)], histogram);
+    }
+
+    output.is_dense =
+        std::all_of(output.begin(), output.end(), [](const PointOutT& p) {
+          return std::isfinite(p.histogram[0]);
+        });
+  }
+};
+
+template <typename PointInT, typename PointNT, typename PointOutT>
+class FastFPFHEstimationOMP
+  : public FastFPFHEstimation<PointInT, PointNT, PointOutT>
+{
+public:
+  explicit FastFPFHEstimationOMP(unsigned threads = 0)
+  {
+    this->setNumberOfThreads(threads);
+  }
+};
+
+}  // namespace map_merge_3d
+
+#endif  // MAP_MERGE_FAST_PFH_H_
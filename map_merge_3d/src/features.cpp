@@ -2,15 +2,31 @@
 #include "dispatch_descriptors.h"
 
 #include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <exception>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
 
+#include <pcl/common/common.h>
+#include <pcl/common/io.h>
+#include <pcl/common/point_tests.h>
 #include <pcl/conversions.h>
 #include <pcl/features/normal_3d.h>
+#include <pcl/features/normal_3d_omp.h>
 #include <pcl/filters/filter.h>
 #include <pcl/filters/radius_outlier_removal.h>
 #include <pcl/filters/voxel_grid.h>
 #include <pcl/keypoints/harris_3d.h>
 #include <pcl/keypoints/sift_keypoint.h>
 #include <pcl/point_representation.h>
+#include <pcl/search/kdtree.h>
 
 namespace map_merge_3d
 {
@@ -26,11 +42,101 @@ PointCloudPtr downSample(const PointCloudConstPtr &input, double resolution)
   return output;
 }
 
+/* Counts neighbours in a voxel grid with cells of half the radius. Cells are
+ * hashed by their coordinates relative to the minimum of the cloud packed to
+ * 21 bits per axis. */
+static PointCloudPtr removeOutliersVoxelGrid(const PointCloudConstPtr &input,
+                                             double radius, int min_neighbors)
+{
+  static const int BITS = 21;
+  // neighbour cells may lie up to 2 cells below the minimum
+  static const int64_t PADDING = 2;
+
+  const double cell_size = radius / 2.;
+  Eigen::Vector4f min_point, max_point;
+  pcl::getMinMax3D(*input, min_point, max_point);
+  const Eigen::Array3d extent =
+      ((max_point - min_point).head<3>().cast<double>() / cell_size).array();
+  if (!(extent.maxCoeff() + 2 * PADDING < double(1 << BITS))) {
+    // map is too large for the packed keys
+    return removeOutliers(input, radius, min_neighbors, OutlierFilter::RADIUS);
+  }
+
+  auto cell_key = [&](const PointT &point) {
+    const uint64_t x = uint64_t((point.x - min_point.x()) / cell_size);
+    const uint64_t y = uint64_t((point.y - min_point.y()) / cell_size);
+    const uint64_t z = uint64_t((point.z - min_point.z()) / cell_size);
+    return ((x + PADDING) << (2 * BITS)) | ((y + PADDING) << BITS) |
+           (z + PADDING);
+  };
+
+  // count points in cells
+  std::unordered_map<uint64_t, size_t> cell_index;
+  cell_index.reserve(input->size() / 4);
+  std::vector<uint64_t> cells;
+  std::vector<int> counts;
+  std::vector<size_t> point_cells(input->size());
+  for (size_t i = 0; i < input->size(); ++i) {
+    const PointT &point = (*input)[i];
+    if (!pcl::isFinite(point)) {
+      continue;
+    }
+    const uint64_t key = cell_key(point);
+    auto inserted = cell_index.emplace(key, cells.size());
+    if (inserted.second) {
+      cells.push_back(key);
+      counts.push_back(0);
+    }
+    point_cells[i] = inserted.first->second;
+    ++counts[inserted.first->second];
+  }
+
+  // cells with centres within the radius, i.e. 2 cells, from the centre
+  std::vector<int64_t> offsets;
+  for (int64_t dx = -2; dx <= 2; ++dx) {
+    for (int64_t dy = -2; dy <= 2; ++dy) {
+      for (int64_t dz = -2; dz <= 2; ++dz) {
+        if (dx * dx + dy * dy + dz * dz <= 4) {
+          offsets.push_back(dx * (int64_t(1) << (2 * BITS)) +
+                            dy * (int64_t(1) << BITS) + dz);
+        }
+      }
+    }
+  }
+
+  // points in the neighbourhood of each cell, including the point itself
+  std::vector<int> neighbours(cells.size(), 0);
+  for (size_t c = 0; c < cells.size(); ++c) {
+    for (int64_t offset : offsets) {
+      auto cell = cell_index.find(cells[c] + uint64_t(offset));
+      if (cell != cell_index.end()) {
+        neighbours[c] += counts[cell->second];
+      }
+    }
+  }
+
+  PointCloudPtr output(new PointCloud);
+  output->header = input->header;
+  for (size_t i = 0; i < input->size(); ++i) {
+    const PointT &point = (*input)[i];
+    // the same condition as RadiusOutlierRemoval
+    if (pcl::isFinite(point) && neighbours[point_cells[i]] > min_neighbors) {
+      output->push_back(point);
+    }
+  }
+
+  return output;
+}
+
 /* Use a RadiusOutlierRemoval filter to remove all points with too few local
  * neighbors */
 PointCloudPtr removeOutliers(const PointCloudConstPtr &input, double radius,
-                             int min_neighbors)
+                             int min_neighbors, OutlierFilter method)
 {
+  if (method == OutlierFilter::VOXEL_GRID) {
+    return removeOutliersVoxelGrid(input, radius, min_neighbors);
+  }
+
   pcl::RadiusOutlierRemoval<PointT> filter;
   filter.setInputCloud(input);
   filter.setRadiusSearch(radius);
@@ -42,10 +148,20 @@ PointCloudPtr removeOutliers(const PointCloudConstPtr &input, double radius,
   return output;
 }
 
+/* resolves 0 to the number of hardware threads */
+static inline int threadCount(int threads)
+{
+  if (threads > 0) {
+    return threads;
+  }
+  return std::max(1, int(std::thread::hardware_concurrency()));
+}
+
 static PointCloudPtr detectKeypointsSIFT(const PointCloudConstPtr &points,
                                          double min_scale, int nr_octaves,
                                          int nr_scales_per_octave,
-                                         double min_contrast)
+                                         double min_contrast,
+                                         std::vector<float> &scales)
 {
   pcl::SIFTKeypoint<PointT, pcl::PointWithScale> detector;
   detector.setScales(float(min_scale), nr_octaves, nr_scales_per_octave);
@@ -57,6 +173,169 @@ static PointCloudPtr detectKeypointsSIFT(const PointCloudConstPtr &points,
 
   PointCloudPtr keypoints(new PointCloud);
   pcl::copyPointCloud(keypoints_temp, *keypoints);
+  for (const auto &keypoint : keypoints_temp) {
+    scales.push_back(keypoint.scale);
+  }
+
+  return keypoints;
+}
+
+/* difference of Gaussians extrema in one octave of the scale space, appends
+ * keypoints and their scales */
+static void detectOctaveExtrema(const PointCloudConstPtr &cloud,
+                                double base_scale, int nr_scales_per_octave,
+                                double min_contrast, int threads,
+                                PointCloud &keypoints,
+                                std::vector<float> &scales)
+{
+  // extrema are compared with this many nearest neighbours, the same as in
+  // pcl::SIFTKeypoint
+  static const size_t EXTREMA_NEIGHBOURS = 25;
+
+  // Gaussians of the octave, DoG is computed between adjacent ones
+  const int nr_gaussians = nr_scales_per_octave + 3;
+  const int nr_dog = nr_gaussians - 1;
+  Eigen::ArrayXf variances(nr_gaussians);
+  std::vector<float> sigmas(static_cast<size_t>(nr_gaussians));
+  for (int s = 0; s < nr_gaussians; ++s) {
+    sigmas[size_t(s)] = float(
+        base_scale * std::pow(2., double(s - 1) / nr_scales_per_octave));
+    variances[s] = sigmas[size_t(s)] * sigmas[size_t(s)];
+  }
+  // Gaussians are cut off at 3 standard deviations
+  const double max_radius = 3. * double(sigmas.back());
+
+  // sorted results
+  pcl::search::KdTree<PointT> tree;
+  tree.setInputCloud(cloud);
+
+  const int size = int(cloud->size());
+  Eigen::ArrayXf intensity(size);
+  for (int i = 0; i < size; ++i) {
+    // the same as pcl::common::IntensityFieldAccessor
+    const PointT &point = (*cloud)[size_t(i)];
+    intensity[i] = float(299 * point.r + 587 * point.g + 114 * point.b) *
+                   0.001f;
+  }
+
+  // one row of DoG responses per point
+  Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> dog(
+      size, nr_dog);
+  // nearest neighbours for extrema are taken from the same radius search,
+  // sorted hits are the nearest neighbours if there are enough of them
+  std::vector<int> nearest(size_t(size) * EXTREMA_NEIGHBOURS);
+  std::vector<size_t> nearest_count(static_cast<size_t>(size));
+#pragma omp parallel num_threads(threads)
+  {
+    std::vector<int> neighbours;
+    std::vector<float> distances;
+    Eigen::ArrayXf values;
+    Eigen::ArrayXf weights;
+    Eigen::ArrayXf response(nr_gaussians);
+#pragma omp for schedule(dynamic, 64)
+    for (int i = 0; i < size; ++i) {
+      // one search serves all scales of the octave
+      tree.radiusSearch(i, max_radius, neighbours, distances);
+      const Eigen::Index count = Eigen::Index(neighbours.size());
+      values.resize(count);
+      for (Eigen::Index j = 0; j < count; ++j) {
+        values[j] = intensity[neighbours[size_t(j)]];
+      }
+      const Eigen::Map<const Eigen::ArrayXf> squared_distances(
+          distances.data(), count);
+      // Gaussian filter response at each scale
+      for (int s = 0; s < nr_gaussians; ++s) {
+        const float variance = variances[s];
+        weights = (squared_distances * (-0.5f / variance)).exp();
+        weights = (squared_distances <= 9.f * variance).select(weights, 0.f);
+        response[s] = (weights * values).sum() / weights.sum();
+      }
+      dog.row(i) =
+          (response.tail(nr_dog) - response.head(nr_dog)).matrix().transpose();
+
+      // sparse points have nearest neighbours outside of the Gaussian radius
+      if (neighbours.size() < EXTREMA_NEIGHBOURS) {
+        tree.nearestKSearch(i, int(EXTREMA_NEIGHBOURS), neighbours, distances);
+      }
+      const size_t nearest_size =
+          std::min(neighbours.size(), EXTREMA_NEIGHBOURS);
+      std::copy_n(neighbours.begin(), nearest_size,
+                  nearest.begin() + ptrdiff_t(size_t(i) * EXTREMA_NEIGHBOURS));
+      nearest_count[size_t(i)] = nearest_size;
+    }
+  }
+
+  // bit for each DoG scale where the point is an extremum
+  std::vector<uint32_t> extrema(size_t(size), 0);
+#pragma omp parallel num_threads(threads)
+  {
+    Eigen::RowVectorXf min_dog(nr_dog);
+    Eigen::RowVectorXf max_dog(nr_dog);
+#pragma omp for schedule(static)
+    for (int i = 0; i < size; ++i) {
+      // extremes in the neighbourhood (including the point) at each scale
+      min_dog.setConstant(std::numeric_limits<float>::max());
+      max_dog.setConstant(-std::numeric_limits<float>::max());
+      for (size_t j = 0; j < nearest_count[size_t(i)]; ++j) {
+        const int neighbour = nearest[size_t(i) * EXTREMA_NEIGHBOURS + j];
+        min_dog = min_dog.cwiseMin(dog.row(neighbour));
+        max_dog = max_dog.cwiseMax(dog.row(neighbour));
+      }
+
+      for (int s = 1; s < nr_dog - 1; ++s) {
+        const float value = dog(i, s);
+        if (std::abs(value) < min_contrast) {
+          continue;
+        }
+        const bool is_minimum = value == min_dog[s] &&
+                                value < min_dog[s - 1] &&
+                                value < min_dog[s + 1];
+        const bool is_maximum = value == max_dog[s] &&
+                                value > max_dog[s - 1] &&
+                                value > max_dog[s + 1];
+        if (is_minimum || is_maximum) {
+          extrema[size_t(i)] |= 1u << s;
+        }
+      }
+    }
+  }
+
+  // the same order as pcl::SIFTKeypoint
+  for (int i = 0; i < size; ++i) {
+    for (int s = 1; s < nr_dog - 1; ++s) {
+      if (extrema[size_t(i)] & (1u << s)) {
+        keypoints.push_back((*cloud)[size_t(i)]);
+        scales.push_back(sigmas[size_t(s)]);
+      }
+    }
+  }
+}
+
+/* the same keypoints as pcl::SIFTKeypoint, but neighbourhoods are searched
+ * once per point and octave and responses are computed in parallel */
+static PointCloudPtr detectKeypointsFastSIFT(const PointCloudConstPtr &points,
+                                             double min_scale, int nr_octaves,
+                                             int nr_scales_per_octave,
+                                             double min_contrast, int threads,
+                                             std::vector<float> &scales)
+{
+  // smaller octaves are not searched, the same as in pcl::SIFTKeypoint
+  static const size_t MIN_OCTAVE_POINTS = 25;
+
+  PointCloudPtr keypoints(new PointCloud);
+  keypoints->header = points->header;
+  PointCloudConstPtr octave = points;
+  double scale = min_scale;
+  for (int i = 0; i < nr_octaves; ++i) {
+    // each octave is downsampled from the previous one
+    octave = downSample(octave, scale);
+    if (octave->size() < MIN_OCTAVE_POINTS) {
+      break;
+    }
+    detectOctaveExtrema(octave, scale, nr_scales_per_octave, min_contrast,
+                        threads, *keypoints, scales);
+    scale *= 2.;
+  }
 
   return keypoints;
 }
@@ -85,32 +364,135 @@ static PointCloudPtr detectKeypointsHarris(const PointCloudConstPtr &points,
 PointCloudPtr detectKeypoints(const PointCloudConstPtr &points,
                               const SurfaceNormalsPtr &normals, Keypoint type,
                               double threshold, double radius,
-                              double resolution)
+                              double resolution, int threads,
+                              std::vector<float> *scales)
 {
+  PointCloudPtr keypoints;
+  std::vector<float> keypoint_scales;
   switch (type) {
     case Keypoint::SIFT:
-      return detectKeypointsSIFT(points, resolution, 3, 3, threshold);
+      keypoints = detectKeypointsSIFT(points, resolution, 3, 3, threshold,
+                                      keypoint_scales);
+      break;
     case Keypoint::HARRIS:
-      return detectKeypointsHarris(points, normals, threshold, radius);
+      keypoints = detectKeypointsHarris(points, normals, threshold, radius);
+      // single scale
+      keypoint_scales.assign(keypoints->size(), float(resolution));
+      break;
+    case Keypoint::FAST_SIFT:
+      keypoints =
+          detectKeypointsFastSIFT(points, resolution, 3, 3, threshold,
+                                  threadCount(threads), keypoint_scales);
+      break;
   }
+
+  if (scales) {
+    // relative to the smallest scale
+    scales->clear();
+    for (float scale : keypoint_scales) {
+      scales->push_back(scale / float(resolution));
+    }
+  }
+
+  return keypoints;
 }
 
-/* implementation for specific descriptor type  */
-template <typename DescriptorExtractor, typename DescriptorT>
-static LocalDescriptorsPtr
-computeLocalDescriptors(const PointCloudConstPtr &points,
-                        const SurfaceNormalsPtr &normals,
-                        const PointCloudPtr &keypoints, double feature_radius)
+/* estimator parallelized by PCL */
+template <typename Estimator, typename DescriptorT>
+static void estimateDescriptors(const PointCloudConstPtr &points,
+                                const SurfaceNormalsPtr &normals,
+                                const PointCloudPtr &keypoints,
+                                double feature_radius, int threads,
+                                pcl::PointCloud<DescriptorT> &descriptors,
+                                std::true_type)
 {
-  DescriptorExtractor descriptor;
+  Estimator descriptor;
+  descriptor.setNumberOfThreads(unsigned(threads));
   descriptor.setRadiusSearch(feature_radius);
   descriptor.setSearchSurface(points);
   descriptor.setInputNormals(normals);
   descriptor.setInputCloud(keypoints);
+  descriptor.compute(descriptors);
+}
+
+/* single-threaded estimator runs for chunks of keypoints in parallel */
+template <typename Estimator, typename DescriptorT>
+static void estimateDescriptors(const PointCloudConstPtr &points,
+                                const SurfaceNormalsPtr &normals,
+                                const PointCloudPtr &keypoints,
+                                double feature_radius, int threads,
+                                pcl::PointCloud<DescriptorT> &descriptors,
+                                std::false_type)
+{
+  // more chunks than threads balance uneven neighbourhoods
+  const int chunks = int(std::min<size_t>(
+      std::max<size_t>(keypoints->size(), 1), size_t(threads) * 4));
+  // all chunks share the same search tree
+  pcl::search::KdTree<PointT>::Ptr tree(
+      new pcl::search::KdTree<PointT>(false));
+  tree->setInputCloud(points);
+
+  std::vector<typename pcl::PointCloud<DescriptorT>::Ptr> chunk_descriptors(
+      static_cast<size_t>(chunks));
+  std::vector<std::exception_ptr> errors(static_cast<size_t>(chunks));
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+  for (int c = 0; c < chunks; ++c) {
+    try {
+      const size_t begin = keypoints->size() * size_t(c) / size_t(chunks);
+      const size_t end = keypoints->size() * size_t(c + 1) / size_t(chunks);
+      pcl::IndicesPtr indices(new std::vector<int>(end - begin));
+      std::iota(indices->begin(), indices->end(), int(begin));
+
+      Estimator descriptor;
+      descriptor.setRadiusSearch(feature_radius);
+      descriptor.setSearchMethod(tree);
+      descriptor.setSearchSurface(points);
+      descriptor.setInputNormals(normals);
+      descriptor.setInputCloud(keypoints);
+      descriptor.setIndices(indices);
+      chunk_descriptors[size_t(c)].reset(new pcl::PointCloud<DescriptorT>);
+      descriptor.compute(*chunk_descriptors[size_t(c)]);
+    } catch (...) {
+      errors[size_t(c)] = std::current_exception();
+    }
+  }
+
+  for (size_t c = 0; c < chunk_descriptors.size(); ++c) {
+    if (errors[c]) {
+      std::rethrow_exception(errors[c]);
+    }
+    descriptors += *chunk_descriptors[c];
+  }
+}
 
+/* implementation for specific descriptor type  */
+template <typename DescriptorExtractor, typename ParallelDescriptorExtractor,
+          typename DescriptorT>
+static LocalDescriptorsPtr
+computeLocalDescriptors(const PointCloudConstPtr &points,
+                        const SurfaceNormalsPtr &normals,
+                        const PointCloudPtr &keypoints, double feature_radius,
+                        int threads)
+{
   typename pcl::PointCloud<DescriptorT>::Ptr descriptors(
       new pcl::PointCloud<DescriptorT>);
-  descriptor.compute(*descriptors);
+  if (threads == 1) {
+    DescriptorExtractor descriptor;
+    descriptor.setRadiusSearch(feature_radius);
+    descriptor.setSearchSurface(points);
+    descriptor.setInputNormals(normals);
+    descriptor.setInputCloud(keypoints);
+    descriptor.compute(*descriptors);
+  } else {
+    // estimators without parallel variant are declared twice
+    typedef std::integral_constant<
+        bool, !std::is_same<DescriptorExtractor,
+                            ParallelDescriptorExtractor>::value>
+        HasParallelExtractor;
+    estimateDescriptors<ParallelDescriptorExtractor>(
+        points, normals, keypoints, feature_radius, threads, *descriptors,
+        HasParallelExtractor());
+  }
 
   // remove invalid descriptors (it might not be possible to compute descriptors
   // for all keypoints)
@@ -153,27 +535,82 @@ LocalDescriptorsPtr computeLocalDescriptors(const PointCloudConstPtr &points,
                                             const SurfaceNormalsPtr &normals,
                                             const PointCloudPtr &keypoints,
                                             Descriptor descriptor,
-                                            double feature_radius)
+                                            double feature_radius, int threads)
 {
+  threads = threadCount(threads);
   // this will be dispatched for all descriptors type
   auto functor = [&](auto descriptor_type) {
     return computeLocalDescriptors<
         typename decltype(descriptor_type)::Estimator,
+        typename decltype(descriptor_type)::ParallelEstimator,
         typename decltype(descriptor_type)::PointType>(
-        points, normals, keypoints, feature_radius);
+        points, normals, keypoints, feature_radius, threads);
   };
   return dispatchForEachDescriptor(descriptor, functor);
 }
 
-SurfaceNormalsPtr computeSurfaceNormals(const PointCloudConstPtr &input,
-                                        double radius)
+LocalDescriptorsPtr computeLocalDescriptors(const PointCloudConstPtr &points,
+                                            const SurfaceNormalsPtr &normals,
+                                            const PointCloudPtr &keypoints,
+                                            Descriptor descriptor,
+                                            double feature_radius, int threads,
+                                            const std::vector<float> &scales)
 {
-  pcl::NormalEstimation<PointT, NormalT> estimator;
-  estimator.setRadiusSearch(radius);
-  estimator.setInputCloud(input);
+  if (scales.size() != keypoints->size()) {
+    throw std::invalid_argument("scales do not match keypoints");
+  }
+  if (keypoints->empty()) {
+    return computeLocalDescriptors(points, normals, keypoints, descriptor,
+                                   feature_radius, threads);
+  }
 
+  // keypoints with the same scale share the radius
+  std::map<float, PointCloudPtr> scale_keypoints;
+  for (size_t i = 0; i < keypoints->size(); ++i) {
+    PointCloudPtr &group = scale_keypoints[scales[i]];
+    if (!group) {
+      group.reset(new PointCloud);
+      group->header = keypoints->header;
+    }
+    group->push_back((*keypoints)[i]);
+  }
+
+  keypoints->clear();
+  LocalDescriptorsPtr result;
+  for (const auto &group : scale_keypoints) {
+    LocalDescriptorsPtr descriptors = computeLocalDescriptors(
+        points, normals, group.second, descriptor,
+        feature_radius * double(group.first), threads);
+    *keypoints += *group.second;
+    if (!result) {
+      result = descriptors;
+    } else {
+      LocalDescriptorsPtr concatenated(new LocalDescriptors);
+      pcl::concatenatePointCloud(*result, *descriptors, *concatenated);
+      result = concatenated;
+    }
+  }
+
+  return result;
+}
+
+SurfaceNormalsPtr computeSurfaceNormals(const PointCloudConstPtr &input,
+                                        double radius, int threads)
+{
   SurfaceNormalsPtr normals(new SurfaceNormals);
-  estimator.compute(*normals);
+  threads = threadCount(threads);
+  if (threads == 1) {
+    pcl::NormalEstimation<PointT, NormalT> estimator;
+    estimator.setRadiusSearch(radius);
+    estimator.setInputCloud(input);
+    estimator.compute(*normals);
+  } else {
+    pcl::NormalEstimationOMP<PointT, NormalT> estimator(
+        static_cast<unsigned>(threads));
+    estimator.setRadiusSearch(radius);
+    estimator.setInputCloud(input);
+    estimator.compute(*normals);
+  }
 
   return normals;
 }
@@ -4,6 +4,8 @@
 #include <cassert>
 #include <unordered_set>
 
+#include <Eigen/Geometry>
+
 size_t numberOfNodesInEstimates(
     const std::vector<TransformEstimate> &pairwise_estimates)
 {
@@ -56,9 +58,22 @@ size_t DisjointSets::mergeSets(size_t set1, size_t set2)
   return set2;
 }
 
-void Graph::addEdge(size_t from, size_t to, double weight)
+void Graph::create(size_t num_vertices, const std::vector<GraphEdge> &edges)
 {
-  edges_[from].emplace_back(from, to, weight);
+  // counting sort of edges by their source vertex, keeps the given order
+  offsets_.assign(num_vertices + 1, 0);
+  for (const auto &edge : edges) {
+    assert(edge.from < num_vertices && edge.to < num_vertices);
+    ++offsets_[edge.from + 1];
+  }
+  for (size_t i = 0; i < num_vertices; ++i) {
+    offsets_[i + 1] += offsets_[i];
+  }
+  std::vector<size_t> next(offsets_.begin(), offsets_.end() - 1);
+  edges_.assign(edges.size(), GraphEdge(0, 0, 0.));
+  for (const auto &edge : edges) {
+    edges_[next[edge.from]++] = edge;
+  }
 }
 
 std::vector<TransformEstimate> largestConnectedComponent(
@@ -107,18 +122,18 @@ void findMaxSpanningTree(
 {
   const size_t num_nodes = numberOfNodesInEstimates(pairwise_estimates);
 
-  Graph graph(num_nodes);
   std::vector<GraphEdge> edges;
+  edges.reserve(pairwise_estimates.size());
 
-  // Construct graph from pairwise_estimates
-  for (const auto &est : pairwise_estimates) {
-    graph.addEdge(est.source_idx, est.target_idx, est.confidence);
-    edges.emplace_back(est.source_idx, est.target_idx, est.confidence);
+  // Construct graph edges from pairwise_estimates
+  for (size_t i = 0; i < pairwise_estimates.size(); ++i) {
+    const auto &est = pairwise_estimates[i];
+    edges.emplace_back(est.source_idx, est.target_idx, est.confidence, i);
   }
 
   DisjointSets comps(num_nodes);
-  span_tree.create(num_nodes);
-  std::vector<size_t> span_tree_powers(num_nodes, 0);
+  std::vector<GraphEdge> span_tree_edges;
+  span_tree_edges.reserve(2 * num_nodes);
 
   // Find maximum spanning tree
   sort(edges.begin(), edges.end(), std::greater<GraphEdge>());
@@ -127,49 +142,226 @@ void findMaxSpanningTree(
     size_t comp2 = comps.findSetByElem(edges[i].to);
     if (comp1 != comp2) {
       comps.mergeSets(comp1, comp2);
-      span_tree.addEdge(edges[i].from, edges[i].to, edges[i].weight);
-      span_tree.addEdge(edges[i].to, edges[i].from, edges[i].weight);
-      span_tree_powers[edges[i].from]++;
-      span_tree_powers[edges[i].to]++;
+      span_tree_edges.push_back(edges[i]);
+      span_tree_edges.emplace_back(edges[i].to, edges[i].from, edges[i].weight,
+                                   edges[i].index);
     }
   }
+  span_tree.create(num_nodes, span_tree_edges);
+
+  centers.clear();
+  if (num_nodes == 0) {
+    return;
+  }
 
-  // Find spanning tree leafs
-  std::vector<size_t> span_tree_leafs;
+  // Peel spanning tree leafs layer by layer, the last layer are the centers.
+  // Nodes without any edge are not part of the tree.
+  std::vector<size_t> powers(num_nodes);
+  std::vector<size_t> layer;
+  size_t remaining = 0;
   for (size_t i = 0; i < num_nodes; ++i) {
-    if (span_tree_powers[i] == 1) {
-      span_tree_leafs.push_back(i);
+    powers[i] = span_tree.degree(i);
+    if (powers[i] > 0) {
+      ++remaining;
     }
+    if (powers[i] == 1) {
+      layer.push_back(i);
+    }
+  }
+  std::vector<size_t> next_layer;
+  while (remaining > 2) {
+    remaining -= layer.size();
+    next_layer.clear();
+    for (size_t leaf : layer) {
+      powers[leaf] = 0;
+      Graph::EdgeIterator edge = span_tree.adjacentBegin(leaf);
+      for (; edge != span_tree.adjacentEnd(leaf); ++edge) {
+        if (powers[edge->to] > 0 && --powers[edge->to] == 1) {
+          next_layer.push_back(edge->to);
+        }
+      }
+    }
+    if (next_layer.empty()) {
+      break;
+    }
+    layer.swap(next_layer);
+  }
+  centers = std::move(layer);
+  std::sort(centers.begin(), centers.end());
+
+  // no edges at all
+  if (centers.empty()) {
+    centers.push_back(0);
+  }
+
+  assert(centers.size() > 0 && centers.size() <= 2);
+}
+
+LoopConsistency::LoopConsistency(size_t num_nodes,
+                                 double max_translation_error,
+                                 double max_rotation_error)
+  : max_translation_error_(max_translation_error)
+  , max_rotation_error_(max_rotation_error)
+  , neighbours_(num_nodes)
+{
+}
+
+uint64_t LoopConsistency::key(size_t from, size_t to)
+{
+  if (from > to) {
+    std::swap(from, to);
+  }
+  return (uint64_t(from) << 32) | uint64_t(to);
+}
+
+const LoopConsistency::Edge *LoopConsistency::findEdge(size_t from,
+                                                       size_t to) const
+{
+  auto it = edges_index_.find(key(from, to));
+  if (it == edges_index_.end()) {
+    return nullptr;
   }
+  return &edges_[it->second];
+}
+
+/* transform mapping points of from into the frame of to, the inverse of
+ * getTransform in map_merging, which maps points of to into from */
+Eigen::Matrix4f LoopConsistency::relativeTransform(size_t from,
+                                                   size_t to) const
+{
+  const TransformEstimate &est = findEdge(from, to)->estimate;
+  if (est.source_idx == from) {
+    return est.transform;
+  }
+  return est.transform.inverse();
+}
+
+bool LoopConsistency::isConsistent(size_t a, size_t b, size_t c) const
+{
+  const Eigen::Matrix4f loop = relativeTransform(c, a) *
+                               relativeTransform(b, c) *
+                               relativeTransform(a, b);
+  const float translation = loop.block<3, 1>(0, 3).norm();
+  const float rotation =
+      Eigen::AngleAxisf(Eigen::Matrix3f(loop.block<3, 3>(0, 0))).angle();
+  return translation <= max_translation_error_ &&
+         rotation <= max_rotation_error_;
+}
+
+void LoopConsistency::addEstimate(const TransformEstimate &estimate)
+{
+  const size_t a = estimate.source_idx;
+  const size_t b = estimate.target_idx;
+  if (a == b || std::max(a, b) >= neighbours_.size() ||
+      estimate.transform.isZero() || findEdge(a, b)) {
+    return;
+  }
+  edges_index_.emplace(key(a, b), edges_.size());
+  edges_.push_back({estimate, 0, 0});
 
-  // Find maximum distance from each spanning tree vertex
-  std::vector<size_t> max_dists(num_nodes, 0);
-  std::vector<size_t> cur_dists;
-  for (size_t i = 0; i < span_tree_leafs.size(); ++i) {
-    cur_dists.assign(num_nodes, 0);
-    span_tree.walkBreadthFirst(span_tree_leafs[i], [&cur_dists](auto edge) {
-      return cur_dists[edge.to] = cur_dists[edge.from] + 1;
-    });
-    for (size_t j = 0; j < num_nodes; ++j) {
-      max_dists[j] = std::max(max_dists[j], cur_dists[j]);
+  // loops closed by the new edge
+  const std::vector<size_t> &smaller =
+      neighbours_[a].size() < neighbours_[b].size() ? neighbours_[a] :
+                                                      neighbours_[b];
+  const size_t other = &smaller == &neighbours_[a] ? b : a;
+  for (size_t c : smaller) {
+    if (!findEdge(c, other)) {
+      continue;
+    }
+    const bool consistent = isConsistent(a, b, c);
+    for (size_t edge : {edges_index_[key(a, b)], edges_index_[key(b, c)],
+                        edges_index_[key(c, a)]}) {
+      if (consistent) {
+        ++edges_[edge].consistent;
+      } else {
+        ++edges_[edge].inconsistent;
+      }
     }
   }
+  neighbours_[a].push_back(b);
+  neighbours_[b].push_back(a);
+}
 
-  // Find min-max distance
-  size_t min_max_dist = max_dists[0];
-  for (size_t i = 1; i < num_nodes; ++i) {
-    if (min_max_dist > max_dists[i]) {
-      min_max_dist = max_dists[i];
+bool LoopConsistency::isImplied(size_t from, size_t to) const
+{
+  if (std::max(from, to) >= neighbours_.size()) {
+    return false;
+  }
+  for (size_t c : neighbours_[from]) {
+    const Edge *first = findEdge(from, c);
+    const Edge *second = findEdge(c, to);
+    if (second && first->consistent > 0 && second->consistent > 0) {
+      return true;
     }
   }
+  return false;
+}
 
-  // Find spanning tree centers
-  centers.clear();
-  for (size_t i = 0; i < num_nodes; ++i) {
-    if (max_dists[i] == min_max_dist) {
-      centers.push_back(i);
+std::vector<TransformEstimate>
+LoopConsistency::consistentEstimates(size_t &rejected) const
+{
+  std::vector<Edge> edges = edges_;
+  std::vector<bool> removed(edges.size(), false);
+  auto edgeIndex = [this](size_t from, size_t to) {
+    return edges_index_.find(key(from, to))->second;
+  };
+
+  rejected = 0;
+  while (true) {
+    // the worst edge still in an inconsistent loop
+    size_t worst = edges.size();
+    for (size_t i = 0; i < edges.size(); ++i) {
+      if (removed[i] || edges[i].inconsistent == 0) {
+        continue;
+      }
+      if (worst == edges.size()) {
+        worst = i;
+        continue;
+      }
+      const long excess =
+          long(edges[i].inconsistent) - long(edges[i].consistent);
+      const long worst_excess =
+          long(edges[worst].inconsistent) - long(edges[worst].consistent);
+      if (excess > worst_excess ||
+          (excess == worst_excess && edges[i].estimate.confidence <
+                                         edges[worst].estimate.confidence)) {
+        worst = i;
+      }
+    }
+    if (worst == edges.size()) {
+      break;
+    }
+
+    // loops with the removed edge do not count anymore
+    removed[worst] = true;
+    ++rejected;
+    const size_t a = edges[worst].estimate.source_idx;
+    const size_t b = edges[worst].estimate.target_idx;
+    for (size_t c : neighbours_[a]) {
+      if (!findEdge(c, b)) {
+        continue;
+      }
+      const size_t ac = edgeIndex(a, c);
+      const size_t bc = edgeIndex(b, c);
+      if (removed[ac] || removed[bc]) {
+        continue;
+      }
+      const bool consistent = isConsistent(a, b, c);
+      for (size_t edge : {ac, bc}) {
+        if (consistent) {
+          --edges[edge].consistent;
+        } else {
+          --edges[edge].inconsistent;
+        }
+      }
     }
   }
 
-  assert(centers.size() > 0 && centers.size() <= 2);
+  std::vector<TransformEstimate> result;
+  for (size_t i = 0; i < edges.size(); ++i) {
+    if (!removed[i]) {
+      result.push_back(edges[i].estimate);
+    }
+  }
+  return result;
 }
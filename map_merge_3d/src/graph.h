@@ -10,30 +10,18 @@ Many modifications has been done to fit our pipeline. OpenCV uses the same
 license as this project (BSD).
 */
 
-#include <list>
+#include <cstddef>
+#include <cstdint>
 #include <queue>
+#include <unordered_map>
 #include <vector>
 
 #include <Eigen/Core>
 
-using std::size_t;
-
-/**
- * @brief Represents transformation estiamte between 2 clouds
- */
-struct TransformEstimate {
-  TransformEstimate() = default;
-  TransformEstimate(size_t source_idx_, size_t target_idx_)
-    : source_idx(source_idx_), target_idx(target_idx_)
-  {
-  }
+#include <map_merge_3d/matching.h>
 
-  size_t source_idx;  // source cloud index
-  size_t target_idx;
-
-  Eigen::Matrix4f transform;
-  double confidence = 0.0;
-};
+using std::size_t;
+using map_merge_3d::TransformEstimate;
 
 class DisjointSets
 {
@@ -55,7 +43,7 @@ private:
 };
 
 struct GraphEdge {
-  GraphEdge(size_t from, size_t to, double weight);
+  GraphEdge(size_t from, size_t to, double weight, size_t index = 0);
   bool operator<(const GraphEdge& other) const
   {
     return weight < other.weight;
@@ -67,46 +55,66 @@ struct GraphEdge {
 
   size_t from, to;
   double weight;
+  // index of the estimate this edge was created from
+  size_t index;
 };
 
-inline GraphEdge::GraphEdge(size_t _from, size_t _to, double _weight)
-  : from(_from), to(_to), weight(_weight)
+inline GraphEdge::GraphEdge(size_t _from, size_t _to, double _weight,
+                            size_t _index)
+  : from(_from), to(_to), weight(_weight), index(_index)
 {
 }
 
+/**
+ * @brief Static graph in compressed sparse row format
+ * @details Edges going from each vertex are stored contiguously in the order
+ * they were given, offsets_ index the first edge of each vertex.
+ */
 class Graph
 {
 public:
+  typedef std::vector<GraphEdge>::const_iterator EdgeIterator;
+
   Graph(size_t num_vertices = 0)
   {
-    create(num_vertices);
+    create(num_vertices, {});
   }
-  void create(size_t num_vertices)
+  void create(size_t num_vertices, const std::vector<GraphEdge>& edges);
+  size_t numVertices() const
   {
-    edges_.assign(num_vertices, std::list<GraphEdge>());
+    return offsets_.size() - 1;
   }
-  size_t numVertices() const
+  size_t numEdges() const
   {
     return edges_.size();
   }
-  void addEdge(size_t from, size_t to, double weight);
+  size_t degree(size_t vertex) const
+  {
+    return offsets_[vertex + 1] - offsets_[vertex];
+  }
+  EdgeIterator adjacentBegin(size_t vertex) const
+  {
+    return edges_.begin() + std::ptrdiff_t(offsets_[vertex]);
+  }
+  EdgeIterator adjacentEnd(size_t vertex) const
+  {
+    return edges_.begin() + std::ptrdiff_t(offsets_[vertex + 1]);
+  }
   template <typename B>
   B forEach(B body) const;
   template <typename B>
   B walkBreadthFirst(size_t from, B body) const;
 
 private:
-  std::vector<std::list<GraphEdge>> edges_;
+  std::vector<size_t> offsets_;
+  std::vector<GraphEdge> edges_;
 };
 
 template <typename B>
 B Graph::forEach(B body) const
 {
-  for (size_t i = 0; i < numVertices(); ++i) {
-    std::list<GraphEdge>::const_iterator edge = edges_[i].begin();
-    for (; edge != edges_[i].end(); ++edge)
-      body(*edge);
-  }
+  for (const auto& edge : edges_)
+    body(edge);
   return body;
 }
 
@@ -123,8 +131,8 @@ B Graph::walkBreadthFirst(size_t from, B body) const
     size_t vertex = vertices.front();
     vertices.pop();
 
-    std::list<GraphEdge>::const_iterator edge = edges_[vertex].begin();
-    for (; edge != edges_[vertex].end(); ++edge) {
+    EdgeIterator edge = adjacentBegin(vertex);
+    for (; edge != adjacentEnd(vertex); ++edge) {
       if (!was[edge->to]) {
         body(*edge);
         was[edge->to] = true;
@@ -153,11 +161,14 @@ std::vector<TransformEstimate> largestConnectedComponent(
 
 /**
  * @brief Computes maximum spanning tree in the graph of the estimates
- * @details Uses confidence to weight edges.
+ * @details Uses confidence to weight edges. Edges of the tree refer to
+ * pairwise_estimates by their index. Centers are found by repeatedly removing
+ * leaves of the tree, which takes linear time.
  *
  * @param pairwise_estimates estimates graph edges. Must be connected graph.
- * @param span_tree returned spanning tree
- * @param centers returned centers of the spanning tree
+ * @param span_tree returned spanning tree, contains each edge in both
+ * directions
+ * @param centers returned centers of the spanning tree in ascending order
  */
 void findMaxSpanningTree(
     const std::vector<TransformEstimate>& pairwise_estimates, Graph& span_tree,
@@ -166,4 +177,65 @@ void findMaxSpanningTree(
 size_t numberOfNodesInEstimates(
     const std::vector<TransformEstimate>& pairwise_estimates);
 
+/**
+ * @brief Checks consistency of estimates in loops of three nodes
+ * @details Chaining transforms along a loop must give identity. Estimates are
+ * added incrementally, each loop is checked when its last estimate is added.
+ * Every estimate counts consistent and inconsistent loops it belongs to.
+ */
+class LoopConsistency
+{
+public:
+  /**
+   * @param num_nodes number of nodes in estimates
+   * @param max_translation_error maximum translation of the chained loop
+   * @param max_rotation_error maximum rotation angle of the chained loop
+   */
+  LoopConsistency(size_t num_nodes, double max_translation_error,
+                  double max_rotation_error);
+
+  /**
+   * @brief Adds estimate and checks all loops it closes
+   * @details Estimates with zero transform and repeated estimates of the same
+   * pair are ignored.
+   */
+  void addEstimate(const TransformEstimate& estimate);
+
+  /**
+   * @brief Whether the transform between nodes is implied by consistent loops
+   * @details True if both nodes have an estimate with a common node and both
+   * these estimates are verified by a consistent loop.
+   */
+  bool isImplied(size_t from, size_t to) const;
+
+  /**
+   * @brief Returns added estimates without estimates breaking loops
+   * @details Repeatedly removes the estimate with the largest excess of
+   * inconsistent loops over consistent loops (the less confident one on
+   * ties) until no inconsistent loop remains.
+   *
+   * @param rejected returned number of removed estimates
+   */
+  std::vector<TransformEstimate> consistentEstimates(size_t& rejected) const;
+
+private:
+  struct Edge {
+    TransformEstimate estimate;
+    size_t consistent;
+    size_t inconsistent;
+  };
+
+  static uint64_t key(size_t from, size_t to);
+  const Edge* findEdge(size_t from, size_t to) const;
+  Eigen::Matrix4f relativeTransform(size_t from, size_t to) const;
+  bool isConsistent(size_t a, size_t b, size_t c) const;
+
+  double max_translation_error_;
+  double max_rotation_error_;
+  std::vector<Edge> edges_;
+  // pair of nodes -> index to edges_
+  std::unordered_map<uint64_t, size_t> edges_index_;
+  std::vector<std::vector<size_t>> neighbours_;
+};
+
 #endif  // MAP_MERGE_GRAPH_H_
@@ -0,0 +1,373 @@
+#include <map_merge_3d/instrumentation.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <fstream>
+#include <unordered_map>
+
+namespace map_merge_3d
+{
+Tracer::Tracer()
+  : enabled_(false)
+  , epoch_(std::chrono::steady_clock::now())
+  , capacity_(100000)
+  , recorded_(0)
+  , peak_reset_(true)
+{
+}
+
+Tracer &Tracer::global()
+{
+  static Tracer tracer;
+  return tracer;
+}
+
+void Tracer::setCapacity(size_t capacity)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  capacity_ = capacity;
+  while (events_.size() > capacity_) {
+    events_.pop_front();
+  }
+}
+
+int64_t Tracer::now() const
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now() - epoch_)
+      .count();
+}
+
+void Tracer::record(TraceEvent event)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++recorded_;
+  if (capacity_ == 0) {
+    return;
+  }
+  if (events_.size() >= capacity_) {
+    events_.pop_front();
+  }
+  events_.emplace_back(std::move(event));
+}
+
+void Tracer::counter(const std::string &name, double value)
+{
+  if (!enabled_) {
+    return;
+  }
+  TraceEvent event;
+  event.name = name;
+  event.category = "counter";
+  event.start = now();
+  event.duration = -1;  // marks counter sample
+  event.counters.emplace_back(name, value);
+  record(std::move(event));
+}
+
+void Tracer::clear()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  events_.clear();
+}
+
+std::vector<TraceEvent> Tracer::events() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return {events_.begin(), events_.end()};
+}
+
+std::vector<TraceEvent> Tracer::events(uint64_t &cursor) const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  // events_ holds the last events_.size() recorded events
+  const uint64_t first = recorded_ - events_.size();
+  const uint64_t skip = cursor > first ? cursor - first : 0;
+  cursor = recorded_;
+  if (skip >= events_.size()) {
+    return {};
+  }
+  return {events_.begin() + std::ptrdiff_t(skip), events_.end()};
+}
+
+static inline void addCounters(
+    std::vector<std::pair<std::string, double>> &sums,
+    const std::vector<std::pair<std::string, double>> &counters)
+{
+  for (const auto &counter : counters) {
+    auto it = std::find_if(sums.begin(), sums.end(), [&](const auto &sum) {
+      return sum.first == counter.first;
+    });
+    if (it == sums.end()) {
+      sums.emplace_back(counter);
+    } else {
+      it->second += counter.second;
+    }
+  }
+}
+
+/* aggregates events accepted by filter */
+template <typename Filter>
+static std::vector<StageStatistics>
+aggregateStatistics(const std::deque<TraceEvent> &events, Filter filter)
+{
+  std::vector<StageStatistics> result;
+  std::unordered_map<std::string, size_t> stages;
+
+  for (const auto &event : events) {
+    if (event.duration < 0 || !filter(event)) {
+      continue;
+    }
+    auto it = stages.find(event.name);
+    if (it == stages.end()) {
+      it = stages.emplace(event.name, result.size()).first;
+      result.emplace_back();
+      result.back().name = event.name;
+    }
+    StageStatistics &stage = result[it->second];
+    const double time = event.duration / 1000.;
+    ++stage.calls;
+    stage.total_time += time;
+    stage.max_time = std::max(stage.max_time, time);
+    stage.peak_rss = std::max(stage.peak_rss, event.peak_rss);
+    addCounters(stage.counters, event.counters);
+  }
+
+  return result;
+}
+
+std::vector<StageStatistics> Tracer::statistics(int64_t since) const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return aggregateStatistics(events_, [since](const TraceEvent &event) {
+    return event.start >= since;
+  });
+}
+
+std::vector<StageStatistics> Tracer::statistics(int64_t since,
+                                                uint32_t thread) const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return aggregateStatistics(events_, [since, thread](const TraceEvent &event) {
+    return event.start >= since && event.thread == thread;
+  });
+}
+
+/* escapes string for JSON output */
+static inline std::string jsonString(const std::string &s)
+{
+  std::string result = "\"";
+  for (char c : s) {
+    switch (c) {
+      case '"':
+        result += "\\\"";
+        break;
+      case '\\':
+        result += "\\\\";
+        break;
+      case '\n':
+        result += "\\n";
+        break;
+      default:
+        result += c;
+    }
+  }
+  result += '"';
+  return result;
+}
+
+/* writes one event of Chrome trace */
+static void writeChromeTraceEvent(std::ostream &stream,
+                                  const TraceEvent &event)
+{
+  stream << "\n{\"name\":" << jsonString(event.name)
+         << ",\"cat\":" << jsonString(event.category) << ",\"pid\":1"
+         << ",\"tid\":" << event.thread << ",\"ts\":" << event.start;
+  if (event.duration < 0) {
+    stream << ",\"ph\":\"C\"";
+  } else {
+    stream << ",\"ph\":\"X\",\"dur\":" << event.duration;
+  }
+  stream << ",\"args\":{";
+  bool first_arg = true;
+  for (const auto &counter : event.counters) {
+    if (!first_arg) {
+      stream << ",";
+    }
+    first_arg = false;
+    stream << jsonString(counter.first) << ":" << counter.second;
+  }
+  if (event.duration >= 0) {
+    if (!first_arg) {
+      stream << ",";
+    }
+    stream << "\"rss_delta\":" << event.rss_delta
+           << ",\"peak_rss\":" << event.peak_rss;
+  }
+  stream << "}}";
+}
+
+void Tracer::writeChromeTrace(std::ostream &stream) const
+{
+  std::vector<TraceEvent> all_events = events();
+
+  stream << "{\"traceEvents\":[";
+  bool first = true;
+  for (const auto &event : all_events) {
+    if (!first) {
+      stream << ",";
+    }
+    first = false;
+    writeChromeTraceEvent(stream, event);
+  }
+  stream << "\n],\"displayTimeUnit\":\"ms\"}" << std::endl;
+}
+
+/* small sequential ids are better readable in trace viewers */
+uint32_t Tracer::currentThread()
+{
+  static std::atomic<uint32_t> next_id(1);
+  thread_local uint32_t id = next_id++;
+  return id;
+}
+
+/* reads memory fields (in kB) from /proc/self/status in one pass */
+static inline void readMemoryStatus(int64_t *rss, int64_t *peak)
+{
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  int missing = (rss ? 1 : 0) + (peak ? 1 : 0);
+  while (missing > 0 && std::getline(status, line)) {
+    if (rss && line.compare(0, 6, "VmRSS:") == 0) {
+      *rss = std::stoll(line.substr(6)) * 1024;
+      --missing;
+    } else if (peak && line.compare(0, 6, "VmHWM:") == 0) {
+      *peak = std::stoll(line.substr(6)) * 1024;
+      --missing;
+    }
+  }
+}
+
+void Tracer::beginStage(int64_t &rss, int64_t &peak)
+{
+  std::lock_guard<std::mutex> lock(stages_mutex_);
+  int64_t process_peak = 0;
+  rss = 0;
+  readMemoryStatus(&rss, &process_peak);
+  if (!peak_reset_) {
+    process_peak = rss;
+  }
+  // the peak so far is lost by the reset below
+  for (int64_t *stage_peak : stage_peaks_) {
+    *stage_peak = std::max(*stage_peak, process_peak);
+  }
+  peak_reset_ = peak_reset_ && resetPeakResidentMemory();
+  peak = rss;
+  stage_peaks_.push_back(&peak);
+}
+
+void Tracer::endStage(int64_t &rss, int64_t &peak)
+{
+  std::lock_guard<std::mutex> lock(stages_mutex_);
+  int64_t process_peak = 0;
+  rss = 0;
+  readMemoryStatus(&rss, &process_peak);
+  if (!peak_reset_) {
+    process_peak = rss;
+  }
+  for (int64_t *stage_peak : stage_peaks_) {
+    *stage_peak = std::max(*stage_peak, process_peak);
+  }
+  stage_peaks_.erase(
+      std::find(stage_peaks_.begin(), stage_peaks_.end(), &peak));
+}
+
+ChromeTraceWriter::ChromeTraceWriter(const std::string &path)
+  : stream_(path), cursor_(0), empty_(true)
+{
+  stream_ << "[";
+}
+
+ChromeTraceWriter::~ChromeTraceWriter()
+{
+  stream_ << "\n]" << std::endl;
+}
+
+void ChromeTraceWriter::write(const Tracer &tracer)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto &event : tracer.events(cursor_)) {
+    if (!empty_) {
+      stream_ << ",";
+    }
+    empty_ = false;
+    writeChromeTraceEvent(stream_, event);
+  }
+  stream_.flush();
+}
+
+ScopedTimer::ScopedTimer(const char *name, const char *category)
+  : name_(name)
+  , category_(category)
+  , active_(Tracer::global().isEnabled())
+  , start_(0)
+  , rss_start_(0)
+  , peak_rss_(0)
+{
+  if (!active_) {
+    return;
+  }
+  Tracer::global().beginStage(rss_start_, peak_rss_);
+  start_ = Tracer::global().now();
+}
+
+ScopedTimer::~ScopedTimer()
+{
+  if (!active_) {
+    return;
+  }
+  Tracer &tracer = Tracer::global();
+  TraceEvent event;
+  event.name = name_;
+  event.category = category_;
+  event.start = start_;
+  event.duration = tracer.now() - start_;
+  event.thread = Tracer::currentThread();
+  int64_t rss_end = 0;
+  tracer.endStage(rss_end, peak_rss_);
+  event.rss_delta = rss_end - rss_start_;
+  event.peak_rss = std::max<int64_t>(0, peak_rss_ - rss_start_);
+  event.counters = std::move(counters_);
+  tracer.record(std::move(event));
+}
+
+void ScopedTimer::addCounter(const char *name, double value)
+{
+  if (active_) {
+    counters_.emplace_back(name, value);
+  }
+}
+
+int64_t residentMemory()
+{
+  int64_t rss = 0;
+  readMemoryStatus(&rss, nullptr);
+  return rss;
+}
+
+int64_t peakResidentMemory()
+{
+  int64_t peak = 0;
+  readMemoryStatus(nullptr, &peak);
+  return peak;
+}
+
+bool resetPeakResidentMemory()
+{
+  // writing 5 to clear_refs resets VmHWM (Linux >= 4.0)
+  std::ofstream clear_refs("/proc/self/clear_refs");
+  clear_refs << "5";
+  return bool(clear_refs.flush());
+}
+
+}  // namespace map_merge_3d
@@ -0,0 +1,89 @@
+#include <map_merge_3d/evaluation.h>
+#include <map_merge_3d/synthetic.h>
+
+#include <cstdio>
+
+#include <pcl/console/parse.h>
+#include <pcl/io/pcd_io.h>
+
+using namespace map_merge_3d;
+
+int main(int argc, char **argv)
+{
+  using pcl::console::parse_argument;
+
+  SceneParams scene_params;
+  PartialMapsParams maps_params;
+  std::string output_dir = ".";
+
+  // PCL can not parse size_t
+  int points = int(scene_params.points);
+  int maps = int(maps_params.maps);
+  parse_argument(argc, argv, "--points", points);
+  parse_argument(argc, argv, "--maps", maps);
+  if (points < 0 || maps < 0) {
+    pcl::console::print_error("Number of points and maps must be "
+                              "positive!\n");
+    return -1;
+  }
+  scene_params.points = size_t(points);
+  maps_params.maps = size_t(maps);
+  parse_argument(argc, argv, "--obstacles_density",
+                 scene_params.obstacles_density);
+  parse_argument(argc, argv, "--height", scene_params.height);
+  parse_argument(argc, argv, "--map_size", maps_params.map_size);
+  parse_argument(argc, argv, "--overlap", maps_params.overlap);
+  parse_argument(argc, argv, "--noise", maps_params.noise);
+  parse_argument(argc, argv, "--density_variation",
+                 maps_params.density_variation);
+  parse_argument(argc, argv, "--colour_variation",
+                 maps_params.colour_variation);
+  parse_argument(argc, argv, "--max_rotation", maps_params.max_rotation);
+  parse_argument(argc, argv, "--max_tilt", maps_params.max_tilt);
+  parse_argument(argc, argv, "--max_translation",
+                 maps_params.max_translation);
+  parse_argument(argc, argv, "--seed", maps_params.seed);
+  parse_argument(argc, argv, "--output_dir", output_dir);
+  scene_params.seed = maps_params.seed;
+
+  // use scene from file if provided, generate otherwise
+  std::vector<int> pcd_file_indices =
+      pcl::console::parse_file_extension_argument(argc, argv, ".pcd");
+  PointCloudPtr scene(new PointCloud);
+  if (pcd_file_indices.size() > 1) {
+    pcl::console::print_error("Need at most 1 scene file!\n");
+    return -1;
+  }
+  if (pcd_file_indices.size() == 1) {
+    auto file_name = argv[pcd_file_indices[0]];
+    if (pcl::io::loadPCDFile<PointT>(file_name, *scene) < 0) {
+      pcl::console::print_error("Error loading pointcloud file %s. Aborting.\n",
+                                file_name);
+      return -1;
+    }
+  } else {
+    scene_params = sceneForPartialMaps(scene_params, maps_params);
+    pcl::console::print_highlight("Generating scene %gx%g m with %zu "
+                                  "points.\n",
+                                  scene_params.size_x, scene_params.size_y,
+                                  scene_params.points);
+    scene = generateScene(scene_params);
+  }
+
+  pcl::console::print_highlight("Cutting scene into %zu maps.\n",
+                                maps_params.maps);
+  PartialMaps maps = generatePartialMaps(scene, maps_params);
+
+  for (size_t i = 0; i < maps.maps.size(); ++i) {
+    char file_name[32];
+    snprintf(file_name, sizeof(file_name), "/map_%03zu.pcd", i);
+    std::cout << output_dir + file_name << ": " << maps.maps[i]->size()
+              << " points" << std::endl;
+    pcl::io::savePCDFileBinary(output_dir + file_name, *maps.maps[i]);
+  }
+  saveTransforms(output_dir + "/ground_truth.txt", maps.ground_truth);
+  pcl::console::print_highlight("Ground truth written to %s\n",
+                                (output_dir + "/ground_truth.txt").c_str());
+
+  return 0;
+}
@@ -1,5 +1,19 @@
+#include <map_merge_3d/distributed.h>
+#include <map_merge_3d/instrumentation.h>
 #include <map_merge_3d/map_merge_node.h>
 
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <string>
+
+#include <unistd.h>
+
+#include <diagnostic_msgs/DiagnosticArray.h>
+#include <pcl/common/common.h>
 #include <pcl_ros/point_cloud.h>
 #include <ros/assert.h>
 #include <ros/console.h>
@@ -7,9 +21,41 @@
 
 namespace map_merge_3d
 {
-MapMerge3d::MapMerge3d() : subscriptions_size_(0)
+/* at most this many tiles are published in one compositing cycle, the rest
+ * in the following cycles. the bounded publisher queue then does not drop
+ * tiles */
+static const size_t TILES_PER_CYCLE = 16;
+
+/* map_merge_worker built with the node, the build tree takes precedence over
+ * the installed one */
+static std::string defaultWorkerExecutable()
+{
+#if defined(MAP_MERGE_WORKER_DEVEL) && defined(MAP_MERGE_WORKER_INSTALLED)
+  if (::access(MAP_MERGE_WORKER_DEVEL, X_OK) == 0) {
+    return MAP_MERGE_WORKER_DEVEL;
+  }
+  return MAP_MERGE_WORKER_INSTALLED;
+#else
+  return std::string();
+#endif
+}
+
+MapMerge3d::MapMerge3d() : MapMerge3d(ros::NodeHandle(), ros::NodeHandle("~"))
+{
+}
+
+MapMerge3d::MapMerge3d(const ros::NodeHandle& node,
+                       const ros::NodeHandle& private_nh)
+  : node_(node)
+  , compositor_(0.0)
+  , change_pending_(false)
+  , lod_publish_ratio_(2)
+  , compositing_cycles_(0)
+  , has_roi_(false)
+  , tf_thread_running_(true)
+  , subscriptions_size_(0)
+  , snapshot_(new Snapshot)
 {
-  ros::NodeHandle private_nh("~");
   std::string merged_map_topic;
   bool publish_tf = true;
 
@@ -17,16 +63,114 @@ MapMerge3d::MapMerge3d() : subscriptions_size_(0)
   private_nh.param("discovery_rate", discovery_rate_, 0.05);
   private_nh.param("estimation_rate", estimation_rate_, 0.01);
   private_nh.param<std::string>("robot_map_topic", robot_map_topic_, "map");
+  private_nh.param<std::string>("robot_map_updates_topic",
+                                robot_map_updates_topic_, "");
   private_nh.param<std::string>("robot_namespace", robot_namespace_, "");
   private_nh.param<std::string>("merged_map_topic", merged_map_topic, "map");
   private_nh.param<std::string>("world_frame", world_frame_, "world");
   private_nh.param("publish_tf", publish_tf, true);
+  private_nh.param<std::string>("trace_file", trace_file_, "");
+  private_nh.param("publish_diagnostics", publish_diagnostics_, false);
+  private_nh.param("cancel_stale_estimation", cancel_stale_estimation_, false);
+  private_nh.param("estimate_on_change", estimate_on_change_, false);
+  private_nh.param("change_points_ratio", change_points_ratio_, 0.1);
+  private_nh.param("change_bbox_growth", change_bbox_growth_, 1.0);
+  private_nh.param("change_delay", change_delay_, 2.0);
+  private_nh.param("max_maps_memory", max_maps_memory_, 0.0);
+  private_nh.param("tile_size", tile_size_, 0.0);
+  private_nh.param("roi_radius", roi_radius_, 10.0);
+  private_nh.param<std::string>("state_file", state_file_, "");
+  private_nh.param<std::string>("reference_robot", reference_robot_, "");
+  int distributed_workers = 0;
+  private_nh.param("distributed_workers", distributed_workers, 0);
+  std::vector<std::string> worker_sockets;
+  private_nh.param("worker_sockets", worker_sockets,
+                   std::vector<std::string>());
+  double worker_timeout = 60.0;
+  private_nh.param("worker_timeout", worker_timeout, 60.0);
+  std::string worker_executable;
+  private_nh.param<std::string>("worker_executable", worker_executable,
+                                defaultWorkerExecutable());
+  int lod_levels = 1;
+  private_nh.param("lod_levels", lod_levels, 1);
+  private_nh.param("lod_publish_ratio", lod_publish_ratio_, 2);
+  lod_publish_ratio_ = std::max(lod_publish_ratio_, 1);
   // registration parameters
   map_merge_params_ = MapMergingParams::fromROSNode(private_nh);
+  compositor_ = MapCompositor(map_merge_params_.output_resolution);
+  // downsampling maps to the output resolution does not affect the merged map
+  private_nh.param("budget_resolution", budget_resolution_,
+                   map_merge_params_.output_resolution);
+  // resume from the previous run
+  if (!state_file_.empty() && std::ifstream(state_file_).good()) {
+    try {
+      state_store_.reset(new StateStore(state_file_, map_merge_params_));
+      ROS_INFO("loaded saved state of %zu maps from %s", state_store_->size(),
+               state_file_.c_str());
+    } catch (const std::exception& e) {
+      ROS_WARN("not resuming from saved state: %s", e.what());
+    }
+  }
+
+  // distributed registration. forking the node without exec is not safe, its
+  // threads may hold locks
+  if (distributed_workers > 0 &&
+      ::access(worker_executable.c_str(), X_OK) != 0) {
+    ROS_ERROR("worker_executable [%s] is not executable, local workers are "
+              "disabled",
+              worker_executable.c_str());
+    distributed_workers = 0;
+  }
+  if (distributed_workers > 0 || !worker_sockets.empty()) {
+    estimation_context_.workers = std::make_shared<RegistrationWorkers>(
+        worker_sockets, size_t(std::max(distributed_workers, 0)),
+        worker_timeout, worker_executable);
+    ROS_INFO("registering pairs of maps with %zu workers",
+             estimation_context_.workers->size());
+  }
 
   /* publishing */
   merged_map_publisher_ =
-      node_.advertise<PointCloud>(merged_map_topic, 50, true);
+      node_.advertise<PointCloud>(merged_map_topic, 1, true);
+  if (tile_size_ > 0.) {
+    tiled_map_.reset(new TiledMap(tile_size_));
+    // tiles are not latched, new subscribers get all tiles over the next
+    // compositing cycles
+    tiles_publisher_ = node_.advertise<PointCloud>(
+        merged_map_topic + "_tiles", TILES_PER_CYCLE,
+        [this](const ros::SingleSubscriberPublisher&) {
+          std::lock_guard<std::mutex> lock(tiled_map_mutex_);
+          const std::vector<TiledMap::TileKey> tiles = tiled_map_->tiles();
+          pending_tiles_.insert(tiles.begin(), tiles.end());
+        });
+    roi_publisher_ =
+        node_.advertise<PointCloud>(merged_map_topic + "_roi", 1, true);
+    roi_subscriber_ = node_.subscribe<geometry_msgs::PoseStamped>(
+        "roi_pose", 1,
+        [this](const geometry_msgs::PoseStampedConstPtr& msg) {
+          roiUpdate(msg);
+        });
+  }
+  if (lod_levels > 1) {
+    multi_resolution_map_.reset(new MultiResolutionMap(
+        map_merge_params_.output_resolution, size_t(lod_levels)));
+    // level 0 is the merged map
+    for (int i = 1; i < lod_levels; ++i) {
+      lod_publishers_.emplace_back(node_.advertise<PointCloud>(
+          merged_map_topic + "_lod" + std::to_string(i), 1, true));
+    }
+    lod_changed_.assign(size_t(lod_levels), true);
+  }
+  if (publish_diagnostics_) {
+    diagnostics_publisher_ =
+        node_.advertise<diagnostic_msgs::DiagnosticArray>("/diagnostics", 1);
+  }
+
+  // stages are traced only if someone consumes the data
+  Tracer::global().setEnabled(publish_diagnostics_ || !trace_file_.empty());
+  if (!trace_file_.empty()) {
+    trace_writer_.reset(new ChromeTraceWriter(trace_file_));
+  }
 
   /* periodical discovery, estimation, compositing */
   compositing_timer_ =
@@ -35,15 +179,30 @@ MapMerge3d::MapMerge3d() : subscriptions_size_(0)
   discovery_timer_ =
       node_.createTimer(ros::Duration(1. / discovery_rate_),
                         [this](const ros::TimerEvent&) { discovery(); });
-  estimation_timer_ = node_.createTimer(
-      ros::Duration(1. / estimation_rate_),
-      [this](const ros::TimerEvent&) { transformsEstimation(); });
+  if (estimate_on_change_) {
+    // estimation is triggered from map updates, timer is armed on the first
+    // significant change
+    change_timer_ = node_.createTimer(
+        ros::Duration(change_delay_),
+        [this](const ros::TimerEvent&) {
+          {
+            std::lock_guard<std::mutex> lock(change_timer_mutex_);
+            change_pending_ = false;
+          }
+          transformsEstimation();
+        },
+        true, false);
+  } else {
+    estimation_timer_ = node_.createTimer(
+        ros::Duration(1. / estimation_rate_),
+        [this](const ros::TimerEvent&) { transformsEstimation(); });
+  }
 
   // tf needs to publish at constant frequency to avoid transform lookup fails
   if (publish_tf) {
     tf_thread_ = std::thread([this]() {
       ros::Rate rate(30.0);
-      while (node_.ok()) {
+      while (tf_thread_running_ && node_.ok()) {
         publishTF();
         rate.sleep();
       }
@@ -51,6 +210,28 @@ MapMerge3d::MapMerge3d() : subscriptions_size_(0)
   }
 }
 
+MapMerge3d::~MapMerge3d()
+{
+  // no new work from callbacks. running callbacks may still finish
+  compositing_timer_.stop();
+  discovery_timer_.stop();
+  estimation_timer_.stop();
+  change_timer_.stop();
+  {
+    std::lock_guard<std::mutex> lock(subscriptions_mutex_);
+    for (auto& subscription : subscriptions_) {
+      subscription.map_sub.shutdown();
+      subscription.map_updates_sub.shutdown();
+    }
+  }
+  estimation_worker_.cancel();
+
+  tf_thread_running_ = false;
+  if (tf_thread_.joinable()) {
+    tf_thread_.join();
+  }
+}
+
 /*
  * Dynamic robots discovery
  */
@@ -79,86 +260,605 @@ void MapMerge3d::discovery()
     ROS_INFO("adding robot [%s] to system", robot_name.c_str());
     {
       std::lock_guard<std::mutex> lock(subscriptions_mutex_);
-      subscriptions_.emplace_front();
+      // new maps are appended to keep indices of existing maps
+      subscriptions_.emplace_back();
+      subscriptions_.back().index = subscriptions_size_;
       ++subscriptions_size_;
+      // estimation thread looks up the reference robot
+      robots_.insert({robot_name, &subscriptions_.back()});
     }
 
-    // no locking here. robots_ are used only in this procedure
-    MapSubscription& subscription = subscriptions_.front();
-    robots_.insert({robot_name, &subscription});
+    MapSubscription& subscription = subscriptions_.back();
+    updateSnapshot([](Snapshot& snapshot) {
+      snapshot.maps.emplace_back();
+      snapshot.frame_ids.emplace_back();
+    });
 
     /* subscribe callbacks */
     map_topic = ros::names::append(robot_name, robot_map_topic_);
     ROS_INFO("Subscribing to MAP topic: %s.", map_topic.c_str());
+    // only the latest map is used, older messages are dropped in the queue
     subscription.map_sub = node_.subscribe<PointCloud>(
-        map_topic, 50, [this, &subscription](const PointCloudConstPtr& msg) {
+        map_topic, 1, [this, &subscription](const PointCloudConstPtr& msg) {
           mapUpdate(msg, subscription);
         });
+    if (!robot_map_updates_topic_.empty()) {
+      map_topic = ros::names::append(robot_name, robot_map_updates_topic_);
+      ROS_INFO("Subscribing to MAP updates topic: %s.", map_topic.c_str());
+      // updates can't be dropped
+      subscription.map_updates_sub = node_.subscribe<PointCloud>(
+          map_topic, 50, [this, &subscription](const PointCloudConstPtr& msg) {
+            mapDeltaUpdate(msg, subscription);
+          });
+    }
   }
 
   ROS_DEBUG("Robot discovery finished.");
 }
 
+/* memory held by map chunks and concatenated map */
+static inline size_t mapMemory(const PointCloudConstPtr& map,
+                               const MapCompositor::MapChunks& chunks)
+{
+  size_t points = 0;
+  for (const auto& chunk : chunks) {
+    points += chunk->size();
+  }
+  // concatenated map is a separate copy
+  if (map && !(chunks.size() == 1 && chunks[0] == map)) {
+    points += map->size();
+  }
+  return points * sizeof(PointT);
+}
+
 /*
  * Composing maps according to computed transforms
  */
 void MapMerge3d::mapCompositing()
 {
   ROS_DEBUG("Map compositing started.");
-
-  std::vector<PointCloudConstPtr> clouds = getMaps();
-  if (clouds.empty()) {
+  const int64_t cycle_start = Tracer::global().now();
+  const ros::WallTime start = ros::WallTime::now();
+  if (!composeMergedMap()) {
     return;
   }
-  std::vector<Eigen::Matrix4f> transforms = getTransforms();
-  // shrink clouds if we have subscribed some new maps since the last
-  // estimation
-  clouds.resize(transforms.size());
+  publishStatistics("compositing", cycle_start,
+                    (ros::WallTime::now() - start).toSec(),
+                    1. / compositing_rate_);
+  ROS_DEBUG("Map compositing finished.");
+}
 
-  PointCloudPtr merged_map =
-      composeMaps(clouds, transforms, map_merge_params_.output_resolution);
+/* composes and publishes merged map. returns false if there was nothing to
+ * compose */
+bool MapMerge3d::composeMergedMap()
+{
+  ScopedTimer timer("mapCompositing", "node");
+
+  // maps and transforms consistent with each other
+  SnapshotPtr snapshot = getSnapshot();
+  if (snapshot->maps.empty()) {
+    return false;
+  }
+  size_t maps_memory = 0;
+  for (const auto& chunks : snapshot->maps) {
+    maps_memory += mapMemory(nullptr, chunks);
+  }
+  timer.addCounter("maps_memory_mb", maps_memory / (1024. * 1024.));
+  // skip maps we have subscribed since the last estimation
+  std::vector<MapCompositor::MapChunks> maps(
+      snapshot->maps.begin(),
+      snapshot->maps.begin() +
+          std::min(snapshot->maps.size(), snapshot->transforms.size()));
+
+  // only compositing timer uses compositor
+  PointCloudPtr merged_map = compositor_.compose(maps, snapshot->transforms);
   if (!merged_map) {
-    return;
+    return false;
   }
 
   std_msgs::Header header;
   header.frame_id = world_frame_;
   header.stamp = ros::Time::now();
   pcl_conversions::toPCL(header, merged_map->header);
-  merged_map_publisher_.publish(merged_map);
+  // coarse levels first, they are faster to transfer
+  if (multi_resolution_map_) {
+    ScopedTimer lod_timer("publishLevelsOfDetail", "node");
+    if (!compositor_.changedRegion().isEmpty()) {
+      multi_resolution_map_->update(merged_map);
+      std::fill(lod_changed_.begin(), lod_changed_.end(), true);
+    }
+    for (size_t i = lod_publishers_.size(); i > 0; --i) {
+      if (isLevelDue(i)) {
+        lod_publishers_[i - 1].publish(multi_resolution_map_->level(i));
+        lod_changed_[i] = false;
+      }
+    }
+  }
+  if (!multi_resolution_map_ || isLevelDue(0)) {
+    ScopedTimer publish_timer("publish", "node");
+    merged_map_publisher_.publish(merged_map);
+    if (multi_resolution_map_) {
+      lod_changed_[0] = false;
+    }
+  }
+  ++compositing_cycles_;
+  if (tiled_map_) {
+    ScopedTimer tiles_timer("publishTiles", "node");
+    publishTiles(*merged_map);
+  }
 
-  ROS_DEBUG("Map compositing finished.");
+  return true;
+}
+
+/* whether level of detail should be published in this compositing cycle.
+ * the coarsest level is published every cycle, finer levels lod_publish_ratio_
+ * times less often. levels are published only when they changed */
+bool MapMerge3d::isLevelDue(size_t level) const
+{
+  if (!lod_changed_[level]) {
+    return false;
+  }
+  uint64_t period = 1;
+  for (size_t i = level + 1; i < lod_changed_.size(); ++i) {
+    period *= uint64_t(lod_publish_ratio_);
+  }
+  return compositing_cycles_ % period == 0;
+}
+
+/* publishes tiles changed by the merged map and region of interest */
+void MapMerge3d::publishTiles(const PointCloud& merged_map)
+{
+  std::lock_guard<std::mutex> lock(tiled_map_mutex_);
+  // only tiles in the region changed by compositing are rebuilt
+  std::vector<TiledMap::TileKey> changed =
+      tiled_map_->update(merged_map, compositor_.changedRegion());
+  pending_tiles_.insert(changed.begin(), changed.end());
+
+  // tiles nearest to the region of interest first
+  std::vector<TiledMap::TileKey> to_publish(pending_tiles_.begin(),
+                                            pending_tiles_.end());
+  if (has_roi_) {
+    const TiledMap::TileKey center =
+        tiled_map_->tileKey(roi_center_.x(), roi_center_.y());
+    auto distance = [&center](const TiledMap::TileKey& key) {
+      const int64_t dx = key.first - center.first;
+      const int64_t dy = key.second - center.second;
+      return dx * dx + dy * dy;
+    };
+    std::stable_sort(to_publish.begin(), to_publish.end(),
+                     [&distance](const TiledMap::TileKey& a,
+                                 const TiledMap::TileKey& b) {
+                       return distance(a) < distance(b);
+                     });
+  }
+  to_publish.resize(std::min(to_publish.size(), TILES_PER_CYCLE));
+  for (const auto& key : to_publish) {
+    PointCloudConstPtr tile = tiled_map_->tile(key);
+    if (!tile) {
+      // removed tile is marked by one invalid point in the tile center
+      PointCloudPtr removed(new PointCloud);
+      removed->header = merged_map.header;
+      PointT point;
+      point.x = float((key.first + 0.5) * tile_size_);
+      point.y = float((key.second + 0.5) * tile_size_);
+      point.z = std::numeric_limits<float>::quiet_NaN();
+      removed->push_back(point);
+      removed->is_dense = false;
+      tile = removed;
+    }
+    tiles_publisher_.publish(tile);
+    pending_tiles_.erase(key);
+  }
+  ROS_DEBUG("published %zu tiles, %zu tiles changed, %zu pending",
+            to_publish.size(), changed.size(), pending_tiles_.size());
+
+  if (has_roi_ && !changed.empty()) {
+    publishROI();
+  }
+}
+
+/* tiled_map_mutex_ must be locked */
+void MapMerge3d::publishROI()
+{
+  PointCloudPtr roi = tiled_map_->regionOfInterest(roi_center_, roi_radius_);
+  std_msgs::Header header;
+  header.frame_id = world_frame_;
+  header.stamp = ros::Time::now();
+  pcl_conversions::toPCL(header, roi->header);
+  roi_publisher_.publish(roi);
+}
+
+void MapMerge3d::roiUpdate(const geometry_msgs::PoseStampedConstPtr& msg)
+{
+  if (!msg->header.frame_id.empty() && msg->header.frame_id != world_frame_) {
+    ROS_WARN_THROTTLE(10., "region of interest pose must be in %s frame, "
+                           "got %s. Ignoring.",
+                      world_frame_.c_str(), msg->header.frame_id.c_str());
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(tiled_map_mutex_);
+  roi_center_ = Eigen::Vector3f(float(msg->pose.position.x),
+                                float(msg->pose.position.y),
+                                float(msg->pose.position.z));
+  has_roi_ = true;
+  publishROI();
 }
 
 void MapMerge3d::transformsEstimation()
+{
+  estimation_worker_.request([this](const std::atomic<bool>& cancelled) {
+    estimateTransforms(cancelled);
+  });
+}
+
+/* runs in estimation worker */
+void MapMerge3d::estimateTransforms(const std::atomic<bool>& cancelled)
 {
   ROS_DEBUG("Transform estimation started.");
+  const int64_t cycle_start = Tracer::global().now();
+  const ros::WallTime start = ros::WallTime::now();
+  // maps are taken when the estimation starts to use the latest maps
   std::vector<PointCloudConstPtr> clouds = getMaps();
   if (clouds.empty()) {
     return;
   }
 
-  std::vector<Eigen::Matrix4f> transforms =
-      estimateMapsTransforms(clouds, map_merge_params_);
+  // context is kept between estimations to reuse features of unchanged maps
+  estimation_context_.is_cancelled = [&cancelled]() {
+    return cancelled.load();
+  };
+  // robot is found only after its map was discovered
+  estimation_context_.pinned_reference_frame = EstimationContext::NO_REFERENCE;
+  if (!reference_robot_.empty()) {
+    std::lock_guard<std::mutex> lock(subscriptions_mutex_);
+    auto robot = robots_.find(reference_robot_);
+    if (robot != robots_.end()) {
+      estimation_context_.pinned_reference_frame = robot->second->index;
+    }
+  }
+  std::vector<Eigen::Matrix4f> transforms;
+  try {
+    ScopedTimer timer("transformsEstimation", "node");
+    timer.addCounter("maps", clouds.size());
+    if (state_store_) {
+      const size_t restored =
+          state_store_->restore(clouds, estimation_context_);
+      if (restored > 0) {
+        ROS_INFO("restored features of %zu maps from saved state", restored);
+      }
+    }
+    transforms =
+        estimateMapsTransforms(clouds, map_merge_params_, estimation_context_);
+  } catch (const EstimationCancelled&) {
+    ROS_DEBUG("Transform estimation cancelled.");
+    return;
+  } catch (const std::exception& e) {
+    ROS_ERROR("Transform estimation failed: %s", e.what());
+    return;
+  }
 
-  // set transforms thread-safe
-  {
-    std::lock_guard<std::mutex> lock(transforms_mutex_);
-    transforms_ = transforms;
+  // unchanged transforms are returned exactly the same. keeping the snapshot
+  // lets compositing and tf skip recomputation
+  if (transforms != getSnapshot()->transforms) {
+    updateSnapshot([&transforms](Snapshot& snapshot) {
+      snapshot.transforms = std::move(transforms);
+    });
+  }
+  if (!state_file_.empty()) {
+    saveState();
   }
-  // notify tf publisher that transforms changed
-  tf_current_flag_.clear();
 
+  // change-triggered estimation has no period to overrun
+  const double period = estimate_on_change_ ?
+                            std::numeric_limits<double>::infinity() :
+                            1. / estimation_rate_;
+  publishStatistics("estimation", cycle_start,
+                    (ros::WallTime::now() - start).toSec(), period);
   ROS_DEBUG("Transform estimation finished.");
 }
 
+/* runs in estimation worker */
+void MapMerge3d::saveState()
+{
+  // state changes only with content of maps
+  std::vector<uint64_t> state;
+  for (const auto& features : estimation_context_.features) {
+    state.push_back(features.hash);
+  }
+  if (state == saved_state_) {
+    return;
+  }
+
+  try {
+    ScopedTimer timer("saveState", "node");
+    StateStore::save(state_file_, map_merge_params_, estimation_context_);
+    saved_state_ = std::move(state);
+  } catch (const std::exception& e) {
+    ROS_WARN("saving state failed: %s", e.what());
+  }
+}
+
 void MapMerge3d::mapUpdate(const PointCloud::ConstPtr& msg,
                            MapSubscription& subscription)
 {
   ROS_DEBUG("received map update");
-  std::lock_guard<std::mutex> lock(subscription.mutex);
+  bool new_map;
+  bool significant = false;
+  {
+    std::lock_guard<std::mutex> lock(subscription.mutex);
+    new_map = subscription.chunks.empty();
+    subscription.map = msg;
+    subscription.chunks = {msg};
+    subscription.downsampled_chunks = 0;
+    subscription.evicted = false;
+    snapshotMap(subscription);
+    if (estimate_on_change_) {
+      significant = isSignificantChange(*msg, true, subscription);
+    }
+  }
+  mapChanged(new_map, significant);
+}
+
+/* maps with more chunks are concatenated to one chunk */
+static const size_t MAX_MAP_CHUNKS = 64;
+
+static inline PointCloudPtr
+concatenateChunks(MapCompositor::MapChunks::const_iterator first,
+                  MapCompositor::MapChunks::const_iterator last)
+{
+  PointCloudPtr result(new PointCloud);
+  size_t points = 0;
+  for (auto it = first; it != last; ++it) {
+    points += (*it)->size();
+  }
+  result->reserve(points);
+  for (auto it = first; it != last; ++it) {
+    *result += **it;
+  }
+  result->header = (*std::prev(last))->header;
+  return result;
+}
+
+static inline PointCloudPtr
+concatenateChunks(const MapCompositor::MapChunks& chunks)
+{
+  return concatenateChunks(chunks.begin(), chunks.end());
+}
+
+/* keeps downsampled and new chunks apart, so that the memory budget
+ * downsamples only new points. subscription must be locked */
+static inline void mergeChunks(MapCompositor::MapChunks& chunks,
+                               size_t& downsampled_chunks, double resolution)
+{
+  const auto first_new = chunks.begin() + std::ptrdiff_t(downsampled_chunks);
+  MapCompositor::MapChunks merged;
+  if (downsampled_chunks > 0) {
+    // chunks were downsampled separately, merge points in the same voxels
+    merged.push_back(
+        downSample(concatenateChunks(chunks.begin(), first_new), resolution));
+  }
+  if (first_new != chunks.end()) {
+    merged.push_back(concatenateChunks(first_new, chunks.end()));
+  }
+  downsampled_chunks = downsampled_chunks > 0 ? 1 : 0;
+  chunks = std::move(merged);
+}
+
+void MapMerge3d::mapDeltaUpdate(const PointCloud::ConstPtr& msg,
+                                MapSubscription& subscription)
+{
+  ROS_DEBUG("received map delta update");
+  bool new_map;
+  bool significant = false;
+  {
+    std::lock_guard<std::mutex> lock(subscription.mutex);
+    if (subscription.evicted) {
+      return;
+    }
+    new_map = subscription.chunks.empty();
+    subscription.chunks.push_back(msg);
+    // contiguous map is built lazily when needed
+    subscription.map = nullptr;
+    if (subscription.chunks.size() > MAX_MAP_CHUNKS) {
+      mergeChunks(subscription.chunks, subscription.downsampled_chunks,
+                  budget_resolution_);
+      if (subscription.chunks.size() == 1) {
+        subscription.map = subscription.chunks[0];
+      }
+    }
+    snapshotMap(subscription);
+    if (estimate_on_change_) {
+      significant = isSignificantChange(*msg, false, subscription);
+    }
+  }
+  mapChanged(new_map, significant);
+}
+
+void MapMerge3d::mapChanged(bool new_map, bool significant)
+{
+  enforceMemoryBudget();
+
+  if (significant) {
+    scheduleEstimation();
+  }
+
+  // running estimation is working with outdated maps. restart it with the
+  // latest maps.
+  if ((new_map || cancel_stale_estimation_) && estimation_worker_.busy()) {
+    ROS_DEBUG("restarting estimation with updated maps");
+    estimation_worker_.request(
+        [this](const std::atomic<bool>& cancelled) {
+          estimateTransforms(cancelled);
+        },
+        true);
+  }
+}
+
+/* downsamples and if needed evicts maps to fit to max_maps_memory_ */
+void MapMerge3d::enforceMemoryBudget()
+{
+  if (max_maps_memory_ <= 0.) {
+    return;
+  }
+  // someone else is already enforcing the budget
+  std::unique_lock<std::mutex> budget_lock(budget_mutex_, std::try_to_lock);
+  if (!budget_lock) {
+    return;
+  }
+  const size_t budget = size_t(max_maps_memory_ * 1024. * 1024.);
+
+  // subscriptions are never removed, we can work without the global lock
+  std::vector<MapSubscription*> subscriptions;
+  {
+    std::lock_guard<std::mutex> lock(subscriptions_mutex_);
+    for (auto& subscription : subscriptions_) {
+      subscriptions.push_back(&subscription);
+    }
+  }
+
+  while (true) {
+    size_t total = 0;
+    // map with most points not yet downsampled and largest map overall
+    MapSubscription* to_downsample = nullptr;
+    MapSubscription* to_evict = nullptr;
+    size_t to_downsample_memory = 0;
+    size_t to_evict_memory = 0;
+    MapCompositor::MapChunks chunks;
+    size_t downsampled_chunks = 0;
+    for (MapSubscription* subscription : subscriptions) {
+      std::lock_guard<std::mutex> lock(subscription->mutex);
+      const size_t memory =
+          mapMemory(subscription->map, subscription->chunks);
+      total += memory;
+      if (memory > to_evict_memory) {
+        to_evict = subscription;
+        to_evict_memory = memory;
+      }
+      const MapCompositor::MapChunks new_chunks(
+          subscription->chunks.begin() +
+              std::ptrdiff_t(subscription->downsampled_chunks),
+          subscription->chunks.end());
+      const size_t new_memory = mapMemory(nullptr, new_chunks);
+      if (new_memory > to_downsample_memory) {
+        to_downsample = subscription;
+        to_downsample_memory = new_memory;
+        chunks = subscription->chunks;
+        downsampled_chunks = subscription->downsampled_chunks;
+      }
+    }
+    if (total <= budget) {
+      return;
+    }
+
+    if (to_downsample) {
+      ROS_DEBUG("maps use %.1f MB, downsampling %.1f MB of new points",
+                total / (1024. * 1024.),
+                to_downsample_memory / (1024. * 1024.));
+      // downsample only chunks added since the last downsampling, without
+      // lock. map may be updated in the meantime
+      PointCloudPtr downsampled = downSample(
+          concatenateChunks(chunks.begin() + std::ptrdiff_t(downsampled_chunks),
+                            chunks.end()),
+          budget_resolution_);
+      std::lock_guard<std::mutex> lock(to_downsample->mutex);
+      if (to_downsample->chunks != chunks) {
+        // map changed, budget will be enforced with the next update
+        return;
+      }
+      to_downsample->chunks.resize(downsampled_chunks);
+      to_downsample->chunks.push_back(downsampled);
+      to_downsample->downsampled_chunks = to_downsample->chunks.size();
+      to_downsample->map =
+          to_downsample->chunks.size() == 1 ? downsampled : nullptr;
+      // the same map, just sparser. should not trigger estimation
+      size_t points = 0;
+      for (const auto& chunk : to_downsample->chunks) {
+        points += chunk->size();
+      }
+      to_downsample->points = points;
+      to_downsample->trigger_points = points;
+      snapshotMap(*to_downsample);
+      continue;
+    }
+
+    ROS_WARN_THROTTLE(10., "maps use %.1f MB, which exceeds max_maps_memory "
+                           "even after downsampling. Dropping map with "
+                           "%.1f MB and ignoring its updates until the next "
+                           "whole map on the %s topic.",
+                      total / (1024. * 1024.),
+                      to_evict_memory / (1024. * 1024.),
+                      robot_map_topic_.c_str());
+    std::lock_guard<std::mutex> lock(to_evict->mutex);
+    to_evict->map = nullptr;
+    to_evict->chunks.clear();
+    to_evict->downsampled_chunks = 0;
+    to_evict->points = 0;
+    to_evict->evicted = true;
+    snapshotMap(*to_evict);
+  }
+}
+
+/* change policy. updates map extent with the update, which either replaces
+ * the map or is appended to it. subscription must be locked */
+bool MapMerge3d::isSignificantChange(const PointCloud& update, bool replace,
+                                     MapSubscription& subscription)
+{
+  if (replace) {
+    subscription.points = 0;
+  }
+  if (update.empty()) {
+    return false;
+  }
+
+  PointT min_pt, max_pt;
+  pcl::getMinMax3D(update, min_pt, max_pt);
+  if (subscription.points == 0) {
+    subscription.min = min_pt.getVector3fMap();
+    subscription.max = max_pt.getVector3fMap();
+  } else {
+    subscription.min = subscription.min.cwiseMin(min_pt.getVector3fMap());
+    subscription.max = subscription.max.cwiseMax(max_pt.getVector3fMap());
+  }
+  subscription.points += update.size();
 
-  subscription.map = msg;
+  bool significant;
+  if (subscription.trigger_points == 0) {
+    // we have never estimated with this map
+    significant = true;
+  } else {
+    const double points_change =
+        std::abs(double(subscription.points) -
+                 double(subscription.trigger_points)) /
+        double(subscription.trigger_points);
+    // how far the map expanded beyond its extent from the last estimation
+    const double bbox_growth =
+        std::max((subscription.trigger_min - subscription.min).maxCoeff(),
+                 (subscription.max - subscription.trigger_max).maxCoeff());
+    significant = points_change >= change_points_ratio_ ||
+                  bbox_growth >= change_bbox_growth_;
+  }
+
+  if (significant) {
+    subscription.trigger_points = subscription.points;
+    subscription.trigger_min = subscription.min;
+    subscription.trigger_max = subscription.max;
+  }
+  return significant;
+}
+
+/* requests estimation after change_delay_. changes that arrive in the
+ * meantime are served by the same estimation */
+void MapMerge3d::scheduleEstimation()
+{
+  std::lock_guard<std::mutex> lock(change_timer_mutex_);
+  if (change_pending_) {
+    return;
+  }
+  ROS_DEBUG("significant map change, estimation in %.2f s", change_delay_);
+  change_pending_ = true;
+  change_timer_.stop();
+  change_timer_.start();
 }
 
 std::vector<PointCloudConstPtr> MapMerge3d::getMaps()
@@ -168,7 +868,15 @@ std::vector<PointCloudConstPtr> MapMerge3d::getMaps()
   clouds.reserve(subscriptions_size_);
   for (auto& subscription : subscriptions_) {
     std::lock_guard<std::mutex> lock2(subscription.mutex);
-    clouds.emplace_back(subscription.map);
+    if (!subscription.map && !subscription.chunks.empty()) {
+      subscription.map = concatenateChunks(subscription.chunks);
+    }
+    if (subscription.map) {
+      clouds.emplace_back(subscription.map);
+    } else {
+      // we have not received this map yet
+      clouds.emplace_back(new PointCloud);
+    }
   }
 
   return clouds;
@@ -176,8 +884,35 @@ std::vector<PointCloudConstPtr> MapMerge3d::getMaps()
 
 std::vector<Eigen::Matrix4f> MapMerge3d::getTransforms()
 {
-  std::lock_guard<std::mutex> lock(transforms_mutex_);
-  return transforms_;
+  return getSnapshot()->transforms;
+}
+
+MapMerge3d::SnapshotPtr MapMerge3d::getSnapshot() const
+{
+  return std::atomic_load(&snapshot_);
+}
+
+/* copy-on-write update of the snapshot. readers keep using the old
+ * snapshot */
+void MapMerge3d::updateSnapshot(const std::function<void(Snapshot&)>& update)
+{
+  std::lock_guard<std::mutex> lock(snapshot_mutex_);
+  std::shared_ptr<Snapshot> snapshot(new Snapshot(*getSnapshot()));
+  update(*snapshot);
+  std::atomic_store(&snapshot_, SnapshotPtr(std::move(snapshot)));
+}
+
+/* publishes map to snapshot. subscription must be locked, so that updates of
+ * one map are published in order */
+void MapMerge3d::snapshotMap(const MapSubscription& subscription)
+{
+  updateSnapshot([&subscription](Snapshot& snapshot) {
+    snapshot.maps[subscription.index] = subscription.chunks;
+    snapshot.frame_ids[subscription.index] =
+        subscription.chunks.empty() ?
+            std::string() :
+            subscription.chunks.back()->header.frame_id;
+  });
 }
 
 std::string MapMerge3d::robotNameFromTopic(const std::string& topic)
@@ -207,22 +942,84 @@ bool MapMerge3d::isRobotMapTopic(const ros::master::TopicInfo& topic)
          is_map_topic;
 }
 
+static inline diagnostic_msgs::KeyValue keyValue(const std::string& key,
+                                                 double value)
+{
+  diagnostic_msgs::KeyValue key_value;
+  key_value.key = key;
+  key_value.value = std::to_string(value);
+  return key_value;
+}
+
+/* reports stages executed by this thread since cycle_start */
+void MapMerge3d::publishStatistics(const std::string& cycle_name,
+                                   int64_t cycle_start, double cycle_duration,
+                                   double cycle_period)
+{
+  const bool overrun = cycle_duration > cycle_period;
+  if (overrun) {
+    ROS_WARN("%s cycle took %.2f s, which is longer than its period %.2f s.",
+             cycle_name.c_str(), cycle_duration, cycle_period);
+  }
+
+  Tracer& tracer = Tracer::global();
+  if (trace_writer_) {
+    trace_writer_->write(tracer);
+  }
+
+  if (!publish_diagnostics_) {
+    return;
+  }
+
+  diagnostic_msgs::DiagnosticStatus status;
+  status.name = ros::this_node::getName() + ": " + cycle_name;
+  status.level = overrun ? diagnostic_msgs::DiagnosticStatus::WARN :
+                           diagnostic_msgs::DiagnosticStatus::OK;
+  status.message = overrun ? "cycle overran its period" : "OK";
+  status.values.emplace_back(keyValue("cycle time [s]", cycle_duration));
+  status.values.emplace_back(keyValue("cycle period [s]", cycle_period));
+  // cycle runs on the calling thread, other cycles may run concurrently
+  for (const auto& stage :
+       tracer.statistics(cycle_start, Tracer::currentThread())) {
+    status.values.emplace_back(
+        keyValue(stage.name + " calls", stage.calls));
+    status.values.emplace_back(
+        keyValue(stage.name + " time [ms]", stage.total_time));
+    status.values.emplace_back(
+        keyValue(stage.name + " max time [ms]", stage.max_time));
+    status.values.emplace_back(
+        keyValue(stage.name + " peak memory [MB]",
+                 stage.peak_rss / (1024. * 1024.)));
+    for (const auto& counter : stage.counters) {
+      status.values.emplace_back(
+          keyValue(stage.name + " " + counter.first, counter.second));
+    }
+  }
+
+  diagnostic_msgs::DiagnosticArray diagnostics;
+  diagnostics.header.stamp = ros::Time::now();
+  diagnostics.status.emplace_back(std::move(status));
+  diagnostics_publisher_.publish(diagnostics);
+}
+
 static inline std::vector<geometry_msgs::TransformStamped> computeTFTransforms(
     const std::vector<Eigen::Matrix4f>& transforms,
-    const std::vector<PointCloudConstPtr>& maps, const std::string& world_frame)
+    const std::vector<std::string>& frame_ids, const std::string& world_frame)
 {
   std::vector<geometry_msgs::TransformStamped> result;
   result.reserve(transforms.size());
-  // convert to ROS transforms
-  for (const auto& transform : transforms) {
+  for (size_t i = 0; i < transforms.size(); ++i) {
+    // maps we have not received yet have no frame
+    if (frame_ids[i].empty()) {
+      continue;
+    }
+    // convert to ROS transforms
     Eigen::Affine3d affine;
-    affine.matrix() = transform.cast<double>();
+    affine.matrix() = transforms[i].cast<double>();
     result.emplace_back(tf2::eigenToTransform(affine));
-  }
-  // fill frame_ids
-  for (size_t i = 0; i < result.size(); ++i) {
-    result[i].header.frame_id = world_frame;
-    result[i].child_frame_id = maps[i]->header.frame_id;
+    // fill frame_ids
+    result.back().header.frame_id = world_frame;
+    result.back().child_frame_id = frame_ids[i];
   }
 
   return result;
@@ -230,11 +1027,13 @@ static inline std::vector<geometry_msgs::TransformStamped> computeTFTransforms(
 
 void MapMerge3d::publishTF()
 {
-  if (!tf_current_flag_.test_and_set()) {
+  // no locking. snapshot is immutable
+  SnapshotPtr snapshot = getSnapshot();
+  if (snapshot != tf_snapshot_) {
     // need to recalculate stored transforms
-    auto transforms = getTransforms();  // this is thread-safe access
-    auto maps = getMaps();
-    tf_transforms_ = computeTFTransforms(transforms, maps, world_frame_);
+    tf_transforms_ = computeTFTransforms(snapshot->transforms,
+                                         snapshot->frame_ids, world_frame_);
+    tf_snapshot_ = std::move(snapshot);
   }
   if (tf_transforms_.empty()) {
     return;
@@ -249,19 +1048,3 @@ void MapMerge3d::publishTF()
 }
 
 }  // namespace map_merge_3d
-
-int main(int argc, char** argv)
-{
-  ros::init(argc, argv, "map_merge");
-  // this package is still in development -- start wil debugging enabled
-  if (ros::console::set_logger_level(ROSCONSOLE_DEFAULT_NAME,
-                                     ros::console::levels::Debug)) {
-    ros::console::notifyLoggerLevelsChanged();
-  }
-
-  map_merge_3d::MapMerge3d map_merge_node;
-  // use all threads for spinning
-  ros::MultiThreadedSpinner spinner;
-  spinner.spin();
-  return 0;
-}
@@ -0,0 +1,19 @@
+#include <map_merge_3d/map_merge_node.h>
+
+#include <ros/console.h>
+
+int main(int argc, char** argv)
+{
+  ros::init(argc, argv, "map_merge");
+  // this package is still in development -- start wil debugging enabled
+  if (ros::console::set_logger_level(ROSCONSOLE_DEFAULT_NAME,
+                                     ros::console::levels::Debug)) {
+    ros::console::notifyLoggerLevelsChanged();
+  }
+
+  map_merge_3d::MapMerge3d map_merge_node;
+  // use all threads for spinning
+  ros::MultiThreadedSpinner spinner;
+  spinner.spin();
+  return 0;
+}
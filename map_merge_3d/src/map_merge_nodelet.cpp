@@ -0,0 +1,29 @@
+#include <map_merge_3d/map_merge_node.h>
+
+#include <memory>
+
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+
+namespace map_merge_3d
+{
+/**
+ * @brief Runs MapMerge3d as a nodelet
+ * @details Maps published as PointCloud by nodelets in the same manager are
+ * passed by pointer, without serialization and copying.
+ */
+class MapMerge3dNodelet : public nodelet::Nodelet
+{
+  std::unique_ptr<MapMerge3d> map_merge_;
+
+  void onInit() override
+  {
+    // MapMerge3d callbacks are thread-safe
+    map_merge_.reset(
+        new MapMerge3d(getMTNodeHandle(), getMTPrivateNodeHandle()));
+  }
+};
+
+}  // namespace map_merge_3d
+
+PLUGINLIB_EXPORT_CLASS(map_merge_3d::MapMerge3dNodelet, nodelet::Nodelet)
@@ -1,10 +1,149 @@
+#include <map_merge_3d/distributed.h>
+#include <map_merge_3d/evaluation.h>
+#include <map_merge_3d/instrumentation.h>
 #include <map_merge_3d/map_merging.h>
 
+#include <fstream>
+#include <sstream>
+
+#include <pcl/common/time.h>
 #include <pcl/console/parse.h>
 #include <pcl/io/pcd_io.h>
 
 using namespace map_merge_3d;
 
+// offline registration of large maps may take long
+static const double WORKER_TIMEOUT = 3600.;
+
+/* parses comma-separated list of enum values */
+template <typename EnumT>
+static std::vector<EnumT> parseEnumList(int argc, char **argv,
+                                        const char *option, EnumT default_value)
+{
+  std::string list;
+  pcl::console::parse_argument(argc, argv, option, list);
+  if (list.empty()) {
+    return {default_value};
+  }
+
+  std::vector<EnumT> result;
+  std::istringstream stream(list);
+  std::string value;
+  while (std::getline(stream, value, ',')) {
+    result.push_back(enums::from_string<EnumT>(value));
+  }
+  return result;
+}
+
+/* distances scale with the resolution, the same as their defaults in
+ * MapMergingParams */
+static MapMergingParams withResolution(const MapMergingParams &params,
+                                       double resolution)
+{
+  MapMergingParams result = params;
+  const double scale = resolution / params.resolution;
+  result.resolution = resolution;
+  result.descriptor_radius *= scale;
+  result.normal_radius *= scale;
+  result.inlier_threshold *= scale;
+  result.max_correspondence_distance *= scale;
+  result.pose_graph_kernel_width *= scale;
+  result.loop_translation_tolerance *= scale;
+  result.transform_translation_tolerance *= scale;
+  result.submap_overlap *= scale;
+  result.submap_translation_tolerance *= scale;
+  return result;
+}
+
+/* sweeps grid of parameters and writes accuracy and resources usage for each
+ * configuration as CSV */
+static int runBenchmark(int argc, char **argv,
+                        const std::vector<PointCloudConstPtr> &clouds,
+                        const MapMergingParams &params)
+{
+  std::string ground_truth_file;
+  std::string output_file = "benchmark.csv";
+  pcl::console::parse_argument(argc, argv, "--ground_truth", ground_truth_file);
+  pcl::console::parse_argument(argc, argv, "--benchmark_output", output_file);
+  if (ground_truth_file.empty()) {
+    pcl::console::print_error("Benchmark needs --ground_truth file!\n");
+    return -1;
+  }
+
+  std::vector<Eigen::Matrix4f> ground_truth = loadTransforms(ground_truth_file);
+  if (ground_truth.size() != clouds.size()) {
+    pcl::console::print_error("Ground truth has %zu transforms, but there are "
+                              "%zu input files!\n",
+                              ground_truth.size(), clouds.size());
+    return -1;
+  }
+
+  // parameters grid
+  std::vector<Descriptor> descriptor_types = parseEnumList(
+      argc, argv, "--descriptor_types", params.descriptor_type);
+  std::vector<Keypoint> keypoint_types =
+      parseEnumList(argc, argv, "--keypoint_types", params.keypoint_type);
+  std::vector<EstimationMethod> estimation_methods = parseEnumList(
+      argc, argv, "--estimation_methods", params.estimation_method);
+  std::vector<double> resolutions;
+  pcl::console::parse_x_arguments(argc, argv, "--resolutions", resolutions);
+  if (resolutions.empty()) {
+    resolutions.push_back(params.resolution);
+  }
+
+  std::ofstream output(output_file);
+  output << "descriptor_type,keypoint_type,estimation_method,resolution,"
+            "wall_time_s,peak_rss_mb,merged_maps,mean_rotation_error_rad,"
+            "max_rotation_error_rad,mean_translation_error,"
+            "max_translation_error,status"
+         << std::endl;
+
+  for (double resolution : resolutions) {
+    for (Descriptor descriptor_type : descriptor_types) {
+      for (Keypoint keypoint_type : keypoint_types) {
+        for (EstimationMethod estimation_method : estimation_methods) {
+          MapMergingParams config = withResolution(params, resolution);
+          config.descriptor_type = descriptor_type;
+          config.keypoint_type = keypoint_type;
+          config.estimation_method = estimation_method;
+
+          pcl::console::print_highlight(
+              "Benchmarking %s, %s, %s, resolution %g\n",
+              enums::to_string(descriptor_type),
+              enums::to_string(keypoint_type),
+              enums::to_string(estimation_method), resolution);
+
+          std::string status = "OK";
+          std::vector<Eigen::Matrix4f> transforms;
+          resetPeakResidentMemory();
+          pcl::StopWatch timer;
+          try {
+            transforms = estimateMapsTransforms(clouds, config);
+          } catch (const std::exception &e) {
+            status = e.what();
+            transforms.assign(clouds.size(), Eigen::Matrix4f::Zero());
+          }
+          const double wall_time = timer.getTimeSeconds();
+          const double peak_rss = peakResidentMemory() / (1024. * 1024.);
+          TransformsError error = evaluateTransforms(transforms, ground_truth);
+
+          output << descriptor_type << "," << keypoint_type << ","
+                 << estimation_method << "," << resolution << ","
+                 << wall_time << "," << peak_rss << "," << error.merged << ","
+                 << error.mean_rotation << "," << error.max_rotation << ","
+                 << error.mean_translation << "," << error.max_translation
+                 << ",\"" << status << "\"" << std::endl;
+        }
+      }
+    }
+  }
+
+  pcl::console::print_highlight("Benchmark results written to %s\n",
+                                output_file.c_str());
+
+  return 0;
+}
+
 int main(int argc, char **argv)
 {
   std::vector<int> pcd_file_indices =
@@ -32,10 +171,31 @@ int main(int argc, char **argv)
     clouds.push_back(cloud);
   }
 
+  if (pcl::console::find_switch(argc, argv, "--benchmark")) {
+    return runBenchmark(argc, argv, clouds, params);
+  }
+
   pcl::console::print_highlight("Estimating transforms.\n");
 
+  EstimationContext context;
+  // workers are forked before estimation starts any threads
+  int workers = 0;
+  pcl::console::parse_argument(argc, argv, "--workers", workers);
+  if (workers > 0) {
+    context.workers = std::make_shared<RegistrationWorkers>(
+        std::vector<std::string>(), size_t(workers), WORKER_TIMEOUT);
+  }
   std::vector<Eigen::Matrix4f> transforms =
-      estimateMapsTransforms(clouds, params);
+      estimateMapsTransforms(clouds, params, context);
+
+  pcl::console::print_highlight("Pairwise registrations:\n");
+
+  for (const auto &estimate : context.pairwise_estimates) {
+    std::cout << "pair " << estimate.source_idx << " -> "
+              << estimate.target_idx
+              << " (confidence: " << estimate.confidence << ")" << std::endl
+              << estimate.registration << std::endl;
+  }
 
   pcl::console::print_highlight("Estimated transforms:\n");
 
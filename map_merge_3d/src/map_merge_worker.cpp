@@ -0,0 +1,76 @@
+#include <map_merge_3d/distributed.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <pcl/console/parse.h>
+#include <pcl/console/print.h>
+
+using namespace map_merge_3d;
+
+/* registers pairs of maps for RegistrationWorkers. Serves either a connection
+ * inherited from the parent process (--fd) or connections to a unix domain
+ * socket (--socket) one by one. */
+int main(int argc, char **argv)
+{
+  using pcl::console::parse_argument;
+
+  int fd = -1;
+  std::string socket_path;
+  parse_argument(argc, argv, "--fd", fd);
+  parse_argument(argc, argv, "--socket", socket_path);
+
+  if (fd >= 0) {
+    try {
+      serveRegistrationWorker(fd);
+    } catch (const std::exception &e) {
+      pcl::console::print_error("%s\n", e.what());
+      return -1;
+    }
+    return 0;
+  }
+
+  sockaddr_un address;
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (socket_path.empty() || socket_path.size() >= sizeof(address.sun_path)) {
+    pcl::console::print_error("Need --socket path or --fd descriptor!\n");
+    return -1;
+  }
+  std::strcpy(address.sun_path, socket_path.c_str());
+
+  const int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  // socket left behind by the previous run
+  ::unlink(socket_path.c_str());
+  if (listener < 0 ||
+      ::bind(listener, reinterpret_cast<sockaddr *>(&address),
+             sizeof(address)) != 0 ||
+      ::listen(listener, 1) != 0) {
+    pcl::console::print_error("Cannot listen on %s: %s\n", socket_path.c_str(),
+                              std::strerror(errno));
+    return -1;
+  }
+  pcl::console::print_highlight("Listening on %s.\n", socket_path.c_str());
+
+  for (;;) {
+    const int connection = ::accept(listener, nullptr, nullptr);
+    if (connection < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      pcl::console::print_error("Cannot accept connection: %s\n",
+                                std::strerror(errno));
+      return -1;
+    }
+    try {
+      serveRegistrationWorker(connection);
+    } catch (const std::exception &e) {
+      // coordinator will retry with another worker
+      pcl::console::print_error("%s\n", e.what());
+    }
+  }
+}
@@ -1,7 +1,23 @@
+#include <map_merge_3d/distributed.h>
 #include <map_merge_3d/features.h>
+#include <map_merge_3d/instrumentation.h>
 #include <map_merge_3d/map_merging.h>
+#include <map_merge_3d/state_store.h>
+#include <map_merge_3d/submaps.h>
 #include "graph.h"
+#include "pose_graph.h"
 
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <unordered_map>
+#include <utility>
+
+#include <Eigen/Geometry>
+
+#include <pcl/common/common.h>
+#include <pcl/common/point_tests.h>
+#include <pcl/common/time.h>
 #include <pcl/common/transforms.h>
 #include <pcl/console/parse.h>
 
@@ -49,6 +65,42 @@ MapMergingParams MapMergingParams::fromCommandLine(int argc, char **argv)
   parse_argument(argc, argv, "--confidence_threshold",
                  params.confidence_threshold);
   parse_argument(argc, argv, "--output_resolution", params.output_resolution);
+  parse_argument(argc, argv, "--tracking", params.tracking);
+  parse_argument(argc, argv, "--tracking_score_ratio",
+                 params.tracking_score_ratio);
+  parse_argument(argc, argv, "--pose_graph_iterations",
+                 params.pose_graph_iterations);
+  parse_argument(argc, argv, "--pose_graph_kernel_width",
+                 params.pose_graph_kernel_width);
+  parse_argument(argc, argv, "--filter_inconsistent_loops",
+                 params.filter_inconsistent_loops);
+  parse_argument(argc, argv, "--loop_translation_tolerance",
+                 params.loop_translation_tolerance);
+  parse_argument(argc, argv, "--loop_rotation_tolerance",
+                 params.loop_rotation_tolerance);
+  parse_argument(argc, argv, "--prune_implied_pairs",
+                 params.prune_implied_pairs);
+  parse_argument(argc, argv, "--keep_reference_frame",
+                 params.keep_reference_frame);
+  parse_argument(argc, argv, "--transform_translation_tolerance",
+                 params.transform_translation_tolerance);
+  parse_argument(argc, argv, "--transform_rotation_tolerance",
+                 params.transform_rotation_tolerance);
+  parse_argument(argc, argv, "--submap_size", params.submap_size);
+  parse_argument(argc, argv, "--submap_overlap", params.submap_overlap);
+  std::string outliers_filter;
+  parse_argument(argc, argv, "--outliers_filter", outliers_filter);
+  if (!outliers_filter.empty()) {
+    params.outliers_filter = enums::from_string<OutlierFilter>(outliers_filter);
+  }
+  parse_argument(argc, argv, "--feature_threads", params.feature_threads);
+  parse_argument(argc, argv, "--adaptive_descriptor_radius",
+                 params.adaptive_descriptor_radius);
+  parse_argument(argc, argv, "--submap_candidates", params.submap_candidates);
+  parse_argument(argc, argv, "--submap_translation_tolerance",
+                 params.submap_translation_tolerance);
+  parse_argument(argc, argv, "--submap_rotation_tolerance",
+                 params.submap_rotation_tolerance);
 
   return params;
 }
@@ -93,6 +145,32 @@ MapMergingParams MapMergingParams::fromROSNode(const ros::NodeHandle &n)
   n.getParam("confidence_threshold",
                  params.confidence_threshold);
   n.getParam("output_resolution", params.output_resolution);
+  n.getParam("tracking", params.tracking);
+  n.getParam("tracking_score_ratio", params.tracking_score_ratio);
+  n.getParam("pose_graph_iterations", params.pose_graph_iterations);
+  n.getParam("pose_graph_kernel_width", params.pose_graph_kernel_width);
+  n.getParam("filter_inconsistent_loops", params.filter_inconsistent_loops);
+  n.getParam("loop_translation_tolerance", params.loop_translation_tolerance);
+  n.getParam("loop_rotation_tolerance", params.loop_rotation_tolerance);
+  n.getParam("prune_implied_pairs", params.prune_implied_pairs);
+  n.getParam("keep_reference_frame", params.keep_reference_frame);
+  n.getParam("transform_translation_tolerance",
+             params.transform_translation_tolerance);
+  n.getParam("transform_rotation_tolerance",
+             params.transform_rotation_tolerance);
+  n.getParam("submap_size", params.submap_size);
+  n.getParam("submap_overlap", params.submap_overlap);
+  std::string outliers_filter;
+  n.getParam("outliers_filter", outliers_filter);
+  if (!outliers_filter.empty()) {
+    params.outliers_filter = enums::from_string<OutlierFilter>(outliers_filter);
+  }
+  n.getParam("feature_threads", params.feature_threads);
+  n.getParam("adaptive_descriptor_radius", params.adaptive_descriptor_radius);
+  n.getParam("submap_candidates", params.submap_candidates);
+  n.getParam("submap_translation_tolerance",
+             params.submap_translation_tolerance);
+  n.getParam("submap_rotation_tolerance", params.submap_rotation_tolerance);
 
   return params;
 }
@@ -118,45 +196,114 @@ std::ostream &operator<<(std::ostream &stream, const MapMergingParams &params)
   stream << "confidence_threshold: " << params.confidence_threshold
          << std::endl;
   stream << "output_resolution: " << params.output_resolution << std::endl;
+  stream << "tracking: " << params.tracking << std::endl;
+  stream << "tracking_score_ratio: " << params.tracking_score_ratio
+         << std::endl;
+  stream << "pose_graph_iterations: " << params.pose_graph_iterations
+         << std::endl;
+  stream << "pose_graph_kernel_width: " << params.pose_graph_kernel_width
+         << std::endl;
+  stream << "filter_inconsistent_loops: " << params.filter_inconsistent_loops
+         << std::endl;
+  stream << "loop_translation_tolerance: "
+         << params.loop_translation_tolerance << std::endl;
+  stream << "loop_rotation_tolerance: " << params.loop_rotation_tolerance
+         << std::endl;
+  stream << "prune_implied_pairs: " << params.prune_implied_pairs
+         << std::endl;
+  stream << "keep_reference_frame: " << params.keep_reference_frame
+         << std::endl;
+  stream << "transform_translation_tolerance: "
+         << params.transform_translation_tolerance << std::endl;
+  stream << "transform_rotation_tolerance: "
+         << params.transform_rotation_tolerance << std::endl;
+  stream << "submap_size: " << params.submap_size << std::endl;
+  stream << "submap_overlap: " << params.submap_overlap << std::endl;
+  stream << "outliers_filter: " << params.outliers_filter << std::endl;
+  stream << "feature_threads: " << params.feature_threads << std::endl;
+  stream << "adaptive_descriptor_radius: " << params.adaptive_descriptor_radius
+         << std::endl;
+  stream << "submap_candidates: " << params.submap_candidates << std::endl;
+  stream << "submap_translation_tolerance: "
+         << params.submap_translation_tolerance << std::endl;
+  stream << "submap_rotation_tolerance: " << params.submap_rotation_tolerance
+         << std::endl;
 
   return stream;
 }
 
+const size_t EstimationContext::NO_REFERENCE = size_t(-1);
+
 /**
- * @brief Finds transformation between from and to in pairwise_transforms
- * @details May return either transform present in pairwise_transforms or
- * inverse of suitable transform that represent transform between from and to
- * nodes.
+ * @brief Returns transformation between from and to given by estimate
+ * @details May return either transform of the estimate or its inverse, based
+ * on the direction of the estimate.
  *
- * @param pairwise_transforms transform to look
+ * @param estimate estimate between from and to nodes
  * @param from source index
  * @param to target index
- * @return Required transform or zero matrix if the transform could not be
- * found.
+ * @return Required transform or zero matrix if the estimate is not between
+ * from and to.
  */
-static inline Eigen::Matrix4f
-getTransform(const std::vector<TransformEstimate> &pairwise_transforms,
-             size_t from, size_t to)
+static inline Eigen::Matrix4f getTransform(const TransformEstimate &estimate,
+                                           size_t from, size_t to)
 {
-  for (const auto &est : pairwise_transforms) {
-    if (est.source_idx == from && est.target_idx == to) {
-      return est.transform.inverse();
-    }
-    if (est.source_idx == to && est.target_idx == from) {
-      return est.transform;
-    }
+  if (estimate.source_idx == from && estimate.target_idx == to) {
+    return estimate.transform.inverse();
+  }
+  if (estimate.source_idx == to && estimate.target_idx == from) {
+    return estimate.transform;
   }
 
   return Eigen::Matrix4f::Zero();
 }
 
+/**
+ * @brief Computes transforms of all maps to the reference frame
+ *
+ * @param pairwise_transforms pairwise estimates
+ * @param params estimation parameters
+ * @param reference_frame preferred reference frame, used if it is in the
+ * spanning tree. Otherwise the center of the tree is used. Receives the used
+ * reference frame.
+ * @return global transforms, empty if no map could be merged
+ */
 static inline std::vector<Eigen::Matrix4f> computeGlobalTransforms(
     const std::vector<TransformEstimate> &pairwise_transforms,
-    double confidence_threshold)
+    const MapMergingParams &params, size_t &reference_frame)
 {
+  ScopedTimer timer("computeGlobalTransforms", "graph");
+  timer.addCounter("pairwise_estimates", pairwise_transforms.size());
+
+  // drop confident estimates that break loops
+  std::vector<TransformEstimate> estimates;
+  if (params.filter_inconsistent_loops) {
+    LoopConsistency loops(numberOfNodesInEstimates(pairwise_transforms),
+                          params.loop_translation_tolerance,
+                          params.loop_rotation_tolerance);
+    for (const auto &est : pairwise_transforms) {
+      if (est.confidence >= params.confidence_threshold) {
+        loops.addEstimate(est);
+      } else {
+        estimates.push_back(est);
+      }
+    }
+    size_t rejected = 0;
+    for (auto &est : loops.consistentEstimates(rejected)) {
+      estimates.push_back(std::move(est));
+    }
+    timer.addCounter("inconsistent_estimates", rejected);
+  } else {
+    estimates = pairwise_transforms;
+  }
+
   // consider only largest conncted component
   std::vector<TransformEstimate> component =
-      largestConnectedComponent(pairwise_transforms, confidence_threshold);
+      largestConnectedComponent(estimates, params.confidence_threshold);
+  if (component.empty()) {
+    reference_frame = EstimationContext::NO_REFERENCE;
+    return {};
+  }
 
   // find maximum spanning tree
   Graph span_tree;
@@ -166,8 +313,11 @@ static inline std::vector<Eigen::Matrix4f> computeGlobalTransforms(
 
   // size of the largest connected component
   const size_t nodes_count = numberOfNodesInEstimates(pairwise_transforms);
-  // index of the node taken as the reference frame
-  const size_t reference_frame = span_tree_centers[0];
+  // center of the tree unless the reference frame is given
+  if (reference_frame >= span_tree.numVertices() ||
+      span_tree.degree(reference_frame) == 0) {
+    reference_frame = span_tree_centers[0];
+  }
   // init all transforms as invalid
   std::vector<Eigen::Matrix4f> global_transforms(nodes_count,
                                                  Eigen::Matrix4f::Zero());
@@ -175,105 +325,681 @@ static inline std::vector<Eigen::Matrix4f> computeGlobalTransforms(
   global_transforms[reference_frame] = Eigen::Matrix4f::Identity();
   // compute global transforms by chaining them together
   span_tree.walkBreadthFirst(
-      span_tree_centers[0],
+      reference_frame,
       [&global_transforms, &component](const GraphEdge &edge) {
         global_transforms[edge.to] =
             global_transforms[edge.from] *
-            getTransform(component, edge.from, edge.to);
+            getTransform(component[edge.index], edge.from, edge.to);
       });
 
+  // spanning tree is the initial guess for optimization over all estimates
+  if (params.pose_graph_iterations > 0) {
+    ScopedTimer optimization_timer("optimizePoseGraph", "graph");
+    // estimates disagreeing with the spanning tree are wrong registrations,
+    // robust kernel would only reduce their influence
+    std::vector<TransformEstimate> edges;
+    size_t rejected = 0;
+    for (const auto &est : component) {
+      if (est.confidence < params.confidence_threshold ||
+          global_transforms[est.source_idx].isZero() ||
+          global_transforms[est.target_idx].isZero()) {
+        continue;
+      }
+      const Eigen::Matrix4f tree_transform =
+          global_transforms[est.target_idx].inverse() *
+          global_transforms[est.source_idx];
+      if (transformChanged(tree_transform, est.transform,
+                           params.loop_translation_tolerance,
+                           params.loop_rotation_tolerance)) {
+        ++rejected;
+        continue;
+      }
+      edges.push_back(est);
+    }
+    optimization_timer.addCounter("edges", edges.size());
+    optimization_timer.addCounter("rejected_edges", rejected);
+    const size_t iterations = optimizePoseGraph(
+        edges, global_transforms, reference_frame, params.pose_graph_iterations,
+        params.pose_graph_kernel_width);
+    optimization_timer.addCounter("iterations", iterations);
+  }
+
   return global_transforms;
 }
 
+/* feature-based registration of two clouds with the score of the result */
+static inline RegistrationResult registerClouds(
+    const PointCloudPtr &source_points, const PointCloudPtr &source_keypoints,
+    const LocalDescriptorsPtr &source_descriptors,
+    const PointCloudPtr &target_points, const PointCloudPtr &target_keypoints,
+    const LocalDescriptorsPtr &target_descriptors,
+    const MapMergingParams &params)
+{
+  RegistrationResult registration = estimateTransform(
+      source_points, source_keypoints, source_descriptors, target_points,
+      target_keypoints, target_descriptors, params.estimation_method,
+      params.refine_transform, params.inlier_threshold,
+      params.max_correspondence_distance, params.max_iterations,
+      params.matching_k, params.transform_epsilon);
+
+  pcl::StopWatch score_timer;
+  registration.score =
+      transformScore(source_points, target_points, registration.transform,
+                     params.max_correspondence_distance);
+  registration.scoring_time = score_timer.getTime();
+
+  return registration;
+}
+
+/**
+ * @brief Points of cloud near the other cloud
+ *
+ * @param cloud cloud to crop
+ * @param other the other cloud
+ * @param other_to_cloud transform from the other cloud to the cloud
+ * @param margin extension of the bounding box of the other cloud
+ * @return points of cloud in the bounding box of the other cloud extended by
+ * margin
+ */
+static inline PointCloudPtr cropToOverlap(const PointCloudPtr &cloud,
+                                          const PointCloud &other,
+                                          const Eigen::Matrix4f &other_to_cloud,
+                                          float margin)
+{
+  PointCloudPtr result(new PointCloud);
+  result->header = cloud->header;
+  if (other.empty()) {
+    return result;
+  }
+  PointT min, max;
+  pcl::getMinMax3D(other, min, max);
+  const Eigen::AlignedBox3f other_box(min.getVector3fMap(),
+                                      max.getVector3fMap());
+  const Eigen::Affine3f transform(other_to_cloud);
+  Eigen::AlignedBox3f box;
+  box.setEmpty();
+  for (int corner = 0; corner < 8; ++corner) {
+    box.extend(transform *
+               other_box.corner(Eigen::AlignedBox3f::CornerType(corner)));
+  }
+  box.min().array() -= margin;
+  box.max().array() += margin;
+
+  for (const auto &point : *cloud) {
+    if (box.contains(point.getVector3fMap())) {
+      result->push_back(point);
+    }
+  }
+  return result;
+}
+
+/* aborts estimation if requested */
+static inline void checkCancelled(const std::function<bool()> &is_cancelled)
+{
+  if (is_cancelled && is_cancelled()) {
+    throw EstimationCancelled();
+  }
+}
+
+static inline void checkCancelled(const EstimationContext &context)
+{
+  checkCancelled(context.is_cancelled);
+}
+
+/* appends descriptors of the same type */
+static inline void appendDescriptors(LocalDescriptors &descriptors,
+                                     const LocalDescriptors &other)
+{
+  if (descriptors.fields.empty()) {
+    descriptors = other;
+    return;
+  }
+  descriptors.data.insert(descriptors.data.end(), other.data.begin(),
+                          other.data.end());
+  descriptors.width += other.width * other.height;
+  descriptors.height = 1;
+  descriptors.row_step = descriptors.width * descriptors.point_step;
+  descriptors.is_dense = descriptors.is_dense && other.is_dense;
+}
+
+/**
+ * @brief Computes keypoints and descriptors of a map submap by submap
+ * @details Only points of one submap extended by submap_overlap are processed
+ * at a time, so normals and search structures of the whole map are never held
+ * in memory. Each keypoint is kept only in the submap it lies in, the
+ * extension provides neighbourhoods of keypoints on the border. Normals of the
+ * whole map are not kept.
+ */
+static void computeSubmapFeatures(MapFeatures &features,
+                                  const MapMergingParams &params,
+                                  const EstimationContext &context)
+{
+  const PointCloud &cloud = *features.cloud;
+  const double size = params.submap_size;
+  auto cellOf = [size](float coordinate) {
+    return int(std::floor(coordinate / size));
+  };
+  std::map<std::pair<int, int>, std::vector<int>> cells;
+  for (size_t i = 0; i < cloud.size(); ++i) {
+    if (pcl::isFinite(cloud[i])) {
+      cells[{cellOf(cloud[i].x), cellOf(cloud[i].y)}].push_back(int(i));
+    }
+  }
+
+  features.normals.reset(new SurfaceNormals);
+  features.keypoints.reset(new PointCloud);
+  features.keypoints->header = cloud.header;
+  features.descriptors.reset(new LocalDescriptors);
+  const int reach = int(std::ceil(params.submap_overlap / size));
+  for (const auto &cell : cells) {
+    checkCancelled(context);
+    const int x = cell.first.first;
+    const int y = cell.first.second;
+    const double min_x = x * size - params.submap_overlap;
+    const double max_x = (x + 1) * size + params.submap_overlap;
+    const double min_y = y * size - params.submap_overlap;
+    const double max_y = (y + 1) * size + params.submap_overlap;
+    PointCloudPtr points(new PointCloud);
+    points->header = cloud.header;
+    for (int dx = -reach; dx <= reach; ++dx) {
+      for (int dy = -reach; dy <= reach; ++dy) {
+        auto neighbour = cells.find({x + dx, y + dy});
+        if (neighbour == cells.end()) {
+          continue;
+        }
+        for (int i : neighbour->second) {
+          const PointT &point = cloud[size_t(i)];
+          if (point.x >= min_x && point.x <= max_x && point.y >= min_y &&
+              point.y <= max_y) {
+            points->push_back(point);
+          }
+        }
+      }
+    }
+
+    SurfaceNormalsPtr normals = computeSurfaceNormals(
+        points, params.normal_radius, params.feature_threads);
+    std::vector<float> scales;
+    PointCloudPtr detected = detectKeypoints(
+        points, normals, params.keypoint_type, params.keypoint_threshold,
+        params.normal_radius, params.resolution, params.feature_threads,
+        &scales);
+    // keypoints of the cell itself
+    PointCloudPtr keypoints(new PointCloud);
+    keypoints->header = cloud.header;
+    std::vector<float> keypoints_scales;
+    for (size_t k = 0; k < detected->size(); ++k) {
+      const PointT &keypoint = (*detected)[k];
+      if (cellOf(keypoint.x) == x && cellOf(keypoint.y) == y) {
+        keypoints->push_back(keypoint);
+        if (k < scales.size()) {
+          keypoints_scales.push_back(scales[k]);
+        }
+      }
+    }
+    if (keypoints->empty()) {
+      continue;
+    }
+
+    LocalDescriptorsPtr descriptors;
+    if (params.adaptive_descriptor_radius) {
+      descriptors = computeLocalDescriptors(
+          points, normals, keypoints, params.descriptor_type,
+          params.descriptor_radius, params.feature_threads, keypoints_scales);
+    } else {
+      descriptors = computeLocalDescriptors(points, normals, keypoints,
+                                            params.descriptor_type,
+                                            params.descriptor_radius,
+                                            params.feature_threads);
+    }
+    *features.keypoints += *keypoints;
+    appendDescriptors(*features.descriptors, *descriptors);
+  }
+}
+
+TransformEstimate
+estimatePairTransform(const MapFeatures &source, const MapFeatures &target,
+                      const MapMergingParams &params,
+                      const std::function<bool()> &is_cancelled)
+{
+  TransformEstimate estimate(0, 0);
+  estimate.transform = Eigen::Matrix4f::Zero();
+  if (!(params.submap_size > 0.)) {
+    estimate.registration = registerClouds(
+        source.cloud, source.keypoints, source.descriptors, target.cloud,
+        target.keypoints, target.descriptors, params);
+    estimate.transform = estimate.registration.transform;
+    estimate.confidence = 1. / estimate.registration.score;
+    estimate.global_score = estimate.registration.score;
+    return estimate;
+  }
+
+  if (source.submaps.empty() || target.submaps.empty()) {
+    return estimate;
+  }
+
+  // keypoints of whole maps are matched once, matches select submap pairs
+  ScopedTimer timer("registerSubmaps", "matching");
+  CorrespondencesPtr correspondences = findFeatureCorrespondences(
+      source.descriptors, target.descriptors, params.matching_k);
+  const std::vector<std::pair<size_t, size_t>> candidates =
+      selectSubmapPairs(source.submaps, target.submaps, *correspondences,
+                        size_t(std::max(params.submap_candidates, 0)));
+  timer.addCounter("submap_pairs", candidates.size());
+
+  // register selected submaps against submaps
+  std::vector<TransformEstimate> submap_estimates;
+  for (const auto &candidate : candidates) {
+    checkCancelled(is_cancelled);
+    const Submap &source_submap = source.submaps[candidate.first];
+    const Submap &target_submap = target.submaps[candidate.second];
+    TransformEstimate submap_estimate(candidate.first, candidate.second);
+    submap_estimate.registration = registerClouds(
+        extractSubmapCloud(source.cloud, source_submap, params.submap_size,
+                           params.submap_overlap),
+        source_submap.keypoints, source_submap.descriptors,
+        extractSubmapCloud(target.cloud, target_submap, params.submap_size,
+                           params.submap_overlap),
+        target_submap.keypoints, target_submap.descriptors, params);
+    submap_estimate.transform = submap_estimate.registration.transform;
+    submap_estimate.confidence = 1. / submap_estimate.registration.score;
+    submap_estimates.push_back(std::move(submap_estimate));
+  }
+  estimate = aggregateSubmapEstimates(submap_estimates,
+                                      params.submap_translation_tolerance,
+                                      params.submap_rotation_tolerance);
+  estimate.source_idx = 0;
+  estimate.target_idx = 0;
+  estimate.global_score = estimate.registration.score;
+  return estimate;
+}
+
 std::vector<Eigen::Matrix4f>
 estimateMapsTransforms(const std::vector<PointCloudConstPtr> &clouds,
                        const MapMergingParams &params)
 {
+  EstimationContext context;
+  return estimateMapsTransforms(clouds, params, context);
+}
+
+std::vector<Eigen::Matrix4f>
+estimateMapsTransforms(const std::vector<PointCloudConstPtr> &clouds,
+                       const MapMergingParams &params,
+                       EstimationContext &context)
+{
+  // results of the previous estimation are used for tracking
+  std::vector<TransformEstimate> previous_estimates;
+  previous_estimates.swap(context.pairwise_estimates);
+  std::vector<Eigen::Matrix4f> previous_transforms;
+  previous_transforms.swap(context.transforms);
+
+  ScopedTimer total_timer("estimateMapsTransforms", "map_merging");
+  total_timer.addCounter("clouds", clouds.size());
+  checkCancelled(context);
+
   if (clouds.empty()) {
+    context.reference_frame = EstimationContext::NO_REFERENCE;
     return {};
   }
   if (clouds.size() == 1) {
-    return {Eigen::Matrix4f::Identity()};
+    context.reference_frame = 0;
+    context.transforms = {Eigen::Matrix4f::Identity()};
+    return context.transforms;
   }
 
-  // per cloud data extracted for transform estimation
-  std::vector<PointCloudPtr> clouds_resized;
-  std::vector<SurfaceNormalsPtr> normals;
-  std::vector<PointCloudPtr> keypoints;
-  std::vector<LocalDescriptorsPtr> descriptors;
-  clouds_resized.reserve(clouds.size());
-  normals.reserve(clouds.size());
-  keypoints.reserve(clouds.size());
-  descriptors.reserve(clouds.size());
+  /* compute per-cloud features needed for all registrations */
 
-  /* compute per-cloud features */
+  // reuse features of unchanged clouds
+  std::vector<MapFeatures> &features = context.features;
+  features.resize(clouds.size());
+  std::vector<size_t> changed;
+  std::vector<bool> unchanged(clouds.size(), false);
+  for (size_t i = 0; i < clouds.size(); ++i) {
+    if (features[i].source == clouds[i]) {
+      unchanged[i] = true;
+      continue;
+    }
+    features[i] = MapFeatures();
+    if (clouds[i]->empty()) {
+      // nothing to compute, empty cloud does not take part in registration
+      features[i].source = clouds[i];
+      features[i].hash = cloudHash(*clouds[i]);
+      features[i].cloud.reset(new PointCloud);
+      features[i].normals.reset(new SurfaceNormals);
+      features[i].keypoints.reset(new PointCloud);
+      features[i].descriptors.reset(new LocalDescriptors);
+      continue;
+    }
+    changed.push_back(i);
+  }
+  total_timer.addCounter("cached_features", clouds.size() - changed.size());
 
   // resize clouds to registration resolution
-  for (auto &cloud : clouds) {
-    PointCloudPtr resized = downSample(cloud, params.resolution);
-    clouds_resized.emplace_back(std::move(resized));
+  for (size_t i : changed) {
+    checkCancelled(context);
+    ScopedTimer timer("downSample", "features");
+    PointCloudPtr resized = downSample(clouds[i], params.resolution);
+    timer.addCounter("input_points", clouds[i]->size());
+    timer.addCounter("output_points", resized->size());
+    features[i].cloud = std::move(resized);
   }
 
   // remove noise (this reduces number of keypoints)
-  for (auto &cloud : clouds_resized) {
+  for (size_t i : changed) {
+    checkCancelled(context);
+    ScopedTimer timer("removeOutliers", "features");
+    PointCloudPtr &cloud = features[i].cloud;
+    timer.addCounter("input_points", cloud->size());
     cloud = removeOutliers(cloud, params.descriptor_radius,
-                           params.outliers_min_neighbours);
+                           params.outliers_min_neighbours,
+                           params.outliers_filter);
+    timer.addCounter("output_points", cloud->size());
+    // the cloud is complete, descriptors are computed only when needed
+    features[i].hash = cloudHash(*clouds[i]);
+    features[i].source = clouds[i];
+  }
+
+  /* reuse or track pairs registered in the previous estimation */
+
+  std::vector<TransformEstimate> &pairwise_transforms =
+      context.pairwise_estimates;
+  std::vector<std::pair<size_t, size_t>> global_pairs;
+  // maps merged in the previous estimation
+  std::vector<bool> tracked(clouds.size(), false);
+  if (params.tracking && previous_transforms.size() <= clouds.size()) {
+    for (size_t i = 0; i < previous_transforms.size(); ++i) {
+      tracked[i] = !previous_transforms[i].isZero();
+    }
+  }
+  // previous estimates by pair of maps
+  std::unordered_map<size_t, const TransformEstimate *> previous_by_pair;
+  previous_by_pair.reserve(previous_estimates.size());
+  for (const auto &est : previous_estimates) {
+    if (est.source_idx < clouds.size() && est.target_idx < clouds.size()) {
+      previous_by_pair.emplace(est.source_idx * clouds.size() + est.target_idx,
+                               &est);
+    }
+  }
+  size_t reused_pairs = 0;
+  size_t tracked_pairs = 0;
+  for (size_t i = 0; i < clouds.size(); ++i) {
+    for (size_t j = i + 1; j < clouds.size(); ++j) {
+      auto found = previous_by_pair.find(i * clouds.size() + j);
+      const TransformEstimate *previous =
+          found == previous_by_pair.end() ? nullptr : found->second;
+      if (previous && unchanged[i] && unchanged[j]) {
+        // registered from the same features
+        pairwise_transforms.push_back(*previous);
+        ++reused_pairs;
+        continue;
+      }
+      if (!tracked[i] || !tracked[j]) {
+        global_pairs.emplace_back(i, j);
+        continue;
+      }
+      if (!previous) {
+        // maps had no keypoints to match, maps that changed since may have
+        if (!unchanged[i] || !unchanged[j]) {
+          global_pairs.emplace_back(i, j);
+        }
+        continue;
+      }
+      // previous relative transform i -> j
+      const Eigen::Matrix4f guess =
+          previous_transforms[j].inverse() * previous_transforms[i];
+      // only estimates that agree with the previous result are tracked, i.e.
+      // the spanning tree and estimates consistent with it. others are mostly
+      // pairs that do not overlap, maps are already merged through the
+      // tracked estimates
+      if (!(previous->confidence >= params.confidence_threshold) ||
+          transformChanged(guess, previous->transform,
+                           params.loop_translation_tolerance,
+                           params.loop_rotation_tolerance)) {
+        // nothing to track
+        pairwise_transforms.push_back(*previous);
+        continue;
+      }
+
+      checkCancelled(context);
+      ScopedTimer timer("trackTransform", "matching");
+      TransformEstimate estimate(i, j);
+      RegistrationResult &registration = estimate.registration;
+      estimate.global_score = previous->global_score;
+      // only the overlap of maps takes part in the registration
+      const float margin = 2.f * float(params.max_correspondence_distance);
+      const PointCloudPtr source =
+          cropToOverlap(features[i].cloud, *features[j].cloud,
+                        guess.inverse(), margin);
+      const PointCloudPtr target =
+          cropToOverlap(features[j].cloud, *features[i].cloud, guess, margin);
+      timer.addCounter("source_points", source->size());
+      timer.addCounter("target_points", target->size());
+      if (source->empty() || target->empty()) {
+        // tracking lost, register from scratch
+        global_pairs.emplace_back(i, j);
+        continue;
+      }
+      registration = refineTransform(
+          source, target, guess, params.inlier_threshold,
+          params.max_correspondence_distance, params.max_iterations,
+          params.transform_epsilon);
+
+      pcl::StopWatch score_timer;
+      registration.score =
+          transformScore(source, target, registration.transform,
+                         params.max_correspondence_distance);
+      registration.scoring_time = score_timer.getTime();
+      timer.addCounter("icp_iterations", registration.icp_iterations);
+
+      // compared with the global registration, tracked scores would let the
+      // error grow with every tracked estimation
+      if (!registration.icp_converged ||
+          registration.score >
+              previous->global_score * params.tracking_score_ratio) {
+        // tracking lost, register from scratch
+        global_pairs.emplace_back(i, j);
+        continue;
+      }
+      estimate.transform = registration.transform;
+      estimate.confidence = 1. / registration.score;
+      pairwise_transforms.push_back(estimate);
+      ++tracked_pairs;
+    }
+  }
+  total_timer.addCounter("reused_pairs", reused_pairs);
+  total_timer.addCounter("tracked_pairs", tracked_pairs);
+  total_timer.addCounter("global_pairs", global_pairs.size());
+
+  /* compute descriptors for global registration */
+
+  std::vector<size_t> global_maps;
+  for (const auto &pair : global_pairs) {
+    global_maps.push_back(pair.first);
+    global_maps.push_back(pair.second);
+  }
+  std::sort(global_maps.begin(), global_maps.end());
+  global_maps.erase(std::unique(global_maps.begin(), global_maps.end()),
+                    global_maps.end());
+  std::vector<size_t> need_descriptors = global_maps;
+  need_descriptors.erase(
+      std::remove_if(need_descriptors.begin(), need_descriptors.end(),
+                     [&features](size_t i) { return features[i].descriptors; }),
+      need_descriptors.end());
+
+  // large maps are processed submap by submap to bound memory
+  if (params.submap_size > 0.) {
+    for (size_t i : need_descriptors) {
+      checkCancelled(context);
+      ScopedTimer timer("computeSubmapFeatures", "features");
+      timer.addCounter("points", features[i].cloud->size());
+      computeSubmapFeatures(features[i], params, context);
+      timer.addCounter("keypoints", features[i].keypoints->size());
+    }
+    need_descriptors.clear();
   }
 
   // compute normals
-  for (const auto &cloud : clouds_resized) {
-    auto cloud_normals = computeSurfaceNormals(cloud, params.normal_radius);
-    normals.emplace_back(std::move(cloud_normals));
+  for (size_t i : need_descriptors) {
+    checkCancelled(context);
+    ScopedTimer timer("computeSurfaceNormals", "features");
+    timer.addCounter("points", features[i].cloud->size());
+    features[i].normals =
+        computeSurfaceNormals(features[i].cloud, params.normal_radius,
+                              params.feature_threads);
   }
 
   // detect keypoints
-  for (size_t i = 0; i < clouds_resized.size(); ++i) {
-    auto cloud_keypoints = detectKeypoints(
-        clouds_resized[i], normals[i], params.keypoint_type,
-        params.keypoint_threshold, params.normal_radius, params.resolution);
-    keypoints.emplace_back(std::move(cloud_keypoints));
+  std::vector<std::vector<float>> keypoint_scales(features.size());
+  for (size_t i : need_descriptors) {
+    checkCancelled(context);
+    ScopedTimer timer("detectKeypoints", "features");
+    features[i].keypoints = detectKeypoints(
+        features[i].cloud, features[i].normals, params.keypoint_type,
+        params.keypoint_threshold, params.normal_radius, params.resolution,
+        params.feature_threads, &keypoint_scales[i]);
+    timer.addCounter("keypoints", features[i].keypoints->size());
   }
 
-  for (size_t i = 0; i < clouds_resized.size(); ++i) {
-    auto cloud_descriptors = computeLocalDescriptors(
-        clouds_resized[i], normals[i], keypoints[i], params.descriptor_type,
-        params.descriptor_radius);
-    descriptors.emplace_back(std::move(cloud_descriptors));
+  for (size_t i : need_descriptors) {
+    checkCancelled(context);
+    ScopedTimer timer("computeLocalDescriptors", "features");
+    if (params.adaptive_descriptor_radius) {
+      features[i].descriptors = computeLocalDescriptors(
+          features[i].cloud, features[i].normals, features[i].keypoints,
+          params.descriptor_type, params.descriptor_radius,
+          params.feature_threads, keypoint_scales[i]);
+    } else {
+      features[i].descriptors = computeLocalDescriptors(
+          features[i].cloud, features[i].normals, features[i].keypoints,
+          params.descriptor_type, params.descriptor_radius,
+          params.feature_threads);
+    }
+    timer.addCounter("descriptors", features[i].keypoints->size());
   }
 
-  /* estimate pairwise transforms */
+  // split maps to submaps registered separately
+  if (params.submap_size > 0.) {
+    for (size_t i : global_maps) {
+      if (!features[i].submaps.empty() || features[i].keypoints->empty()) {
+        continue;
+      }
+      checkCancelled(context);
+      ScopedTimer timer("partitionToSubmaps", "features");
+      features[i].submaps =
+          partitionToSubmaps(features[i].keypoints, features[i].descriptors,
+                             params.submap_size, params.submap_overlap);
+      timer.addCounter("submaps", features[i].submaps.size());
+    }
+  }
 
-  std::vector<TransformEstimate> pairwise_transforms;
-  // generate pairs
-  for (size_t i = 0; i < clouds.size() - 1; ++i) {
-    for (size_t j = i + 1; j < clouds.size(); ++j) {
-      if (keypoints[i]->size() > 0 && keypoints[j]->size() > 0) {
-        pairwise_transforms.emplace_back(i, j);
+  /* estimate pairwise transforms from scratch */
+
+  // pairs already known to be consistent may imply other pairs
+  LoopConsistency loops(clouds.size(), params.loop_translation_tolerance,
+                        params.loop_rotation_tolerance);
+  if (params.prune_implied_pairs) {
+    for (const auto &est : pairwise_transforms) {
+      if (est.confidence >= params.confidence_threshold) {
+        loops.addEstimate(est);
       }
     }
   }
+  // workers register pairs concurrently, so pairs are pruned only by
+  // estimates known before the registration
+  const bool distributed = context.workers && context.workers->size() > 0;
+  std::vector<std::pair<size_t, size_t>> distributed_pairs;
+  size_t pruned_pairs = 0;
+  for (const auto &pair : global_pairs) {
+    const size_t i = pair.first;
+    const size_t j = pair.second;
+    if (features[i].keypoints->empty() || features[j].keypoints->empty()) {
+      continue;
+    }
+    if (params.prune_implied_pairs && loops.isImplied(i, j)) {
+      ++pruned_pairs;
+      continue;
+    }
+    if (distributed) {
+      distributed_pairs.push_back(pair);
+      continue;
+    }
+    checkCancelled(context);
+    ScopedTimer timer("estimateTransform", "matching");
+    TransformEstimate estimate = estimatePairTransform(
+        features[i], features[j], params, context.is_cancelled);
+    estimate.source_idx = i;
+    estimate.target_idx = j;
+    const RegistrationResult &registration = estimate.registration;
+    pairwise_transforms.push_back(estimate);
+    if (params.prune_implied_pairs &&
+        estimate.confidence >= params.confidence_threshold) {
+      loops.addEstimate(estimate);
+    }
 
-  for (auto &estimate : pairwise_transforms) {
-    size_t i = estimate.source_idx;
-    size_t j = estimate.target_idx;
-    estimate.transform = estimateTransform(
-        clouds_resized[i], keypoints[i], descriptors[i], clouds_resized[j],
-        keypoints[j], descriptors[j], params.estimation_method,
-        params.refine_transform, params.inlier_threshold,
-        params.max_correspondence_distance, params.max_iterations,
-        params.matching_k, params.transform_epsilon);
-    estimate.confidence =
-        1. / transformScore(clouds_resized[i], clouds_resized[j],
-                            estimate.transform,
-                            params.max_correspondence_distance);
+    timer.addCounter("correspondences", registration.correspondences);
+    timer.addCounter("inliers", registration.inliers);
+    timer.addCounter("icp_iterations", registration.icp_iterations);
+  }
+  if (!distributed_pairs.empty()) {
+    ScopedTimer timer("registerPairs", "matching");
+    timer.addCounter("pairs", distributed_pairs.size());
+    timer.addCounter("workers", context.workers->size());
+    std::vector<TransformEstimate> estimates = context.workers->registerPairs(
+        features, distributed_pairs, params, context.is_cancelled);
+    pairwise_transforms.insert(pairwise_transforms.end(), estimates.begin(),
+                               estimates.end());
   }
+  total_timer.addCounter("pruned_pairs", pruned_pairs);
 
+  // pinned reference frame takes precedence over the previous one
+  const size_t previous_reference = context.reference_frame;
+  size_t reference_frame = context.pinned_reference_frame;
+  if (reference_frame == EstimationContext::NO_REFERENCE &&
+      params.keep_reference_frame) {
+    reference_frame = previous_reference;
+  }
   std::vector<Eigen::Matrix4f> global_transforms =
-      computeGlobalTransforms(pairwise_transforms, params.confidence_threshold);
+      computeGlobalTransforms(pairwise_transforms, params, reference_frame);
+  context.reference_frame = reference_frame;
+
+  // global transforms may not cover the last clouds that were not merged
+  global_transforms.resize(clouds.size(), Eigen::Matrix4f::Zero());
+
+  // keep previous transforms that did not change significantly
+  size_t changed_transforms = global_transforms.size();
+  if (reference_frame != EstimationContext::NO_REFERENCE &&
+      reference_frame == previous_reference) {
+    const size_t previous_count =
+        std::min(previous_transforms.size(), global_transforms.size());
+    for (size_t i = 0; i < previous_count; ++i) {
+      if (!transformChanged(previous_transforms[i], global_transforms[i],
+                            params.transform_translation_tolerance,
+                            params.transform_rotation_tolerance)) {
+        global_transforms[i] = previous_transforms[i];
+        --changed_transforms;
+      }
+    }
+  }
+  total_timer.addCounter("changed_transforms", changed_transforms);
+  context.transforms = global_transforms;
 
   return global_transforms;
 }
 
+bool transformChanged(const Eigen::Matrix4f &previous,
+                      const Eigen::Matrix4f &current,
+                      double translation_tolerance, double rotation_tolerance)
+{
+  if (previous.isZero() || current.isZero()) {
+    return previous.isZero() != current.isZero();
+  }
+
+  const Eigen::Affine3f delta(previous.inverse() * current);
+  const float translation = delta.translation().norm();
+  const float rotation = Eigen::AngleAxisf(delta.linear()).angle();
+  return translation > translation_tolerance || rotation > rotation_tolerance;
+}
+
 PointCloudPtr composeMaps(const std::vector<PointCloudConstPtr> &clouds,
                           const std::vector<Eigen::Matrix4f> &transforms,
                           double resolution)
@@ -287,6 +1013,8 @@ PointCloudPtr composeMaps(const std::vector<PointCloudConstPtr> &clouds,
                                  "be the same.");
   }
 
+  ScopedTimer timer("composeMaps", "compositing");
+
   PointCloudPtr result(new PointCloud);
   PointCloudPtr cloud_aligned(new PointCloud);
   for (size_t i = 0; i < clouds.size(); ++i) {
@@ -299,9 +1027,180 @@ PointCloudPtr composeMaps(const std::vector<PointCloudConstPtr> &clouds,
   }
 
   // voxelize result cloud to required resolution
+  timer.addCounter("input_points", result->size());
   result = downSample(result, resolution);
+  timer.addCounter("output_points", result->size());
 
   return result;
 }
 
+MapCompositor::MapCompositor(double resolution) : resolution_(resolution)
+{
+  changed_region_.setEmpty();
+  cleared_region_.setEmpty();
+}
+
+PointCloudPtr
+MapCompositor::compose(const std::vector<PointCloudConstPtr> &clouds,
+                       const std::vector<Eigen::Matrix4f> &transforms)
+{
+  std::vector<MapChunks> maps;
+  maps.reserve(clouds.size());
+  for (const auto &cloud : clouds) {
+    maps.push_back({cloud});
+  }
+  return compose(maps, transforms);
+}
+
+/* whether prefix is prefix of chunks */
+static inline bool isPrefix(const MapCompositor::MapChunks &prefix,
+                            const MapCompositor::MapChunks &chunks)
+{
+  return prefix.size() <= chunks.size() &&
+         std::equal(prefix.begin(), prefix.end(), chunks.begin());
+}
+
+/* adds points to the contribution and to the sum of all contributions. voxels
+ * are aligned with the origin the same way as in pcl::VoxelGrid */
+void MapCompositor::addPoints(Contribution &contribution,
+                              const PointCloud &points)
+{
+  const float inverse_resolution = 1.f / float(resolution_);
+  for (const auto &point : points) {
+    if (!pcl::isFinite(point)) {
+      continue;
+    }
+    const VoxelKey key = {int(std::floor(point.x * inverse_resolution)),
+                          int(std::floor(point.y * inverse_resolution)),
+                          int(std::floor(point.z * inverse_resolution))};
+    const Eigen::Vector3d position = point.getVector3fMap().cast<double>();
+    const Eigen::Vector4d colour(point.r, point.g, point.b, point.a);
+    for (Voxel *voxel : {&contribution.voxels[key], &voxels_[key]}) {
+      voxel->position += position;
+      voxel->colour += colour;
+      ++voxel->count;
+    }
+    contribution.bounds.extend(point.getVector3fMap());
+  }
+}
+
+/* subtracts the contribution from the sum of all contributions */
+void MapCompositor::removeContribution(Contribution &contribution)
+{
+  for (const auto &contribution_voxel : contribution.voxels) {
+    auto voxel = voxels_.find(contribution_voxel.first);
+    if (voxel == voxels_.end()) {
+      continue;
+    }
+    if (voxel->second.count <= contribution_voxel.second.count) {
+      voxels_.erase(voxel);
+      continue;
+    }
+    voxel->second.position -= contribution_voxel.second.position;
+    voxel->second.colour -= contribution_voxel.second.colour;
+    voxel->second.count -= contribution_voxel.second.count;
+  }
+  changed_region_.extend(contribution.bounds);
+  contribution = Contribution();
+}
+
+PointCloudPtr
+MapCompositor::compose(const std::vector<MapChunks> &maps,
+                       const std::vector<Eigen::Matrix4f> &transforms)
+{
+  if (maps.empty()) {
+    return nullptr;
+  }
+
+  if (maps.size() != transforms.size()) {
+    throw std::runtime_error("MapCompositor: maps and transforms size must "
+                             "be the same.");
+  }
+
+  ScopedTimer timer("composeMaps", "compositing");
+
+  // region covers removed and added points of contributions
+  changed_region_ = cleared_region_;
+  cleared_region_.setEmpty();
+  for (size_t i = maps.size(); i < contributions_.size(); ++i) {
+    removeContribution(contributions_[i]);
+  }
+  contributions_.resize(maps.size());
+  PointCloudPtr cloud_aligned(new PointCloud);
+  size_t processed_points = 0;
+  for (size_t i = 0; i < maps.size(); ++i) {
+    Contribution &contribution = contributions_[i];
+    if (transforms[i].isZero()) {
+      removeContribution(contribution);
+      continue;
+    }
+
+    if (transforms[i] != contribution.transform ||
+        !isPrefix(contribution.chunks, maps[i])) {
+      // start from scratch
+      removeContribution(contribution);
+      contribution.transform = transforms[i];
+    }
+
+    // process only new chunks
+    const size_t processed_chunks = contribution.chunks.size();
+    if (processed_chunks == maps[i].size()) {
+      continue;
+    }
+    const Eigen::AlignedBox3f bounds = contribution.bounds;
+    contribution.bounds.setEmpty();
+    for (size_t j = processed_chunks; j < maps[i].size(); ++j) {
+      if (!maps[i][j]) {
+        continue;
+      }
+      pcl::transformPointCloud(*maps[i][j], *cloud_aligned, transforms[i]);
+      addPoints(contribution, *cloud_aligned);
+      processed_points += maps[i][j]->size();
+    }
+    changed_region_.extend(contribution.bounds);
+    contribution.bounds.extend(bounds);
+    contribution.chunks = maps[i];
+  }
+  timer.addCounter("processed_points", processed_points);
+
+  if (result_ && changed_region_.isEmpty()) {
+    return result_;
+  }
+
+  // centroids of voxels, the same as voxelizing all points together
+  result_.reset(new PointCloud);
+  result_->reserve(voxels_.size());
+  for (const auto &voxel : voxels_) {
+    const double count = double(voxel.second.count);
+    PointT point;
+    point.getVector3fMap() = (voxel.second.position / count).cast<float>();
+    const Eigen::Vector4d colour = voxel.second.colour / count;
+    point.r = uint8_t(colour[0]);
+    point.g = uint8_t(colour[1]);
+    point.b = uint8_t(colour[2]);
+    point.a = uint8_t(colour[3]);
+    result_->push_back(point);
+  }
+  timer.addCounter("output_points", result_->size());
+  // changed points move centroids of voxels they fall into
+  if (!changed_region_.isEmpty()) {
+    const Eigen::Vector3f padding =
+        Eigen::Vector3f::Constant(float(resolution_));
+    changed_region_.min() -= padding;
+    changed_region_.max() += padding;
+  }
+
+  return result_;
+}
+
+void MapCompositor::clear()
+{
+  for (const auto &contribution : contributions_) {
+    cleared_region_.extend(contribution.bounds);
+  }
+  contributions_.clear();
+  voxels_.clear();
+  result_.reset();
+}
+
 }  // namespace map_merge_3d
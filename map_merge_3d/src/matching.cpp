@@ -1,6 +1,7 @@
 #include <map_merge_3d/matching.h>
 #include "dispatch_descriptors.h"
 
+#include <pcl/common/time.h>
 #include <pcl/conversions.h>
 #include <pcl/registration/correspondence_rejection_sample_consensus.h>
 #include <pcl/registration/ia_ransac.h>
@@ -193,15 +194,24 @@ Eigen::Matrix4f estimateTransformFromDescriptorsSets(
   return dispatchForEachDescriptor(name, functor);
 }
 
-Eigen::Matrix4f estimateTransformICP(const PointCloudPtr &source_points,
-                                     const PointCloudPtr &target_points,
-                                     const Eigen::Matrix4f &initial_guess,
-                                     double max_correspondence_distance,
-                                     double outlier_rejection_threshold,
-                                     int max_iterations,
-                                     double transformation_epsilon)
+/* ICP exposing number of performed iterations, which is protected in PCL */
+class IterativeClosestPointWithStats
+    : public pcl::IterativeClosestPoint<PointT, PointT>
+{
+public:
+  int getIterations() const
+  {
+    return nr_iterations_;
+  }
+};
+
+static Eigen::Matrix4f estimateTransformICP(
+    const PointCloudPtr &source_points, const PointCloudPtr &target_points,
+    const Eigen::Matrix4f &initial_guess, double max_correspondence_distance,
+    double outlier_rejection_threshold, int max_iterations,
+    double transformation_epsilon, RegistrationResult &stats)
 {
-  pcl::IterativeClosestPoint<PointT, PointT> icp;
+  IterativeClosestPointWithStats icp;
   icp.setMaxCorrespondenceDistance(max_correspondence_distance);
   icp.setRANSACOutlierRejectionThreshold(outlier_rejection_threshold);
   icp.setTransformationEpsilon(transformation_epsilon);
@@ -217,10 +227,28 @@ Eigen::Matrix4f estimateTransformICP(const PointCloudPtr &source_points,
   PointCloud registration_output;
   icp.align(registration_output);
 
+  stats.icp_iterations = icp.getIterations();
+  stats.icp_converged = icp.hasConverged();
+
   return icp.getFinalTransformation() * initial_guess;
 }
 
-Eigen::Matrix4f estimateTransform(
+Eigen::Matrix4f estimateTransformICP(const PointCloudPtr &source_points,
+                                     const PointCloudPtr &target_points,
+                                     const Eigen::Matrix4f &initial_guess,
+                                     double max_correspondence_distance,
+                                     double outlier_rejection_threshold,
+                                     int max_iterations,
+                                     double transformation_epsilon)
+{
+  RegistrationResult stats;
+  return estimateTransformICP(source_points, target_points, initial_guess,
+                              max_correspondence_distance,
+                              outlier_rejection_threshold, max_iterations,
+                              transformation_epsilon, stats);
+}
+
+RegistrationResult estimateTransform(
     const PointCloudPtr &source_points, const PointCloudPtr &source_keypoints,
     const LocalDescriptorsPtr &source_descriptors,
     const PointCloudPtr &target_points, const PointCloudPtr &target_keypoints,
@@ -228,32 +256,61 @@ Eigen::Matrix4f estimateTransform(
     bool refine, double inlier_threshold, double max_correspondence_distance,
     int max_iterations, size_t matching_k, double transform_epsilon)
 {
-  Eigen::Matrix4f transform;
+  RegistrationResult result;
+  pcl::StopWatch timer;
 
   switch (method) {
     case EstimationMethod::MATCHING: {
       CorrespondencesPtr inliers;
       CorrespondencesPtr correspondences = findFeatureCorrespondences(
           source_descriptors, target_descriptors, matching_k);
-      transform = estimateTransformFromCorrespondences(
+      result.correspondences = correspondences->size();
+      result.matching_time = timer.getTime();
+      timer.reset();
+
+      result.transform = estimateTransformFromCorrespondences(
           source_keypoints, target_keypoints, correspondences, inliers,
           inlier_threshold);
+      result.inliers = inliers->size();
+      result.initial_alignment_time = timer.getTime();
     } break;
     case EstimationMethod::SAC_IA: {
-      transform = estimateTransformFromDescriptorsSets(
+      result.transform = estimateTransformFromDescriptorsSets(
           source_keypoints, source_descriptors, target_keypoints,
           target_descriptors, inlier_threshold, max_correspondence_distance,
           max_iterations);
+      result.initial_alignment_time = timer.getTime();
     } break;
   }
 
   if (refine) {
-    transform = estimateTransformICP(
-        source_points, target_points, transform, max_correspondence_distance,
-        inlier_threshold, max_iterations, transform_epsilon);
+    timer.reset();
+    result.transform = estimateTransformICP(
+        source_points, target_points, result.transform,
+        max_correspondence_distance, inlier_threshold, max_iterations,
+        transform_epsilon, result);
+    result.refinement_time = timer.getTime();
   }
 
-  return transform;
+  return result;
+}
+
+RegistrationResult refineTransform(const PointCloudPtr &source_points,
+                                   const PointCloudPtr &target_points,
+                                   const Eigen::Matrix4f &initial_guess,
+                                   double inlier_threshold,
+                                   double max_correspondence_distance,
+                                   int max_iterations,
+                                   double transform_epsilon)
+{
+  RegistrationResult result;
+  pcl::StopWatch timer;
+  result.transform = estimateTransformICP(
+      source_points, target_points, initial_guess, max_correspondence_distance,
+      inlier_threshold, max_iterations, transform_epsilon, result);
+  result.refinement_time = timer.getTime();
+
+  return result;
 }
 
 double transformScore(const PointCloudPtr &source_points,
@@ -267,4 +324,22 @@ double transformScore(const PointCloudPtr &source_points,
                                           transform);
 }
 
+std::ostream &operator<<(std::ostream &stream,
+                         const RegistrationResult &result)
+{
+  stream << "correspondences: " << result.correspondences << std::endl;
+  stream << "inliers: " << result.inliers << std::endl;
+  stream << "icp_iterations: " << result.icp_iterations << std::endl;
+  stream << "icp_converged: " << result.icp_converged << std::endl;
+  stream << "score: " << result.score << std::endl;
+  stream << "matching_time: " << result.matching_time << " ms" << std::endl;
+  stream << "initial_alignment_time: " << result.initial_alignment_time
+         << " ms" << std::endl;
+  stream << "refinement_time: " << result.refinement_time << " ms"
+         << std::endl;
+  stream << "scoring_time: " << result.scoring_time << " ms" << std::endl;
+
+  return stream;
+}
+
 }  // namespace map_merge_3d
@@ -0,0 +1,83 @@
+#include <map_merge_3d/features.h>
+#include <map_merge_3d/multi_resolution_map.h>
+
+#include <cmath>
+#include <stdexcept>
+
+namespace map_merge_3d
+{
+MultiResolutionMap::MultiResolutionMap(double resolution, size_t levels)
+  : resolution_(resolution)
+{
+  if (!(resolution > 0.) || levels == 0) {
+    throw std::invalid_argument("MultiResolutionMap: resolution must be "
+                                "positive and levels at least 1");
+  }
+  levels_.resize(levels);
+  for (auto &level : levels_) {
+    level.points.reset(new PointCloud);
+  }
+}
+
+double MultiResolutionMap::resolution(size_t level) const
+{
+  return std::ldexp(resolution_, int(level));
+}
+
+size_t MultiResolutionMap::levelForResolution(double resolution) const
+{
+  for (size_t i = 0; i < levels_.size(); ++i) {
+    if (this->resolution(i) >= resolution) {
+      return i;
+    }
+  }
+  return levels_.size() - 1;
+}
+
+void MultiResolutionMap::update(const PointCloudPtr &map)
+{
+  levels_[0].points = map;
+  levels_[0].octree = nullptr;
+  // each level is computed from the previous level, which is much smaller
+  // than the input
+  for (size_t i = 1; i < levels_.size(); ++i) {
+    levels_[i].points = downSample(levels_[i - 1].points, resolution(i));
+    levels_[i].points->header = map->header;
+    levels_[i].octree = nullptr;
+  }
+}
+
+PointCloudConstPtr MultiResolutionMap::level(size_t level) const
+{
+  return levels_.at(level).points;
+}
+
+PointCloudPtr MultiResolutionMap::radiusSearch(const Eigen::Vector3f &center,
+                                               double radius, size_t level)
+{
+  Level &l = levels_.at(level);
+  PointCloudPtr result(new PointCloud);
+  result->header = l.points->header;
+  if (l.points->empty()) {
+    return result;
+  }
+
+  if (!l.octree) {
+    l.octree.reset(new Octree(resolution(level)));
+    l.octree->setInputCloud(l.points);
+    l.octree->addPointsFromInputCloud();
+  }
+
+  PointT query;
+  query.getVector3fMap() = center;
+  std::vector<int> indices;
+  std::vector<float> distances;
+  l.octree->radiusSearch(query, radius, indices, distances);
+  result->reserve(indices.size());
+  for (int index : indices) {
+    result->push_back((*l.points)[size_t(index)]);
+  }
+  return result;
+}
+
+}  // namespace map_merge_3d
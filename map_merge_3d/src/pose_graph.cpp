@@ -0,0 +1,262 @@
+#include "pose_graph.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <Eigen/Geometry>
+#include <Eigen/SparseCholesky>
+#include <Eigen/StdVector>
+
+typedef Eigen::Matrix<double, 6, 1> Vector6d;
+typedef Eigen::Matrix<double, 6, 6> Matrix6d;
+typedef std::vector<Eigen::Isometry3d,
+                    Eigen::aligned_allocator<Eigen::Isometry3d>>
+    Poses;
+
+namespace
+{
+struct PoseGraphEdge {
+  size_t source;
+  size_t target;
+  // inverse of the measured transform source -> target
+  Eigen::Isometry3d measurement_inverse;
+  // relative confidence of the measurement
+  double weight;
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+typedef std::vector<PoseGraphEdge, Eigen::aligned_allocator<PoseGraphEdge>>
+    PoseGraphEdges;
+}  // namespace
+
+/* pose perturbed in its local frame by (rotation vector, translation) */
+static inline Eigen::Isometry3d retract(const Eigen::Isometry3d &pose,
+                                        const Vector6d &delta)
+{
+  Eigen::Isometry3d increment = Eigen::Isometry3d::Identity();
+  const Eigen::Vector3d rotation = delta.head<3>();
+  const double angle = rotation.norm();
+  if (angle > 0.) {
+    increment.linear() =
+        Eigen::AngleAxisd(angle, rotation / angle).toRotationMatrix();
+  }
+  increment.translation() = delta.tail<3>();
+  return pose * increment;
+}
+
+/* zero if poses agree with the measurement */
+static inline Vector6d edgeError(const PoseGraphEdge &edge,
+                                 const Eigen::Isometry3d &source,
+                                 const Eigen::Isometry3d &target)
+{
+  const Eigen::Isometry3d error =
+      edge.measurement_inverse * target.inverse() * source;
+  const Eigen::AngleAxisd rotation(error.linear());
+  Vector6d result;
+  result.head<3>() = rotation.angle() * rotation.axis();
+  result.tail<3>() = error.translation();
+  return result;
+}
+
+/* Huber kernel */
+static inline double robustCost(double residual, double width)
+{
+  if (residual <= width) {
+    return 0.5 * residual * residual;
+  }
+  return width * (residual - 0.5 * width);
+}
+
+static inline double robustWeight(double residual, double width)
+{
+  return residual <= width ? 1. : width / residual;
+}
+
+static double totalCost(const PoseGraphEdges &edges,
+                        const Poses &poses,
+                        double kernel_width)
+{
+  double cost = 0.;
+  for (const auto &edge : edges) {
+    const double residual =
+        edgeError(edge, poses[edge.source], poses[edge.target]).norm();
+    cost += edge.weight * robustCost(residual, kernel_width);
+  }
+  return cost;
+}
+
+size_t
+optimizePoseGraph(const std::vector<TransformEstimate> &pairwise_estimates,
+                  std::vector<Eigen::Matrix4f> &global_transforms,
+                  size_t reference, int max_iterations, double kernel_width)
+{
+  const size_t nodes_count = global_transforms.size();
+  if (reference >= nodes_count || global_transforms[reference].isZero()) {
+    return 0;
+  }
+
+  // each valid map except the reference has 6 variables
+  Poses poses(nodes_count, Eigen::Isometry3d::Identity());
+  std::vector<int> variables(nodes_count, -1);
+  int variables_count = 0;
+  for (size_t i = 0; i < nodes_count; ++i) {
+    if (global_transforms[i].isZero()) {
+      continue;
+    }
+    poses[i] = Eigen::Isometry3d(global_transforms[i].cast<double>());
+    if (i != reference) {
+      variables[i] = variables_count++;
+    }
+  }
+
+  // confidences are relative to the most confident estimate
+  double max_confidence = 0.;
+  for (const auto &est : pairwise_estimates) {
+    max_confidence = std::max(max_confidence, est.confidence);
+  }
+
+  PoseGraphEdges edges;
+  for (const auto &est : pairwise_estimates) {
+    if (est.source_idx >= nodes_count || est.target_idx >= nodes_count ||
+        est.source_idx == est.target_idx ||
+        global_transforms[est.source_idx].isZero() ||
+        global_transforms[est.target_idx].isZero() || est.transform.isZero() ||
+        !est.transform.allFinite()) {
+      continue;
+    }
+    PoseGraphEdge edge;
+    edge.source = est.source_idx;
+    edge.target = est.target_idx;
+    edge.measurement_inverse =
+        Eigen::Isometry3d(est.transform.cast<double>()).inverse();
+    edge.weight =
+        max_confidence > 0. ? std::max(est.confidence, 0.) / max_confidence
+                            : 1.;
+    if (edge.weight <= 0.) {
+      continue;
+    }
+    edges.push_back(edge);
+  }
+  if (variables_count == 0 || edges.empty()) {
+    return 0;
+  }
+
+  const int dimension = 6 * variables_count;
+  Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>> solver;
+  bool pattern_analyzed = false;
+  double lambda = 1e-4;
+  double cost = totalCost(edges, poses, kernel_width);
+
+  int iteration = 0;
+  for (; iteration < max_iterations; ++iteration) {
+    /* linearize around current poses */
+    std::vector<Eigen::Triplet<double>> triplets;
+    triplets.reserve(size_t(dimension) + 4 * 36 * edges.size());
+    // keep the whole diagonal in the pattern for damping
+    for (int k = 0; k < dimension; ++k) {
+      triplets.emplace_back(k, k, 0.);
+    }
+    Eigen::VectorXd gradient = Eigen::VectorXd::Zero(dimension);
+    const double step = 1e-6;
+    for (const auto &edge : edges) {
+      const Eigen::Isometry3d &source = poses[edge.source];
+      const Eigen::Isometry3d &target = poses[edge.target];
+      const Vector6d error = edgeError(edge, source, target);
+      const double weight =
+          edge.weight * robustWeight(error.norm(), kernel_width);
+
+      // numerical jacobians w.r.t. local perturbations
+      Matrix6d jacobian_source;
+      Matrix6d jacobian_target;
+      for (int k = 0; k < 6; ++k) {
+        Vector6d delta = Vector6d::Zero();
+        delta[k] = step;
+        jacobian_source.col(k) =
+            (edgeError(edge, retract(source, delta), target) -
+             edgeError(edge, retract(source, -delta), target)) /
+            (2. * step);
+        jacobian_target.col(k) =
+            (edgeError(edge, source, retract(target, delta)) -
+             edgeError(edge, source, retract(target, -delta))) /
+            (2. * step);
+      }
+
+      const int blocks[2] = {variables[edge.source], variables[edge.target]};
+      const Matrix6d *jacobians[2] = {&jacobian_source, &jacobian_target};
+      for (int a = 0; a < 2; ++a) {
+        if (blocks[a] < 0) {
+          continue;
+        }
+        gradient.segment<6>(6 * blocks[a]) +=
+            weight * jacobians[a]->transpose() * error;
+        for (int b = 0; b < 2; ++b) {
+          if (blocks[b] < 0) {
+            continue;
+          }
+          const Matrix6d block =
+              weight * jacobians[a]->transpose() * *jacobians[b];
+          for (int r = 0; r < 6; ++r) {
+            for (int c = 0; c < 6; ++c) {
+              triplets.emplace_back(6 * blocks[a] + r, 6 * blocks[b] + c,
+                                    block(r, c));
+            }
+          }
+        }
+      }
+    }
+    Eigen::SparseMatrix<double> hessian(dimension, dimension);
+    hessian.setFromTriplets(triplets.begin(), triplets.end());
+    if (!pattern_analyzed) {
+      // the structure is the same in all iterations
+      solver.analyzePattern(hessian);
+      pattern_analyzed = true;
+    }
+
+    /* find damping that decreases the cost */
+    const double previous_cost = cost;
+    bool improved = false;
+    Eigen::VectorXd delta;
+    for (int attempt = 0; attempt < 10 && !improved; ++attempt) {
+      Eigen::SparseMatrix<double> damped = hessian;
+      for (int k = 0; k < dimension; ++k) {
+        damped.coeffRef(k, k) += lambda;
+      }
+      solver.factorize(damped);
+      if (solver.info() != Eigen::Success) {
+        lambda *= 10.;
+        continue;
+      }
+      delta = solver.solve(-gradient);
+
+      Poses updated = poses;
+      for (size_t i = 0; i < nodes_count; ++i) {
+        if (variables[i] >= 0) {
+          updated[i] = retract(poses[i], delta.segment<6>(6 * variables[i]));
+        }
+      }
+      const double updated_cost = totalCost(edges, updated, kernel_width);
+      if (updated_cost < cost) {
+        poses = std::move(updated);
+        cost = updated_cost;
+        lambda = std::max(lambda / 10., 1e-12);
+        improved = true;
+      } else {
+        lambda *= 10.;
+      }
+    }
+
+    // converged
+    if (!improved || previous_cost - cost <= 1e-6 * previous_cost) {
+      ++iteration;
+      break;
+    }
+  }
+
+  for (size_t i = 0; i < nodes_count; ++i) {
+    if (variables[i] >= 0) {
+      global_transforms[i] = poses[i].matrix().cast<float>();
+    }
+  }
+
+  return size_t(iteration);
+}
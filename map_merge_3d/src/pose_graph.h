@@ -0,0 +1,42 @@
+#ifndef MAP_MERGE_POSE_GRAPH_H_
+#define MAP_MERGE_POSE_GRAPH_H_
+
+#include <vector>
+
+#include <Eigen/Core>
+
+#include <map_merge_3d/matching.h>
+
+using std::size_t;
+using map_merge_3d::TransformEstimate;
+
+/**
+ * @brief Optimizes global transforms over all pairwise estimates
+ * @details Levenberg-Marquardt over SE(3) poses of the maps. Each pairwise
+ * estimate is a relative pose measurement between its source and target, so
+ * redundant estimates spread the error evenly instead of accumulating it along
+ * chains. Residuals are weighted by confidence of estimates relative to the
+ * most confident one, estimates with zero confidence are ignored. Huber kernel
+ * limits influence of wrong estimates. Normal equations
+ * are solved by sparse Cholesky decomposition, which follows the structure of
+ * the graph.
+ *
+ * @param pairwise_estimates relative measurements, the same as for
+ * findMaxSpanningTree. Estimates between maps without valid initial transform
+ * are ignored.
+ * @param global_transforms initial transforms maps -> reference frame, e.g.
+ * chained along the spanning tree. Optimized in place, zero matrices are left
+ * untouched.
+ * @param reference index of the reference frame, its transform is fixed
+ * @param max_iterations maximum number of iterations
+ * @param kernel_width residuals larger than this are considered outliers by
+ * the robust kernel
+ *
+ * @return number of performed iterations
+ */
+size_t
+optimizePoseGraph(const std::vector<TransformEstimate>& pairwise_estimates,
+                  std::vector<Eigen::Matrix4f>& global_transforms,
+                  size_t reference, int max_iterations, double kernel_width);
+
+#endif  // MAP_MERGE_POSE_GRAPH_H_
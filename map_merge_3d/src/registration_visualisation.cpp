@@ -61,9 +61,11 @@ int main(int argc, char **argv)
   {
     pcl::ScopeTime t("removing outliers");
     cloud1 = removeOutliers(cloud1, params.descriptor_radius,
-                            params.outliers_min_neighbours);
+                            params.outliers_min_neighbours,
+                            params.outliers_filter);
     cloud2 = removeOutliers(cloud2, params.descriptor_radius,
-                            params.outliers_min_neighbours);
+                            params.outliers_min_neighbours,
+                            params.outliers_filter);
   }
   std::cout << "remaining points: " << cloud1->size() << ", " << cloud2->size()
             << std::endl;
@@ -75,21 +77,26 @@ int main(int argc, char **argv)
   SurfaceNormalsPtr normals1, normals2;
   {
     pcl::ScopeTime t("normals computation");
-    normals1 = computeSurfaceNormals(cloud1, params.normal_radius);
-    normals2 = computeSurfaceNormals(cloud2, params.normal_radius);
+    normals1 = computeSurfaceNormals(cloud1, params.normal_radius,
+                                     params.feature_threads);
+    normals2 = computeSurfaceNormals(cloud2, params.normal_radius,
+                                     params.feature_threads);
   }
 
   /* detect keypoints */
   pcl::console::print_highlight("Detecting keypoints.\n");
   PointCloudPtr keypoints1, keypoints2;
+  std::vector<float> scales1, scales2;
   {
     pcl::ScopeTime t("keypoints detection");
-    keypoints1 = detectKeypoints(cloud1, normals1, params.keypoint_type,
-                                 params.keypoint_threshold,
-                                 params.normal_radius, params.resolution);
-    keypoints2 = detectKeypoints(cloud2, normals2, params.keypoint_type,
-                                 params.keypoint_threshold,
-                                 params.normal_radius, params.resolution);
+    keypoints1 = detectKeypoints(
+        cloud1, normals1, params.keypoint_type, params.keypoint_threshold,
+        params.normal_radius, params.resolution, params.feature_threads,
+        &scales1);
+    keypoints2 = detectKeypoints(
+        cloud2, normals2, params.keypoint_type, params.keypoint_threshold,
+        params.normal_radius, params.resolution, params.feature_threads,
+        &scales2);
   }
   std::cout << "keypoints count: " << keypoints1->size() << ", "
             << keypoints2->size() << std::endl;
@@ -99,12 +106,23 @@ int main(int argc, char **argv)
   LocalDescriptorsPtr descriptors1, descriptors2;
   {
     pcl::ScopeTime t("descriptors computation");
-    descriptors1 = computeLocalDescriptors(cloud1, normals1, keypoints1,
-                                           params.descriptor_type,
-                                           params.descriptor_radius);
-    descriptors2 = computeLocalDescriptors(cloud2, normals2, keypoints2,
-                                           params.descriptor_type,
-                                           params.descriptor_radius);
+    if (params.adaptive_descriptor_radius) {
+      descriptors1 = computeLocalDescriptors(
+          cloud1, normals1, keypoints1, params.descriptor_type,
+          params.descriptor_radius, params.feature_threads, scales1);
+      descriptors2 = computeLocalDescriptors(
+          cloud2, normals2, keypoints2, params.descriptor_type,
+          params.descriptor_radius, params.feature_threads, scales2);
+    } else {
+      descriptors1 = computeLocalDescriptors(cloud1, normals1, keypoints1,
+                                             params.descriptor_type,
+                                             params.descriptor_radius,
+                                             params.feature_threads);
+      descriptors2 = computeLocalDescriptors(cloud2, normals2, keypoints2,
+                                             params.descriptor_type,
+                                             params.descriptor_radius,
+                                             params.feature_threads);
+    }
   }
 
   std::cout << "extracted descriptors:" << std::endl;
@@ -0,0 +1,107 @@
+#include "serialization.h"
+
+namespace map_merge_3d
+{
+void writeDescriptors(Writer &writer, const LocalDescriptors *descriptors)
+{
+  writer.pod<uint8_t>(descriptors != nullptr);
+  if (!descriptors) {
+    writer.align();
+    return;
+  }
+  writer.pod<uint8_t>(descriptors->is_bigendian);
+  writer.pod<uint8_t>(descriptors->is_dense);
+  writer.align();
+  writer.pod<uint32_t>(descriptors->height);
+  writer.pod<uint32_t>(descriptors->width);
+  writer.pod<uint32_t>(descriptors->point_step);
+  writer.pod<uint32_t>(descriptors->row_step);
+  writer.pod<uint64_t>(descriptors->fields.size());
+  for (const auto &field : descriptors->fields) {
+    writer.pod<uint32_t>(field.offset);
+    writer.pod<uint32_t>(field.count);
+    writer.pod<uint32_t>(field.datatype);
+    writer.pod<uint32_t>(field.name.size());
+    writer.bytes(field.name.data(), field.name.size());
+    writer.align();
+  }
+  writer.pod<uint64_t>(descriptors->data.size());
+  writer.bytes(descriptors->data.data(), descriptors->data.size());
+  writer.align();
+}
+
+LocalDescriptorsPtr readDescriptors(Reader &reader)
+{
+  LocalDescriptorsPtr descriptors;
+  const bool present = reader.pod<uint8_t>();
+  if (!present) {
+    reader.align();
+    return descriptors;
+  }
+  descriptors.reset(new LocalDescriptors);
+  descriptors->is_bigendian = reader.pod<uint8_t>();
+  descriptors->is_dense = reader.pod<uint8_t>();
+  reader.align();
+  descriptors->height = reader.pod<uint32_t>();
+  descriptors->width = reader.pod<uint32_t>();
+  descriptors->point_step = reader.pod<uint32_t>();
+  descriptors->row_step = reader.pod<uint32_t>();
+  const uint64_t fields = reader.pod<uint64_t>();
+  for (uint64_t i = 0; i < fields; ++i) {
+    pcl::PCLPointField field;
+    field.offset = reader.pod<uint32_t>();
+    field.count = reader.pod<uint32_t>();
+    field.datatype = uint8_t(reader.pod<uint32_t>());
+    const uint32_t name_size = reader.pod<uint32_t>();
+    field.name.assign(reader.bytes(name_size), name_size);
+    reader.align();
+    descriptors->fields.push_back(std::move(field));
+  }
+  const uint64_t size = reader.pod<uint64_t>();
+  const char *data = reader.bytes(size);
+  descriptors->data.assign(data, data + size);
+  reader.align();
+  return descriptors;
+}
+
+void writeEstimate(Writer &writer, uint64_t source_hash, uint64_t target_hash,
+                   const TransformEstimate &estimate)
+{
+  const RegistrationResult &registration = estimate.registration;
+  writer.pod<uint64_t>(source_hash);
+  writer.pod<uint64_t>(target_hash);
+  writer.bytes(estimate.transform.data(), 16 * sizeof(float));
+  writer.pod<double>(estimate.confidence);
+  writer.bytes(registration.transform.data(), 16 * sizeof(float));
+  writer.pod<uint64_t>(registration.correspondences);
+  writer.pod<uint64_t>(registration.inliers);
+  writer.pod<double>(registration.score);
+  writer.pod<double>(estimate.global_score);
+  writer.pod<int32_t>(registration.icp_iterations);
+  writer.pod<uint8_t>(registration.icp_converged);
+  writer.align();
+}
+
+TransformEstimate readEstimate(Reader &reader, uint64_t &source_hash,
+                               uint64_t &target_hash)
+{
+  TransformEstimate estimate;
+  RegistrationResult &registration = estimate.registration;
+  source_hash = reader.pod<uint64_t>();
+  target_hash = reader.pod<uint64_t>();
+  std::memcpy(estimate.transform.data(), reader.bytes(16 * sizeof(float)),
+              16 * sizeof(float));
+  estimate.confidence = reader.pod<double>();
+  std::memcpy(registration.transform.data(), reader.bytes(16 * sizeof(float)),
+              16 * sizeof(float));
+  registration.correspondences = reader.pod<uint64_t>();
+  registration.inliers = reader.pod<uint64_t>();
+  registration.score = reader.pod<double>();
+  estimate.global_score = reader.pod<double>();
+  registration.icp_iterations = reader.pod<int32_t>();
+  registration.icp_converged = reader.pod<uint8_t>();
+  reader.align();
+  return estimate;
+}
+
+}  // namespace map_merge_3d
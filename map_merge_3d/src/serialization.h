@@ -0,0 +1,164 @@
+#ifndef MAP_MERGE_SERIALIZATION_H_
+#define MAP_MERGE_SERIALIZATION_H_
+
+/*
+Binary serialization of features and estimates shared by the state file and
+the protocol of registration workers. Data are written in the native byte
+order, all records are 8-byte aligned.
+*/
+
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+
+#include <map_merge_3d/matching.h>
+#include <map_merge_3d/typedefs.h>
+
+namespace map_merge_3d
+{
+// all records start at multiples of this
+static const size_t ALIGNMENT = 8;
+
+class Writer
+{
+public:
+  explicit Writer(std::ostream& out) : out_(out), position_(0)
+  {
+  }
+
+  template <typename T>
+  void pod(const T& value)
+  {
+    bytes(&value, sizeof(T));
+  }
+
+  void bytes(const void* data, size_t size)
+  {
+    out_.write(static_cast<const char*>(data), std::streamsize(size));
+    position_ += size;
+  }
+
+  void align()
+  {
+    static const char zeros[ALIGNMENT] = {};
+    bytes(zeros, (ALIGNMENT - position_ % ALIGNMENT) % ALIGNMENT);
+  }
+
+  /* overwrites already written value */
+  void patch(size_t position, uint64_t value)
+  {
+    out_.seekp(std::streamoff(position));
+    out_.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    out_.seekp(0, std::ios::end);
+  }
+
+  size_t position() const
+  {
+    return position_;
+  }
+
+private:
+  std::ostream& out_;
+  size_t position_;
+};
+
+class Reader
+{
+public:
+  Reader(const char* data, size_t size, size_t position = 0)
+    : data_(data), size_(size), position_(position)
+  {
+  }
+
+  template <typename T>
+  T pod()
+  {
+    T value;
+    std::memcpy(&value, bytes(sizeof(T)), sizeof(T));
+    return value;
+  }
+
+  const char* bytes(size_t size)
+  {
+    if (position_ > size_ || size > size_ - position_) {
+      throw std::runtime_error("serialized data are truncated");
+    }
+    const char* result = data_ + position_;
+    position_ += size;
+    return result;
+  }
+
+  void align()
+  {
+    bytes((ALIGNMENT - position_ % ALIGNMENT) % ALIGNMENT);
+  }
+
+  size_t position() const
+  {
+    return position_;
+  }
+
+private:
+  const char* data_;
+  size_t size_;
+  size_t position_;
+};
+
+/* points are stored as raw memory, point size is checked by the user */
+template <typename PointType>
+void writeCloud(Writer& writer, const pcl::PointCloud<PointType>* cloud)
+{
+  writer.pod<uint8_t>(cloud != nullptr);
+  if (!cloud) {
+    writer.align();
+    return;
+  }
+  writer.pod<uint8_t>(cloud->is_dense);
+  writer.align();
+  writer.pod<uint32_t>(cloud->width);
+  writer.pod<uint32_t>(cloud->height);
+  writer.pod<uint64_t>(cloud->size());
+  writer.bytes(cloud->points.data(), cloud->size() * sizeof(PointType));
+  writer.align();
+}
+
+template <typename PointType>
+typename pcl::PointCloud<PointType>::Ptr readCloud(Reader& reader)
+{
+  typename pcl::PointCloud<PointType>::Ptr cloud;
+  const bool present = reader.pod<uint8_t>();
+  if (!present) {
+    reader.align();
+    return cloud;
+  }
+  cloud.reset(new pcl::PointCloud<PointType>);
+  cloud->is_dense = reader.pod<uint8_t>();
+  reader.align();
+  const uint32_t width = reader.pod<uint32_t>();
+  const uint32_t height = reader.pod<uint32_t>();
+  const uint64_t size = reader.pod<uint64_t>();
+  if (uint64_t(width) * height != size) {
+    throw std::runtime_error("serialized cloud has invalid dimensions");
+  }
+  const char* points = reader.bytes(size * sizeof(PointType));
+  cloud->points.resize(size);
+  std::memcpy(cloud->points.data(), points, size * sizeof(PointType));
+  cloud->width = width;
+  cloud->height = height;
+  reader.align();
+  return cloud;
+}
+
+void writeDescriptors(Writer& writer, const LocalDescriptors* descriptors);
+LocalDescriptorsPtr readDescriptors(Reader& reader);
+
+/* estimate with content hashes of its maps instead of indices */
+void writeEstimate(Writer& writer, uint64_t source_hash, uint64_t target_hash,
+                   const TransformEstimate& estimate);
+TransformEstimate readEstimate(Reader& reader, uint64_t& source_hash,
+                               uint64_t& target_hash);
+
+}  // namespace map_merge_3d
+
+#endif  // MAP_MERGE_SERIALIZATION_H_
@@ -0,0 +1,349 @@
+#include <map_merge_3d/state_store.h>
+#include "serialization.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <unordered_set>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <Eigen/LU>
+
+namespace map_merge_3d
+{
+const uint32_t StateStore::VERSION = 2;
+
+static const char MAGIC[8] = {'M', 'M', '3', 'D', 'S', 'T', 'A', 'T'};
+
+/* FNV-1a */
+static const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+static const uint64_t FNV_PRIME = 1099511628211ULL;
+
+static inline void hashBytes(uint64_t &hash, const unsigned char *bytes,
+                             size_t size)
+{
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= FNV_PRIME;
+  }
+}
+
+uint64_t cloudHash(const PointCloud &cloud)
+{
+  uint64_t hash = FNV_OFFSET;
+  unsigned char bytes[3 * sizeof(float) + 3];
+  for (const auto &point : cloud) {
+    std::memcpy(bytes, &point.x, sizeof(float));
+    std::memcpy(bytes + sizeof(float), &point.y, sizeof(float));
+    std::memcpy(bytes + 2 * sizeof(float), &point.z, sizeof(float));
+    bytes[3 * sizeof(float)] = point.r;
+    bytes[3 * sizeof(float) + 1] = point.g;
+    bytes[3 * sizeof(float) + 2] = point.b;
+    hashBytes(hash, bytes, sizeof(bytes));
+  }
+  return hash;
+}
+
+template <typename T>
+static inline void hashValue(uint64_t &hash, const T &value)
+{
+  hashBytes(hash, reinterpret_cast<const unsigned char *>(&value),
+            sizeof(value));
+}
+
+/* features and estimates are valid only for the same parameters. parameters
+ * used only to combine estimates or to publish results do not invalidate the
+ * state */
+static uint64_t paramsHash(const MapMergingParams &params)
+{
+  uint64_t hash = FNV_OFFSET;
+  // features
+  hashValue(hash, params.resolution);
+  hashValue(hash, params.descriptor_radius);
+  hashValue(hash, params.outliers_min_neighbours);
+  hashValue(hash, params.normal_radius);
+  hashValue(hash, int(params.keypoint_type));
+  hashValue(hash, params.keypoint_threshold);
+  hashValue(hash, int(params.descriptor_type));
+  hashValue(hash, int(params.outliers_filter));
+  hashValue(hash, params.adaptive_descriptor_radius);
+  // pairwise estimates
+  hashValue(hash, int(params.estimation_method));
+  hashValue(hash, params.refine_transform);
+  hashValue(hash, params.inlier_threshold);
+  hashValue(hash, params.max_correspondence_distance);
+  hashValue(hash, params.max_iterations);
+  hashValue(hash, uint64_t(params.matching_k));
+  hashValue(hash, params.transform_epsilon);
+  // submaps decide both features and estimates
+  hashValue(hash, params.submap_size);
+  hashValue(hash, params.submap_overlap);
+  hashValue(hash, params.submap_candidates);
+  hashValue(hash, params.submap_translation_tolerance);
+  hashValue(hash, params.submap_rotation_tolerance);
+  return hash;
+}
+
+/* read-only mapping of the whole file */
+class StateStore::MappedFile
+{
+public:
+  explicit MappedFile(const std::string &path) : data_(nullptr), size_(0)
+  {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("StateStore: cannot open " + path + ": " +
+                               std::strerror(errno));
+    }
+    struct stat stats;
+    if (::fstat(fd, &stats) != 0) {
+      ::close(fd);
+      throw std::runtime_error("StateStore: cannot stat " + path + ": " +
+                               std::strerror(errno));
+    }
+    size_ = size_t(stats.st_size);
+    if (size_ > 0) {
+      void *data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) {
+        ::close(fd);
+        throw std::runtime_error("StateStore: cannot map " + path + ": " +
+                                 std::strerror(errno));
+      }
+      data_ = static_cast<const char *>(data);
+    }
+    // mapping stays valid after closing
+    ::close(fd);
+  }
+
+  ~MappedFile()
+  {
+    if (data_) {
+      ::munmap(const_cast<char *>(data_), size_);
+    }
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const char *data() const
+  {
+    return data_;
+  }
+
+  size_t size() const
+  {
+    return size_;
+  }
+
+private:
+  const char *data_;
+  size_t size_;
+};
+
+/* estimate with swapped source and target */
+static TransformEstimate invertEstimate(const TransformEstimate &estimate)
+{
+  TransformEstimate inverted = estimate;
+  std::swap(inverted.source_idx, inverted.target_idx);
+  if (!estimate.transform.isZero()) {
+    inverted.transform = estimate.transform.inverse();
+  }
+  if (!estimate.registration.transform.isZero()) {
+    inverted.registration.transform = estimate.registration.transform.inverse();
+  }
+  return inverted;
+}
+
+StateStore::StateStore(const std::string &path, const MapMergingParams &params)
+  : file_(new MappedFile(path))
+{
+  Reader reader(file_->data(), file_->size());
+  if (file_->size() < sizeof(MAGIC) ||
+      std::memcmp(reader.bytes(sizeof(MAGIC)), MAGIC, sizeof(MAGIC)) != 0) {
+    throw std::runtime_error("StateStore: " + path + " is not a state file");
+  }
+  const uint32_t version = reader.pod<uint32_t>();
+  if (version != VERSION) {
+    throw std::runtime_error("StateStore: " + path + " has version " +
+                             std::to_string(version) + ", expected " +
+                             std::to_string(VERSION));
+  }
+  const uint32_t point_size = reader.pod<uint32_t>();
+  const uint32_t normal_size = reader.pod<uint32_t>();
+  if (point_size != sizeof(PointT) || normal_size != sizeof(NormalT)) {
+    throw std::runtime_error("StateStore: " + path +
+                             " was saved with incompatible point types");
+  }
+  reader.pod<uint32_t>();
+  if (reader.pod<uint64_t>() != paramsHash(params)) {
+    throw std::runtime_error("StateStore: " + path +
+                             " was saved with different parameters");
+  }
+  const uint64_t maps = reader.pod<uint64_t>();
+  const uint64_t estimates = reader.pod<uint64_t>();
+
+  for (uint64_t i = 0; i < estimates; ++i) {
+    StoredEstimate stored;
+    stored.estimate =
+        readEstimate(reader, stored.source_hash, stored.target_hash);
+    estimates_.push_back(stored);
+  }
+
+  // only index maps, records are read on restore
+  for (uint64_t i = 0; i < maps; ++i) {
+    const uint64_t hash = reader.pod<uint64_t>();
+    const uint64_t size = reader.pod<uint64_t>();
+    maps_.emplace(hash, reader.position());
+    reader.bytes(size);
+  }
+}
+
+StateStore::~StateStore() = default;
+
+size_t StateStore::restore(const std::vector<PointCloudConstPtr> &clouds,
+                           EstimationContext &context) const
+{
+  std::vector<MapFeatures> &features = context.features;
+  features.resize(clouds.size());
+
+  size_t restored = 0;
+  for (size_t i = 0; i < clouds.size(); ++i) {
+    if (!clouds[i] || clouds[i]->empty() || features[i].source == clouds[i]) {
+      continue;
+    }
+    const uint64_t hash = cloudHash(*clouds[i]);
+    auto record = maps_.find(hash);
+    if (record == maps_.end()) {
+      continue;
+    }
+
+    Reader reader(file_->data(), file_->size(), record->second);
+    MapFeatures stored;
+    stored.cloud = readCloud<PointT>(reader);
+    stored.normals = readCloud<NormalT>(reader);
+    stored.keypoints = readCloud<PointT>(reader);
+    stored.descriptors = readDescriptors(reader);
+    if (!stored.cloud) {
+      continue;
+    }
+    stored.source = clouds[i];
+    stored.hash = hash;
+    features[i] = std::move(stored);
+    ++restored;
+  }
+
+  // maps with current features by their content
+  std::unordered_map<uint64_t, size_t> indices;
+  for (size_t i = 0; i < clouds.size(); ++i) {
+    if (clouds[i] && !clouds[i]->empty() && features[i].source == clouds[i]) {
+      indices.emplace(features[i].hash, i);
+    }
+  }
+
+  std::vector<TransformEstimate> &estimates = context.pairwise_estimates;
+  // pairs with an estimate
+  const size_t n = clouds.size();
+  std::unordered_set<size_t> known;
+  known.reserve(estimates.size() + estimates_.size());
+  for (const auto &est : estimates) {
+    known.insert(est.source_idx * n + est.target_idx);
+  }
+  for (const auto &stored : estimates_) {
+    auto source = indices.find(stored.source_hash);
+    auto target = indices.find(stored.target_hash);
+    if (source == indices.end() || target == indices.end() ||
+        source->second == target->second) {
+      continue;
+    }
+    TransformEstimate estimate = stored.estimate;
+    estimate.source_idx = source->second;
+    estimate.target_idx = target->second;
+    // estimation expects source index to be the smaller one
+    if (estimate.source_idx > estimate.target_idx) {
+      estimate = invertEstimate(estimate);
+    }
+    if (known.insert(estimate.source_idx * n + estimate.target_idx).second) {
+      estimates.push_back(estimate);
+    }
+  }
+
+  return restored;
+}
+
+void StateStore::save(const std::string &path, const MapMergingParams &params,
+                      const EstimationContext &context)
+{
+  // maps with computed features, each content only once
+  std::vector<const MapFeatures *> maps;
+  std::unordered_map<uint64_t, size_t> indices;
+  for (const auto &features : context.features) {
+    if (!features.source || features.source->empty() || !features.cloud) {
+      continue;
+    }
+    if (indices.emplace(features.hash, maps.size()).second) {
+      maps.push_back(&features);
+    }
+  }
+  std::vector<const TransformEstimate *> estimates;
+  for (const auto &estimate : context.pairwise_estimates) {
+    if (estimate.source_idx < context.features.size() &&
+        estimate.target_idx < context.features.size() &&
+        context.features[estimate.source_idx].source &&
+        context.features[estimate.target_idx].source) {
+      estimates.push_back(&estimate);
+    }
+  }
+
+  // written to temporary file first to replace the old state atomically
+  const std::string tmp_path = path + ".tmp";
+  {
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+      throw std::runtime_error("StateStore: cannot write " + tmp_path);
+    }
+    Writer writer(out);
+    writer.bytes(MAGIC, sizeof(MAGIC));
+    writer.pod<uint32_t>(VERSION);
+    writer.pod<uint32_t>(sizeof(PointT));
+    writer.pod<uint32_t>(sizeof(NormalT));
+    writer.pod<uint32_t>(0);
+    writer.pod<uint64_t>(paramsHash(params));
+    writer.pod<uint64_t>(maps.size());
+    writer.pod<uint64_t>(estimates.size());
+
+    for (const TransformEstimate *estimate : estimates) {
+      writeEstimate(writer, context.features[estimate->source_idx].hash,
+                    context.features[estimate->target_idx].hash, *estimate);
+    }
+
+    for (const MapFeatures *features : maps) {
+      writer.pod<uint64_t>(features->hash);
+      const size_t size_position = writer.position();
+      writer.pod<uint64_t>(0);
+      writeCloud(writer, features->cloud.get());
+      writeCloud(writer, features->normals.get());
+      writeCloud(writer, features->keypoints.get());
+      writeDescriptors(writer, features->descriptors.get());
+      writer.patch(size_position,
+                   writer.position() - size_position - sizeof(uint64_t));
+    }
+
+    out.flush();
+    if (!out) {
+      throw std::runtime_error("StateStore: cannot write " + tmp_path);
+    }
+  }
+  if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    std::remove(tmp_path.c_str());
+    throw std::runtime_error("StateStore: cannot replace " + path + ": " +
+                             std::strerror(errno));
+  }
+}
+
+}  // namespace map_merge_3d
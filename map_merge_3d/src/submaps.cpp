@@ -0,0 +1,268 @@
+#include <map_merge_3d/submaps.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <stdexcept>
+#include <utility>
+
+#include <Eigen/Geometry>
+
+#include <pcl/common/point_tests.h>
+
+namespace map_merge_3d
+{
+typedef std::pair<int, int> SubmapKey;
+
+/* calls body for every submap extended by overlap containing the point */
+template <typename B>
+static inline void forEachSubmap(const PointT &point, double submap_size,
+                                 double overlap, B body)
+{
+  const int min_x = int(std::floor((point.x - overlap) / submap_size));
+  const int max_x = int(std::floor((point.x + overlap) / submap_size));
+  const int min_y = int(std::floor((point.y - overlap) / submap_size));
+  const int max_y = int(std::floor((point.y + overlap) / submap_size));
+  for (int x = min_x; x <= max_x; ++x) {
+    for (int y = min_y; y <= max_y; ++y) {
+      body(SubmapKey(x, y));
+    }
+  }
+}
+
+/* descriptors rows at indices */
+static inline LocalDescriptorsPtr
+selectDescriptors(const LocalDescriptors &descriptors,
+                  const std::vector<size_t> &indices)
+{
+  LocalDescriptorsPtr result(new LocalDescriptors);
+  result->header = descriptors.header;
+  result->fields = descriptors.fields;
+  result->is_bigendian = descriptors.is_bigendian;
+  result->is_dense = descriptors.is_dense;
+  result->point_step = descriptors.point_step;
+  result->height = 1;
+  result->width = uint32_t(indices.size());
+  result->row_step = result->width * result->point_step;
+  result->data.resize(size_t(result->row_step));
+  for (size_t i = 0; i < indices.size(); ++i) {
+    std::memcpy(&result->data[i * descriptors.point_step],
+                &descriptors.data[indices[i] * descriptors.point_step],
+                descriptors.point_step);
+  }
+  return result;
+}
+
+std::vector<Submap>
+partitionToSubmaps(const PointCloudConstPtr &keypoints,
+                   const LocalDescriptorsConstPtr &descriptors,
+                   double submap_size, double overlap, size_t min_keypoints)
+{
+  if (!(submap_size > 0.) || overlap < 0.) {
+    throw std::invalid_argument("partitionToSubmaps: submap_size must be "
+                                "positive and overlap non-negative");
+  }
+  if (size_t(descriptors->width) * descriptors->height != keypoints->size()) {
+    throw std::invalid_argument("partitionToSubmaps: descriptors do not match "
+                                "keypoints");
+  }
+
+  // keypoints decide which submaps exist
+  std::map<SubmapKey, std::vector<size_t>> submaps_keypoints;
+  for (size_t i = 0; i < keypoints->size(); ++i) {
+    const PointT &keypoint = (*keypoints)[i];
+    if (!pcl::isFinite(keypoint)) {
+      continue;
+    }
+    forEachSubmap(keypoint, submap_size, overlap, [&](const SubmapKey &key) {
+      submaps_keypoints[key].push_back(i);
+    });
+  }
+
+  std::map<SubmapKey, Submap> submaps;
+  for (const auto &submap_keypoints : submaps_keypoints) {
+    const std::vector<size_t> &indices = submap_keypoints.second;
+    if (indices.size() < min_keypoints) {
+      continue;
+    }
+    Submap &submap = submaps[submap_keypoints.first];
+    submap.x = submap_keypoints.first.first;
+    submap.y = submap_keypoints.first.second;
+    submap.keypoint_indices = indices;
+    submap.keypoints.reset(new PointCloud);
+    submap.keypoints->header = keypoints->header;
+    submap.keypoints->reserve(indices.size());
+    for (size_t i : indices) {
+      submap.keypoints->push_back((*keypoints)[i]);
+    }
+    submap.descriptors = selectDescriptors(*descriptors, indices);
+  }
+
+  std::vector<Submap> result;
+  result.reserve(submaps.size());
+  for (auto &submap : submaps) {
+    result.push_back(std::move(submap.second));
+  }
+  return result;
+}
+
+PointCloudPtr extractSubmapCloud(const PointCloudConstPtr &cloud,
+                                 const Submap &submap, double submap_size,
+                                 double overlap)
+{
+  const double min_x = submap.x * submap_size - overlap;
+  const double max_x = (submap.x + 1) * submap_size + overlap;
+  const double min_y = submap.y * submap_size - overlap;
+  const double max_y = (submap.y + 1) * submap_size + overlap;
+  PointCloudPtr result(new PointCloud);
+  result->header = cloud->header;
+  for (const auto &point : *cloud) {
+    if (pcl::isFinite(point) && point.x >= min_x && point.x <= max_x &&
+        point.y >= min_y && point.y <= max_y) {
+      result->push_back(point);
+    }
+  }
+  return result;
+}
+
+std::vector<std::pair<size_t, size_t>>
+selectSubmapPairs(const std::vector<Submap> &source_submaps,
+                  const std::vector<Submap> &target_submaps,
+                  const Correspondences &correspondences, size_t max_pairs,
+                  size_t min_votes)
+{
+  // submaps containing each keypoint
+  auto keypointsSubmaps = [](const std::vector<Submap> &submaps) {
+    std::vector<std::vector<size_t>> result;
+    for (size_t s = 0; s < submaps.size(); ++s) {
+      for (size_t keypoint : submaps[s].keypoint_indices) {
+        if (keypoint >= result.size()) {
+          result.resize(keypoint + 1);
+        }
+        result[keypoint].push_back(s);
+      }
+    }
+    return result;
+  };
+  const std::vector<std::vector<size_t>> source_keypoints =
+      keypointsSubmaps(source_submaps);
+  const std::vector<std::vector<size_t>> target_keypoints =
+      keypointsSubmaps(target_submaps);
+
+  std::map<std::pair<size_t, size_t>, size_t> votes;
+  for (const auto &correspondence : correspondences) {
+    const size_t source = size_t(correspondence.index_query);
+    const size_t target = size_t(correspondence.index_match);
+    if (correspondence.index_query < 0 || correspondence.index_match < 0 ||
+        source >= source_keypoints.size() ||
+        target >= target_keypoints.size()) {
+      continue;
+    }
+    for (size_t a : source_keypoints[source]) {
+      for (size_t b : target_keypoints[target]) {
+        ++votes[{a, b}];
+      }
+    }
+  }
+
+  std::vector<std::pair<size_t, std::pair<size_t, size_t>>> ranked;
+  for (const auto &vote : votes) {
+    if (vote.second >= min_votes) {
+      ranked.emplace_back(vote.second, vote.first);
+    }
+  }
+  // the most voted first, ties in the order of submaps
+  std::stable_sort(ranked.begin(), ranked.end(),
+                   [](const std::pair<size_t, std::pair<size_t, size_t>> &a,
+                      const std::pair<size_t, std::pair<size_t, size_t>> &b) {
+                     return a.first > b.first;
+                   });
+  std::vector<std::pair<size_t, size_t>> result;
+  for (size_t i = 0; i < ranked.size() && i < max_pairs; ++i) {
+    result.push_back(ranked[i].second);
+  }
+  return result;
+}
+
+/* whether transforms differ less than tolerances */
+static inline bool isSimilar(const Eigen::Matrix4f &a, const Eigen::Matrix4f &b,
+                             double translation_tolerance,
+                             double rotation_tolerance)
+{
+  const Eigen::Affine3f difference(a.inverse() * b);
+  return difference.translation().norm() <= translation_tolerance &&
+         Eigen::AngleAxisf(difference.linear()).angle() <= rotation_tolerance;
+}
+
+/* estimate with a transform and an overlap of the submaps */
+static inline bool isValid(const TransformEstimate &estimate)
+{
+  const double score = estimate.registration.score;
+  return !estimate.transform.isZero() && estimate.transform.allFinite() &&
+         score >= 0. && score < std::numeric_limits<double>::max();
+}
+
+/* inliers are counted only by MATCHING, otherwise each estimate is one vote */
+static inline double supportWeight(const TransformEstimate &estimate)
+{
+  return estimate.registration.inliers > 0 ?
+             double(estimate.registration.inliers) :
+             1.;
+}
+
+TransformEstimate
+aggregateSubmapEstimates(const std::vector<TransformEstimate> &submap_estimates,
+                         double translation_tolerance,
+                         double rotation_tolerance)
+{
+  TransformEstimate result;
+  result.transform = Eigen::Matrix4f::Zero();
+  double best_support = 0.;
+  const TransformEstimate *best = nullptr;
+  for (const auto &candidate : submap_estimates) {
+    if (!isValid(candidate)) {
+      continue;
+    }
+    double support = 0.;
+    for (const auto &est : submap_estimates) {
+      if (isValid(est) &&
+          isSimilar(candidate.transform, est.transform, translation_tolerance,
+                    rotation_tolerance)) {
+        support += supportWeight(est);
+      }
+    }
+    // the better scored one of equally supported estimates
+    if (support > best_support ||
+        (best && support == best_support &&
+         candidate.registration.score < best->registration.score)) {
+      best_support = support;
+      best = &candidate;
+    }
+  }
+  if (!best) {
+    return result;
+  }
+
+  result = *best;
+  RegistrationResult &registration = result.registration;
+  registration.correspondences = 0;
+  registration.inliers = 0;
+  double score = 0.;
+  for (const auto &est : submap_estimates) {
+    if (!isValid(est) ||
+        !isSimilar(best->transform, est.transform, translation_tolerance,
+                   rotation_tolerance)) {
+      continue;
+    }
+    registration.correspondences += est.registration.correspondences;
+    registration.inliers += est.registration.inliers;
+    score += supportWeight(est) * est.registration.score;
+  }
+  registration.score = score / best_support;
+  result.confidence = 1. / registration.score;
+  return result;
+}
+
+}  // namespace map_merge_3d
@@ -0,0 +1,244 @@
+#include <map_merge_3d/synthetic.h>
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+
+#include <pcl/common/common.h>
+
+namespace map_merge_3d
+{
+namespace
+{
+/* planar rectangle of the scene */
+struct Surface {
+  Eigen::Vector3f origin;
+  Eigen::Vector3f u;  // spans the surface together with v
+  Eigen::Vector3f v;
+  Eigen::Vector3f colour;
+};
+
+void addBox(std::vector<Surface> &surfaces, const Eigen::Vector3f &min,
+            const Eigen::Vector3f &size, const Eigen::Vector3f &colour)
+{
+  const Eigen::Vector3f x(size.x(), 0, 0), y(0, size.y(), 0),
+      z(0, 0, size.z());
+  const Eigen::Vector3f max = min + size;
+  surfaces.push_back({min + z, x, y, colour});
+  surfaces.push_back({min, x, z, colour});
+  surfaces.push_back({max - x - z, x, z, colour});
+  surfaces.push_back({min, y, z, colour});
+  surfaces.push_back({max - y - z, y, z, colour});
+}
+
+uint8_t clampColour(float value)
+{
+  return uint8_t(std::min(255.f, std::max(0.f, value)));
+}
+
+}  // anonymous namespace
+
+PointCloudPtr generateScene(const SceneParams &params)
+{
+  const float size_x = float(params.size_x);
+  const float size_y = float(params.size_y);
+  const float height = float(params.height);
+
+  std::vector<Surface> surfaces;
+  // floor and walls
+  surfaces.push_back({{0, 0, 0}, {size_x, 0, 0}, {0, size_y, 0}, {120, 120, 120}});
+  surfaces.push_back({{0, 0, 0}, {size_x, 0, 0}, {0, 0, height}, {200, 60, 60}});
+  surfaces.push_back(
+      {{0, size_y, 0}, {size_x, 0, 0}, {0, 0, height}, {60, 200, 60}});
+  surfaces.push_back({{0, 0, 0}, {0, size_y, 0}, {0, 0, height}, {60, 60, 200}});
+  surfaces.push_back(
+      {{size_x, 0, 0}, {0, size_y, 0}, {0, 0, height}, {200, 200, 60}});
+
+  // boxes
+  std::mt19937 rng(params.seed);
+  std::uniform_real_distribution<float> extent(0.3f, 1.5f);
+  std::uniform_real_distribution<float> channel(0.f, 255.f);
+  std::uniform_real_distribution<float> unit(0.f, 1.f);
+  const size_t obstacles =
+      size_t(params.obstacles_density * params.size_x * params.size_y);
+  for (size_t i = 0; i < obstacles; ++i) {
+    Eigen::Vector3f size(extent(rng), extent(rng),
+                         std::min(extent(rng), height));
+    Eigen::Vector3f min(unit(rng) * std::max(0.f, size_x - size.x()),
+                        unit(rng) * std::max(0.f, size_y - size.y()), 0.f);
+    addBox(surfaces, min, size, {channel(rng), channel(rng), channel(rng)});
+  }
+
+  // sample surfaces proportionally to their area
+  std::vector<float> areas;
+  areas.reserve(surfaces.size());
+  for (const auto &s : surfaces) {
+    areas.push_back(s.u.cross(s.v).norm());
+  }
+  std::discrete_distribution<size_t> pick_surface(areas.begin(), areas.end());
+
+  PointCloudPtr cloud(new PointCloud);
+  cloud->reserve(params.points);
+  for (size_t i = 0; i < params.points; ++i) {
+    const Surface &s = surfaces[pick_surface(rng)];
+    const float a = unit(rng), b = unit(rng);
+    const Eigen::Vector3f p = s.origin + a * s.u + b * s.v;
+    // stripes with 0.5 m period give colour features
+    const float stripe = (s.u * a + s.v * b).sum();
+    const float shade = int(std::floor(stripe * 2.f)) % 2 ? 1.f : 0.5f;
+    PointT point;
+    point.x = p.x();
+    point.y = p.y();
+    point.z = p.z();
+    point.r = clampColour(s.colour.x() * shade);
+    point.g = clampColour(s.colour.y() * shade);
+    point.b = clampColour(s.colour.z() * shade);
+    cloud->push_back(point);
+  }
+
+  return cloud;
+}
+
+/* maps are placed on grid with this many columns */
+static inline size_t gridColumns(size_t maps)
+{
+  return size_t(std::ceil(std::sqrt(double(maps))));
+}
+
+static inline double gridStride(const PartialMapsParams &params)
+{
+  const double stride = params.map_size * (1.0 - params.overlap);
+  if (!(stride > 0.0)) {
+    throw std::invalid_argument("partial maps: overlap must be smaller than "
+                                "1 and map_size positive");
+  }
+  return stride;
+}
+
+SceneParams sceneForPartialMaps(const SceneParams &scene,
+                                const PartialMapsParams &params)
+{
+  const size_t cols = gridColumns(params.maps);
+  const size_t rows = (params.maps + cols - 1) / cols;
+  const double stride = gridStride(params);
+
+  SceneParams result = scene;
+  result.size_x = params.map_size + double(cols - 1) * stride;
+  result.size_y = params.map_size + double(rows - 1) * stride;
+  return result;
+}
+
+PartialMaps generatePartialMaps(const PointCloudConstPtr &scene,
+                                const PartialMapsParams &params)
+{
+  PartialMaps result;
+  if (params.maps == 0) {
+    return result;
+  }
+
+  const double stride = gridStride(params);
+  const size_t cols = gridColumns(params.maps);
+  const size_t rows = (params.maps + cols - 1) / cols;
+
+  PointT min_pt, max_pt;
+  pcl::getMinMax3D(*scene, min_pt, max_pt);
+
+  // bucket scene points to grid cells of stride size to avoid scanning whole
+  // scene for each map
+  const size_t cells_x = cols + size_t(std::ceil(params.map_size / stride));
+  const size_t cells_y = rows + size_t(std::ceil(params.map_size / stride));
+  std::vector<size_t> point_cells(scene->size());
+  std::vector<size_t> cell_offsets(cells_x * cells_y + 1, 0);
+  for (size_t i = 0; i < scene->size(); ++i) {
+    const PointT &p = (*scene)[i];
+    const size_t cx = std::min(cells_x - 1, size_t((p.x - min_pt.x) / stride));
+    const size_t cy = std::min(cells_y - 1, size_t((p.y - min_pt.y) / stride));
+    point_cells[i] = cy * cells_x + cx;
+    ++cell_offsets[point_cells[i] + 1];
+  }
+  std::partial_sum(cell_offsets.begin(), cell_offsets.end(),
+                   cell_offsets.begin());
+  std::vector<size_t> cell_points(scene->size());
+  {
+    std::vector<size_t> fill(cell_offsets.begin(), cell_offsets.end() - 1);
+    for (size_t i = 0; i < scene->size(); ++i) {
+      cell_points[fill[point_cells[i]]++] = i;
+    }
+  }
+  const size_t cells_per_map = size_t(std::ceil(params.map_size / stride));
+
+  for (size_t k = 0; k < params.maps; ++k) {
+    // each map has its own generator so maps do not depend on each other
+    std::seed_seq seed{params.seed, unsigned(k)};
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> unit(0.f, 1.f);
+    std::uniform_real_distribution<float> symmetric(-1.f, 1.f);
+    // standard deviations might be zero, which normal_distribution does not
+    // support
+    std::normal_distribution<float> normal(0.f, 1.f);
+    const float noise = float(params.noise);
+
+    // random map frame map -> scene
+    Eigen::Affine3f ground_truth =
+        Eigen::Translation3f(float(params.max_translation) * symmetric(rng),
+                             float(params.max_translation) * symmetric(rng),
+                             0.f) *
+        Eigen::AngleAxisf(float(params.max_rotation) * symmetric(rng),
+                          Eigen::Vector3f::UnitZ()) *
+        Eigen::AngleAxisf(float(params.max_tilt) * symmetric(rng),
+                          Eigen::Vector3f::UnitY()) *
+        Eigen::AngleAxisf(float(params.max_tilt) * symmetric(rng),
+                          Eigen::Vector3f::UnitX());
+    const Eigen::Affine3f scene_to_map = ground_truth.inverse();
+    const float keep_ratio =
+        1.f - float(params.density_variation) * unit(rng);
+    const float colour_shift = float(params.colour_variation) * normal(rng);
+
+    // window of this map
+    const size_t col = k % cols;
+    const size_t row = k / cols;
+    const float x_min = min_pt.x + float(double(col) * stride);
+    const float y_min = min_pt.y + float(double(row) * stride);
+    const float x_max = x_min + float(params.map_size);
+    const float y_max = y_min + float(params.map_size);
+
+    PointCloudPtr map(new PointCloud);
+    for (size_t cy = row; cy < std::min(cells_y, row + cells_per_map); ++cy) {
+      for (size_t cx = col; cx < std::min(cells_x, col + cells_per_map);
+           ++cx) {
+        const size_t cell = cy * cells_x + cx;
+        for (size_t i = cell_offsets[cell]; i < cell_offsets[cell + 1]; ++i) {
+          const PointT &p = (*scene)[cell_points[i]];
+          if (p.x < x_min || p.x >= x_max || p.y < y_min || p.y >= y_max) {
+            continue;
+          }
+          if (unit(rng) >= keep_ratio) {
+            continue;
+          }
+          PointT point = p;
+          Eigen::Vector3f position =
+              scene_to_map * Eigen::Vector3f(p.x + noise * normal(rng),
+                                             p.y + noise * normal(rng),
+                                             p.z + noise * normal(rng));
+          point.x = position.x();
+          point.y = position.y();
+          point.z = position.z();
+          point.r = clampColour(p.r + colour_shift);
+          point.g = clampColour(p.g + colour_shift);
+          point.b = clampColour(p.b + colour_shift);
+          map->push_back(point);
+        }
+      }
+    }
+    map->header.frame_id = "map" + std::to_string(k);
+
+    result.maps.emplace_back(std::move(map));
+    result.ground_truth.emplace_back(ground_truth.matrix());
+  }
+
+  return result;
+}
+
+}  // namespace map_merge_3d
@@ -0,0 +1,162 @@
+#include <map_merge_3d/tiled_map.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#include <pcl/common/point_tests.h>
+
+namespace map_merge_3d
+{
+TiledMap::TiledMap(double tile_size) : tile_size_(tile_size)
+{
+  if (!(tile_size > 0.)) {
+    throw std::invalid_argument("TiledMap: tile_size must be positive");
+  }
+}
+
+TiledMap::TileKey TiledMap::tileKey(float x, float y) const
+{
+  return {int(std::floor(x / tile_size_)), int(std::floor(y / tile_size_))};
+}
+
+/* FNV-1a over point coordinates and colour */
+static inline uint64_t hashPoint(const PointT &point)
+{
+  unsigned char bytes[3 * sizeof(float) + 3];
+  std::memcpy(bytes, &point.x, sizeof(float));
+  std::memcpy(bytes + sizeof(float), &point.y, sizeof(float));
+  std::memcpy(bytes + 2 * sizeof(float), &point.z, sizeof(float));
+  bytes[3 * sizeof(float)] = point.r;
+  bytes[3 * sizeof(float) + 1] = point.g;
+  bytes[3 * sizeof(float) + 2] = point.b;
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char byte : bytes) {
+    hash ^= byte;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+std::vector<TiledMap::TileKey> TiledMap::update(const PointCloud &map)
+{
+  return updateTiles(map, nullptr);
+}
+
+std::vector<TiledMap::TileKey>
+TiledMap::update(const PointCloud &map, const Eigen::AlignedBox3f &region)
+{
+  if (region.isEmpty()) {
+    return {};
+  }
+  return updateTiles(map, &region);
+}
+
+/* rebuilds tiles intersecting region, all tiles if region is nullptr */
+std::vector<TiledMap::TileKey>
+TiledMap::updateTiles(const PointCloud &map, const Eigen::AlignedBox3f *region)
+{
+  TileKey min, max;
+  if (region) {
+    min = tileKey(region->min().x(), region->min().y());
+    max = tileKey(region->max().x(), region->max().y());
+  }
+  auto in_region = [region, &min, &max](const TileKey &key) {
+    return !region ||
+           (key.first >= min.first && key.first <= max.first &&
+            key.second >= min.second && key.second <= max.second);
+  };
+
+  std::map<TileKey, Tile> tiles;
+  for (const auto &point : map) {
+    if (!pcl::isFinite(point)) {
+      continue;
+    }
+    const TileKey key = tileKey(point.x, point.y);
+    if (!in_region(key)) {
+      continue;
+    }
+    Tile &tile = tiles[key];
+    if (!tile.points) {
+      tile.points.reset(new PointCloud);
+      tile.points->header = map.header;
+      tile.hash = 0;
+    }
+    tile.points->push_back(point);
+    // sum does not depend on the order of points, which changes with the
+    // extent of the map
+    tile.hash += hashPoint(point);
+  }
+
+  std::vector<TileKey> changed;
+  for (auto it = tiles_.begin(); it != tiles_.end();) {
+    if (in_region(it->first) && tiles.count(it->first) == 0) {
+      changed.push_back(it->first);
+      it = tiles_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  for (auto &tile : tiles) {
+    auto old = tiles_.find(tile.first);
+    if (old != tiles_.end() && old->second.hash == tile.second.hash &&
+        old->second.points->size() == tile.second.points->size()) {
+      // keep the old tile to keep pointers handed out stable
+      continue;
+    }
+    changed.push_back(tile.first);
+    tiles_[tile.first] = std::move(tile.second);
+  }
+  std::sort(changed.begin(), changed.end());
+
+  return changed;
+}
+
+PointCloudConstPtr TiledMap::tile(const TileKey &key) const
+{
+  auto it = tiles_.find(key);
+  if (it == tiles_.end()) {
+    return nullptr;
+  }
+  return it->second.points;
+}
+
+std::vector<TiledMap::TileKey> TiledMap::tiles() const
+{
+  std::vector<TileKey> result;
+  result.reserve(tiles_.size());
+  for (const auto &tile : tiles_) {
+    result.push_back(tile.first);
+  }
+  return result;
+}
+
+PointCloudPtr TiledMap::regionOfInterest(const Eigen::Vector3f &center,
+                                         double radius) const
+{
+  PointCloudPtr result(new PointCloud);
+  const float r = float(radius);
+  const TileKey min = tileKey(center.x() - r, center.y() - r);
+  const TileKey max = tileKey(center.x() + r, center.y() + r);
+  const float r2 = r * r;
+  for (int x = min.first; x <= max.first; ++x) {
+    for (int y = min.second; y <= max.second; ++y) {
+      auto it = tiles_.find({x, y});
+      if (it == tiles_.end()) {
+        continue;
+      }
+      result->header = it->second.points->header;
+      for (const auto &point : *it->second.points) {
+        const float dx = point.x - center.x();
+        const float dy = point.y - center.y();
+        if (dx * dx + dy * dy <= r2) {
+          result->push_back(point);
+        }
+      }
+    }
+  }
+  return result;
+}
+
+}  // namespace map_merge_3d
@@ -0,0 +1,416 @@
+#include <benchmark/benchmark.h>
+
+#include <random>
+#include <string>
+
+#include <map_merge_3d/features.h>
+#include <map_merge_3d/map_merging.h>
+#include <map_merge_3d/evaluation.h>
+#include <map_merge_3d/matching.h>
+#include <map_merge_3d/synthetic.h>
+#include "graph.h"
+#include "pose_graph.h"
+
+#include <pcl/common/transforms.h>
+
+using namespace map_merge_3d;
+
+/* procedural room scene with the given number of points */
+static PointCloudPtr generateScene(size_t points_count, unsigned seed = 42)
+{
+  SceneParams params;
+  params.size_x = 10.0;
+  params.size_y = 10.0;
+  params.obstacles_density = 0.12;
+  params.points = points_count;
+  params.seed = seed;
+  return map_merge_3d::generateScene(params);
+}
+
+/* ground truth transform between source and target of a pair */
+static inline Eigen::Matrix4f groundTruthTransform()
+{
+  Eigen::Affine3f transform =
+      Eigen::Translation3f(1.5f, -0.7f, 0.1f) *
+      Eigen::AngleAxisf(0.3f, Eigen::Vector3f::UnitZ());
+  return transform.matrix();
+}
+
+/* the same scene seen from the other robot (in its own frame) */
+static inline PointCloudPtr transformedScene(const PointCloudConstPtr &scene)
+{
+  PointCloudPtr target(new PointCloud);
+  pcl::transformPointCloud(*scene, *target, groundTruthTransform());
+  return target;
+}
+
+/* preprocessed cloud as in estimateMapsTransforms */
+struct Features {
+  PointCloudPtr cloud;
+  SurfaceNormalsPtr normals;
+  PointCloudPtr keypoints;
+  LocalDescriptorsPtr descriptors;
+};
+
+static Features computeFeatures(const PointCloudConstPtr &input,
+                                const MapMergingParams &params)
+{
+  Features features;
+  features.cloud = downSample(input, params.resolution);
+  features.cloud = removeOutliers(features.cloud, params.descriptor_radius,
+                                  params.outliers_min_neighbours);
+  features.normals = computeSurfaceNormals(features.cloud, params.normal_radius);
+  features.keypoints = detectKeypoints(
+      features.cloud, features.normals, params.keypoint_type,
+      params.keypoint_threshold, params.normal_radius, params.resolution);
+  features.descriptors = computeLocalDescriptors(
+      features.cloud, features.normals, features.keypoints,
+      params.descriptor_type, params.descriptor_radius);
+  return features;
+}
+
+static inline void setPointsProcessed(benchmark::State &state, size_t points)
+{
+  state.SetItemsProcessed(int64_t(state.iterations()) * int64_t(points));
+}
+
+/* cloud sizes used for all benchmarks */
+static const std::vector<int> points_counts = {10000, 100000, 1000000};
+
+static void allKeypoints(benchmark::internal::Benchmark *benchmark)
+{
+  for (int points : points_counts) {
+    for (Keypoint k : {Keypoint::SIFT, Keypoint::HARRIS, Keypoint::FAST_SIFT}) {
+      benchmark->Args({points, int(k)});
+    }
+  }
+}
+
+static void allDescriptors(benchmark::internal::Benchmark *benchmark)
+{
+  for (int points : points_counts) {
+    for (int d = 0; d < NUM_ARGS(DESCRIPTORS_NAMES_); ++d) {
+      // single thread and all threads
+      for (int threads : {1, 0}) {
+        benchmark->Args({points, d, threads});
+      }
+    }
+  }
+}
+
+static void multipleMaps(benchmark::internal::Benchmark *benchmark)
+{
+  for (int points : points_counts) {
+    for (int maps : {2, 8}) {
+      benchmark->Args({points, maps});
+    }
+  }
+}
+
+/* per-cloud stages */
+
+static void BM_downSample(benchmark::State &state)
+{
+  const MapMergingParams params;
+  PointCloudPtr scene = generateScene(size_t(state.range(0)));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(downSample(scene, params.resolution));
+  }
+  setPointsProcessed(state, scene->size());
+}
+BENCHMARK(BM_downSample)
+    ->RangeMultiplier(10)
+    ->Range(10000, 1000000)
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_removeOutliers(benchmark::State &state)
+{
+  const MapMergingParams params;
+  PointCloudPtr cloud =
+      downSample(generateScene(size_t(state.range(0))), params.resolution);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(removeOutliers(cloud, params.descriptor_radius,
+                                            params.outliers_min_neighbours));
+  }
+  setPointsProcessed(state, cloud->size());
+}
+BENCHMARK(BM_removeOutliers)
+    ->RangeMultiplier(10)
+    ->Range(10000, 1000000)
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_computeSurfaceNormals(benchmark::State &state)
+{
+  const MapMergingParams params;
+  PointCloudPtr cloud =
+      downSample(generateScene(size_t(state.range(0))), params.resolution);
+  const int threads = int(state.range(1));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        computeSurfaceNormals(cloud, params.normal_radius, threads));
+  }
+  setPointsProcessed(state, cloud->size());
+}
+BENCHMARK(BM_computeSurfaceNormals)
+    ->RangeMultiplier(10)
+    ->Ranges({{10000, 1000000}, {0, 1}})
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_detectKeypoints(benchmark::State &state)
+{
+  MapMergingParams params;
+  params.keypoint_type = static_cast<Keypoint>(state.range(1));
+  if (params.keypoint_type == Keypoint::HARRIS) {
+    params.keypoint_threshold = 0.0;
+  }
+  PointCloudPtr cloud =
+      downSample(generateScene(size_t(state.range(0))), params.resolution);
+  SurfaceNormalsPtr normals = computeSurfaceNormals(cloud, params.normal_radius);
+  size_t keypoints_count = 0;
+  for (auto _ : state) {
+    PointCloudPtr keypoints = detectKeypoints(
+        cloud, normals, params.keypoint_type, params.keypoint_threshold,
+        params.normal_radius, params.resolution, params.feature_threads);
+    keypoints_count = keypoints->size();
+  }
+  setPointsProcessed(state, cloud->size());
+  state.counters["keypoints"] = keypoints_count;
+  state.SetLabel(enums::to_string(params.keypoint_type));
+}
+BENCHMARK(BM_detectKeypoints)
+    ->Apply(allKeypoints)
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_computeLocalDescriptors(benchmark::State &state)
+{
+  MapMergingParams params;
+  params.descriptor_type = static_cast<Descriptor>(state.range(1));
+  params.feature_threads = int(state.range(2));
+  PointCloudPtr cloud =
+      downSample(generateScene(size_t(state.range(0))), params.resolution);
+  SurfaceNormalsPtr normals = computeSurfaceNormals(cloud, params.normal_radius);
+  PointCloudPtr keypoints = detectKeypoints(
+      cloud, normals, params.keypoint_type, params.keypoint_threshold,
+      params.normal_radius, params.resolution);
+  for (auto _ : state) {
+    // descriptors computation may remove keypoints
+    state.PauseTiming();
+    PointCloudPtr keypoints_copy(new PointCloud(*keypoints));
+    state.ResumeTiming();
+    benchmark::DoNotOptimize(
+        computeLocalDescriptors(cloud, normals, keypoints_copy,
+                                params.descriptor_type,
+                                params.descriptor_radius,
+                                params.feature_threads));
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) *
+                          int64_t(keypoints->size()));
+  state.SetLabel(std::string(enums::to_string(params.descriptor_type)) +
+                 (params.feature_threads == 1 ? "" : " parallel"));
+}
+BENCHMARK(BM_computeLocalDescriptors)
+    ->Apply(allDescriptors)
+    ->Unit(benchmark::kMillisecond);
+
+/* pairwise stages */
+
+static void BM_findFeatureCorrespondences(benchmark::State &state)
+{
+  const MapMergingParams params;
+  PointCloudPtr scene = generateScene(size_t(state.range(0)));
+  Features source = computeFeatures(scene, params);
+  Features target = computeFeatures(transformedScene(scene), params);
+  size_t correspondences_count = 0;
+  for (auto _ : state) {
+    CorrespondencesPtr correspondences = findFeatureCorrespondences(
+        source.descriptors, target.descriptors, params.matching_k);
+    correspondences_count = correspondences->size();
+  }
+  state.counters["correspondences"] = correspondences_count;
+  state.SetItemsProcessed(int64_t(state.iterations()) *
+                          int64_t(source.keypoints->size()));
+}
+BENCHMARK(BM_findFeatureCorrespondences)
+    ->RangeMultiplier(10)
+    ->Range(10000, 1000000)
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_estimateTransformICP(benchmark::State &state)
+{
+  const MapMergingParams params;
+  PointCloudPtr scene = generateScene(size_t(state.range(0)));
+  PointCloudPtr source = downSample(scene, params.resolution);
+  PointCloudPtr target =
+      downSample(transformedScene(scene), params.resolution);
+  // start from slightly perturbed ground truth
+  const Eigen::Matrix4f ground_truth = groundTruthTransform();
+  Eigen::Affine3f perturbation =
+      Eigen::Translation3f(0.1f, 0.1f, 0.f) *
+      Eigen::AngleAxisf(0.05f, Eigen::Vector3f::UnitZ());
+  const Eigen::Matrix4f initial_guess = perturbation.matrix() * ground_truth;
+
+  Eigen::Matrix4f transform;
+  for (auto _ : state) {
+    transform = estimateTransformICP(
+        source, target, initial_guess, params.max_correspondence_distance,
+        params.inlier_threshold, params.max_iterations,
+        params.transform_epsilon);
+  }
+  setPointsProcessed(state, source->size());
+  Eigen::Matrix4f error = ground_truth.inverse() * transform;
+  state.counters["translation_error"] = error.block<3, 1>(0, 3).norm();
+  state.counters["rotation_error"] =
+      Eigen::AngleAxisf(Eigen::Matrix3f(error.block<3, 3>(0, 0))).angle();
+}
+BENCHMARK(BM_estimateTransformICP)
+    ->RangeMultiplier(10)
+    ->Range(10000, 1000000)
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_transformScore(benchmark::State &state)
+{
+  const MapMergingParams params;
+  PointCloudPtr scene = generateScene(size_t(state.range(0)));
+  PointCloudPtr source = downSample(scene, params.resolution);
+  PointCloudPtr target =
+      downSample(transformedScene(scene), params.resolution);
+  const Eigen::Matrix4f ground_truth = groundTruthTransform();
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(transformScore(
+        source, target, ground_truth, params.max_correspondence_distance));
+  }
+  setPointsProcessed(state, source->size());
+}
+BENCHMARK(BM_transformScore)
+    ->RangeMultiplier(10)
+    ->Range(10000, 1000000)
+    ->Unit(benchmark::kMillisecond);
+
+/* global stages */
+
+static void BM_findMaxSpanningTree(benchmark::State &state)
+{
+  const size_t nodes = size_t(state.range(0));
+  std::mt19937 rng(42);
+  std::uniform_real_distribution<double> confidence(0.1, 10.0);
+  std::vector<TransformEstimate> estimates;
+  for (size_t i = 0; i < nodes - 1; ++i) {
+    for (size_t j = i + 1; j < nodes; ++j) {
+      estimates.emplace_back(i, j);
+      estimates.back().transform.setIdentity();
+      estimates.back().confidence = confidence(rng);
+    }
+  }
+  for (auto _ : state) {
+    Graph span_tree;
+    std::vector<size_t> centers;
+    findMaxSpanningTree(estimates, span_tree, centers);
+    benchmark::DoNotOptimize(centers);
+  }
+  state.SetItemsProcessed(int64_t(state.iterations()) *
+                          int64_t(estimates.size()));
+}
+BENCHMARK(BM_findMaxSpanningTree)
+    ->RangeMultiplier(4)
+    ->Range(8, 512)
+    ->Unit(benchmark::kMicrosecond);
+
+static void BM_optimizePoseGraph(benchmark::State &state)
+{
+  // maps along a path, each overlapping with 3 following maps
+  const size_t nodes = size_t(state.range(0));
+  std::mt19937 rng(42);
+  std::normal_distribution<float> noise(0.f, 0.01f);
+  auto pose = [](float x, float y, float yaw) -> Eigen::Matrix4f {
+    Eigen::Affine3f transform =
+        Eigen::Translation3f(x, y, 0.f) *
+        Eigen::AngleAxisf(yaw, Eigen::Vector3f::UnitZ());
+    return transform.matrix();
+  };
+  std::vector<Eigen::Matrix4f> ground_truth;
+  for (size_t i = 0; i < nodes; ++i) {
+    ground_truth.push_back(pose(float(i), float(i % 7), 0.01f * i));
+  }
+  std::vector<TransformEstimate> estimates;
+  std::vector<Eigen::Matrix4f> chained(nodes, Eigen::Matrix4f::Identity());
+  for (size_t i = 0; i < nodes; ++i) {
+    for (size_t j = i + 1; j < std::min(nodes, i + 4); ++j) {
+      estimates.emplace_back(i, j);
+      estimates.back().transform = pose(noise(rng), noise(rng), noise(rng)) *
+                                   ground_truth[j].inverse() * ground_truth[i];
+      estimates.back().confidence = 1.0;
+      if (j == i + 1) {
+        chained[j] = chained[i] * estimates.back().transform.inverse();
+      }
+    }
+  }
+  size_t iterations = 0;
+  for (auto _ : state) {
+    std::vector<Eigen::Matrix4f> transforms = chained;
+    iterations = optimizePoseGraph(estimates, transforms, 0, 20, 0.5);
+  }
+  state.counters["iterations"] = iterations;
+  state.SetItemsProcessed(int64_t(state.iterations()) *
+                          int64_t(estimates.size()));
+}
+BENCHMARK(BM_optimizePoseGraph)
+    ->RangeMultiplier(4)
+    ->Range(8, 512)
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_composeMaps(benchmark::State &state)
+{
+  const MapMergingParams params;
+  const size_t maps = size_t(state.range(1));
+  std::vector<PointCloudConstPtr> clouds;
+  std::vector<Eigen::Matrix4f> transforms;
+  for (size_t i = 0; i < maps; ++i) {
+    clouds.emplace_back(generateScene(size_t(state.range(0)), unsigned(i)));
+    transforms.emplace_back(groundTruthTransform());
+  }
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        composeMaps(clouds, transforms, params.output_resolution));
+  }
+  setPointsProcessed(state, size_t(state.range(0)) * maps);
+}
+BENCHMARK(BM_composeMaps)
+    ->Apply(multipleMaps)
+    ->Unit(benchmark::kMillisecond);
+
+/* whole pipeline on maps cut from one scene */
+
+static void BM_estimateMapsTransforms(benchmark::State &state)
+{
+  const MapMergingParams params;
+  PartialMapsParams maps_params;
+  maps_params.maps = size_t(state.range(1));
+  SceneParams scene_params;
+  scene_params.points = size_t(state.range(0)) * maps_params.maps;
+  scene_params = sceneForPartialMaps(scene_params, maps_params);
+  PartialMaps maps =
+      generatePartialMaps(generateScene(scene_params), maps_params);
+  std::vector<PointCloudConstPtr> clouds(maps.maps.begin(), maps.maps.end());
+
+  std::vector<Eigen::Matrix4f> transforms;
+  for (auto _ : state) {
+    transforms = estimateMapsTransforms(clouds, params);
+  }
+  setPointsProcessed(state, scene_params.points);
+  TransformsError error = evaluateTransforms(transforms, maps.ground_truth);
+  state.counters["merged"] = error.merged;
+  state.counters["max_rotation_error"] = error.max_rotation;
+  state.counters["max_translation_error"] = error.max_translation;
+}
+static void mapsScaling(benchmark::internal::Benchmark *benchmark)
+{
+  for (int maps : {2, 4, 8, 16}) {
+    benchmark->Args({100000, maps});
+  }
+}
+BENCHMARK(BM_estimateMapsTransforms)
+    ->Apply(mapsScaling)
+    ->Iterations(1)
+    ->Unit(benchmark::kSecond);
+
+BENCHMARK_MAIN();
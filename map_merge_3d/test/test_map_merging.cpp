@@ -1,7 +1,30 @@
 #include <gtest/gtest.h>
 #include <ros/ros.h>
 
+#include <map_merge_3d/distributed.h>
+#include <map_merge_3d/estimation_worker.h>
+#include <map_merge_3d/evaluation.h>
+#include <map_merge_3d/features.h>
 #include <map_merge_3d/map_merging.h>
+#include <map_merge_3d/multi_resolution_map.h>
+#include <map_merge_3d/state_store.h>
+#include <map_merge_3d/submaps.h>
+#include <map_merge_3d/synthetic.h>
+#include <map_merge_3d/tiled_map.h>
+#include "graph.h"
+#include "pose_graph.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <tuple>
+
+#include <Eigen/Geometry>
 
 using Eigen::Matrix4f;
 using namespace map_merge_3d;
@@ -20,6 +43,76 @@ TEST(estimateMapsTransforms, one)
   EXPECT_EQ(result[0], Matrix4f::Identity());
 }
 
+TEST(estimateMapsTransforms, contextIsReset)
+{
+  EstimationContext context;
+  context.pairwise_estimates.emplace_back(0, 1);
+  std::vector<Matrix4f> result = estimateMapsTransforms(
+      {PointCloudConstPtr(new PointCloud)}, MapMergingParams(), context);
+  EXPECT_EQ(result.size(), 1);
+  EXPECT_TRUE(context.pairwise_estimates.empty());
+}
+
+TEST(estimateMapsTransforms, cancelled)
+{
+  EstimationContext context;
+  context.is_cancelled = []() { return true; };
+  EXPECT_THROW(estimateMapsTransforms({PointCloudConstPtr(new PointCloud)},
+                                      MapMergingParams(), context),
+               EstimationCancelled);
+}
+
+TEST(EstimationWorker, coalescesRequests)
+{
+  EstimationWorker worker;
+  std::atomic<int> runs(0);
+  std::atomic<int> last(0);
+  std::atomic<bool> release(false);
+  std::atomic<bool> started(false);
+  worker.request([&](const std::atomic<bool>& cancelled) {
+    started = true;
+    while (!release && !cancelled) {
+      std::this_thread::yield();
+    }
+    ++runs;
+  });
+  while (!started) {
+    std::this_thread::yield();
+  }
+  for (int i = 1; i <= 10; ++i) {
+    worker.request([&, i](const std::atomic<bool>&) {
+      ++runs;
+      last = i;
+    });
+  }
+  release = true;
+  worker.waitIdle();
+  // first job and only the latest of the pending jobs
+  EXPECT_EQ(runs, 2);
+  EXPECT_EQ(last, 10);
+}
+
+TEST(EstimationWorker, cancelRunning)
+{
+  EstimationWorker worker;
+  std::atomic<bool> was_cancelled(false);
+  std::atomic<bool> started(false);
+  worker.request([&](const std::atomic<bool>& cancelled) {
+    started = true;
+    while (!cancelled) {
+      std::this_thread::yield();
+    }
+    was_cancelled = true;
+  });
+  while (!started) {
+    std::this_thread::yield();
+  }
+  worker.request([](const std::atomic<bool>&) {}, true);
+  worker.waitIdle();
+  EXPECT_TRUE(was_cancelled);
+  EXPECT_FALSE(worker.busy());
+}
+
 TEST(composeMaps, empty)
 {
   PointCloudPtr result = composeMaps({}, {}, 0.0);
@@ -39,6 +132,882 @@ TEST(composeMaps, one)
   EXPECT_EQ(result->size(), 0);
 }
 
+TEST(MapCompositor, appendChunks)
+{
+  PointCloudPtr first(new PointCloud);
+  first->push_back(PointT());
+  PointCloudPtr second(new PointCloud);
+  second->push_back(PointT());
+  second->points[0].x = 1.f;
+
+  MapCompositor compositor(0.05);
+  PointCloudPtr result = compositor.compose(
+      std::vector<MapCompositor::MapChunks>{{first}}, {Matrix4f::Identity()});
+  ASSERT_NE(result, nullptr);
+  EXPECT_EQ(result->size(), 1);
+  result = compositor.compose(
+      std::vector<MapCompositor::MapChunks>{{first, second}},
+      {Matrix4f::Identity()});
+  EXPECT_EQ(result->size(), 2);
+  // only the new chunk changed the map
+  EXPECT_TRUE(compositor.changedRegion().contains(Eigen::Vector3f(1, 0, 0)));
+  EXPECT_FALSE(
+      compositor.changedRegion().contains(Eigen::Vector3f(-0.5f, 0, 0)));
+  compositor.compose(std::vector<MapCompositor::MapChunks>{{first, second}},
+                     {Matrix4f::Identity()});
+  EXPECT_TRUE(compositor.changedRegion().isEmpty());
+  // invalid transform drops the map
+  result = compositor.compose(
+      std::vector<MapCompositor::MapChunks>{{first, second}},
+      {Matrix4f::Zero()});
+  EXPECT_EQ(result->size(), 0);
+  EXPECT_TRUE(compositor.changedRegion().contains(Eigen::Vector3f(0, 0, 0)));
+}
+
+static inline PointT pointAt(float x, float y, float z)
+{
+  PointT point;
+  point.x = x;
+  point.y = y;
+  point.z = z;
+  return point;
+}
+
+/* small procedural scene cut into partial maps. density of points is the
+ * same for any number of maps */
+static PartialMaps smallPartialMaps(size_t maps_count)
+{
+  PartialMapsParams maps_params;
+  maps_params.maps = maps_count;
+  maps_params.map_size = 8.0;
+  SceneParams scene_params = sceneForPartialMaps(SceneParams(), maps_params);
+  scene_params.points =
+      size_t(1300. * scene_params.size_x * scene_params.size_y);
+  return generatePartialMaps(generateScene(scene_params), maps_params);
+}
+
+struct SceneFeatures {
+  PointCloudPtr cloud;
+  SurfaceNormalsPtr normals;
+  // every 50th point of the cloud
+  PointCloudPtr keypoints;
+};
+
+/* small procedural scene downsampled to resolution with normals */
+static SceneFeatures smallSceneFeatures(const MapMergingParams& params)
+{
+  SceneParams scene_params;
+  scene_params.points = 20000;
+  SceneFeatures scene;
+  scene.cloud = downSample(generateScene(scene_params), params.resolution);
+  scene.normals = computeSurfaceNormals(scene.cloud, params.normal_radius);
+  scene.keypoints.reset(new PointCloud);
+  for (size_t i = 0; i < scene.cloud->size(); i += 50) {
+    scene.keypoints->push_back((*scene.cloud)[i]);
+  }
+  return scene;
+}
+
+TEST(removeOutliers, voxelGridMatchesRadius)
+{
+  // dense plane with a few isolated points
+  PointCloudPtr cloud(new PointCloud);
+  for (int i = 0; i < 80; ++i) {
+    for (int j = 0; j < 80; ++j) {
+      cloud->push_back(pointAt(i * 0.05f, j * 0.05f, 0.f));
+    }
+  }
+  for (int i = 0; i < 5; ++i) {
+    cloud->push_back(pointAt(10.f + i * 3.f, 10.f, 10.f));
+  }
+
+  PointCloudPtr radius =
+      removeOutliers(cloud, 0.3, 20, OutlierFilter::RADIUS);
+  PointCloudPtr voxel_grid =
+      removeOutliers(cloud, 0.3, 20, OutlierFilter::VOXEL_GRID);
+  EXPECT_EQ(radius->size(), 80 * 80);
+  EXPECT_EQ(voxel_grid->size(), 80 * 80);
+}
+
+TEST(computeLocalDescriptors, parallelMatchesSerial)
+{
+  const MapMergingParams params;
+  const SceneFeatures scene = smallSceneFeatures(params);
+  const PointCloudPtr& cloud = scene.cloud;
+  const SurfaceNormalsPtr& normals = scene.normals;
+  const PointCloudPtr& keypoints = scene.keypoints;
+  SurfaceNormalsPtr parallel_normals =
+      computeSurfaceNormals(cloud, params.normal_radius, 4);
+  ASSERT_EQ(parallel_normals->size(), normals->size());
+  for (size_t i = 0; i < normals->size(); ++i) {
+    EXPECT_TRUE((*parallel_normals)[i].getNormalVector3fMap() ==
+                (*normals)[i].getNormalVector3fMap());
+  }
+
+  // FPFH and native estimators are parallel, PFH is computed in chunks
+  for (Descriptor descriptor : {Descriptor::FPFH, Descriptor::PFH,
+                                Descriptor::FAST_FPFH, Descriptor::FAST_PFH}) {
+    PointCloudPtr serial_keypoints(new PointCloud(*keypoints));
+    PointCloudPtr parallel_keypoints(new PointCloud(*keypoints));
+    LocalDescriptorsPtr serial =
+        computeLocalDescriptors(cloud, normals, serial_keypoints, descriptor,
+                                params.descriptor_radius, 1);
+    LocalDescriptorsPtr parallel =
+        computeLocalDescriptors(cloud, normals, parallel_keypoints,
+                                descriptor, params.descriptor_radius, 4);
+    EXPECT_EQ(parallel_keypoints->size(), serial_keypoints->size());
+    EXPECT_EQ(parallel->width, serial->width);
+    EXPECT_EQ(parallel->data, serial->data);
+  }
+}
+
+TEST(computeLocalDescriptors, fastMatchesPCL)
+{
+  const MapMergingParams params;
+  const SceneFeatures scene = smallSceneFeatures(params);
+  const PointCloudPtr& cloud = scene.cloud;
+  const SurfaceNormalsPtr& normals = scene.normals;
+  const PointCloudPtr& keypoints = scene.keypoints;
+
+  const std::pair<Descriptor, Descriptor> implementations[] = {
+      {Descriptor::PFH, Descriptor::FAST_PFH},
+      {Descriptor::FPFH, Descriptor::FAST_FPFH}};
+  for (const auto& implementation : implementations) {
+    PointCloudPtr pcl_keypoints(new PointCloud(*keypoints));
+    PointCloudPtr fast_keypoints(new PointCloud(*keypoints));
+    LocalDescriptorsPtr pcl_descriptors =
+        computeLocalDescriptors(cloud, normals, pcl_keypoints,
+                                implementation.first, params.descriptor_radius);
+    LocalDescriptorsPtr fast_descriptors = computeLocalDescriptors(
+        cloud, normals, fast_keypoints, implementation.second,
+        params.descriptor_radius, 4);
+    ASSERT_EQ(fast_keypoints->size(), pcl_keypoints->size());
+    ASSERT_EQ(fast_descriptors->fields.size(), pcl_descriptors->fields.size());
+    EXPECT_EQ(fast_descriptors->fields[0].name,
+              pcl_descriptors->fields[0].name);
+    ASSERT_EQ(fast_descriptors->data.size(), pcl_descriptors->data.size());
+
+    // histograms differ only by pairs with features at the bin boundaries
+    const float* pcl_data =
+        reinterpret_cast<const float*>(pcl_descriptors->data.data());
+    const float* fast_data =
+        reinterpret_cast<const float*>(fast_descriptors->data.data());
+    double difference = 0.;
+    double total = 0.;
+    for (size_t i = 0; i < pcl_descriptors->data.size() / sizeof(float); ++i) {
+      difference += std::abs(double(fast_data[i]) - double(pcl_data[i]));
+      total += std::abs(double(pcl_data[i]));
+    }
+    EXPECT_LT(difference, 0.01 * total);
+  }
+}
+
+TEST(detectKeypoints, fastSiftMatchesSift)
+{
+  const MapMergingParams params;
+  const SceneFeatures scene = smallSceneFeatures(params);
+  const PointCloudPtr& cloud = scene.cloud;
+  const SurfaceNormalsPtr& normals = scene.normals;
+
+  std::vector<float> sift_scales;
+  std::vector<float> fast_scales;
+  PointCloudPtr sift = detectKeypoints(
+      cloud, normals, Keypoint::SIFT, params.keypoint_threshold,
+      params.normal_radius, params.resolution, 1, &sift_scales);
+  PointCloudPtr fast = detectKeypoints(
+      cloud, normals, Keypoint::FAST_SIFT, params.keypoint_threshold,
+      params.normal_radius, params.resolution, 4, &fast_scales);
+  ASSERT_EQ(sift_scales.size(), sift->size());
+  ASSERT_EQ(fast_scales.size(), fast->size());
+  ASSERT_GT(fast->size(), 0);
+
+  // the same extrema up to rounding of responses
+  size_t matched = 0;
+  for (size_t i = 0; i < fast->size(); ++i) {
+    EXPECT_GE(fast_scales[i], 1.f);
+    for (size_t j = 0; j < sift->size(); ++j) {
+      const Eigen::Vector3f difference = (*fast)[i].getVector3fMap() -
+                                         (*sift)[j].getVector3fMap();
+      if (difference.norm() < 1e-4f &&
+          std::abs(fast_scales[i] - sift_scales[j]) < 1e-4f) {
+        ++matched;
+        break;
+      }
+    }
+  }
+  EXPECT_GE(matched, fast->size() * 9 / 10);
+  EXPECT_GE(matched, sift->size() * 9 / 10);
+}
+
+TEST(computeLocalDescriptors, adaptiveRadius)
+{
+  const MapMergingParams params;
+  const SceneFeatures scene = smallSceneFeatures(params);
+  const PointCloudPtr& cloud = scene.cloud;
+  const SurfaceNormalsPtr& normals = scene.normals;
+  const PointCloudPtr& keypoints = scene.keypoints;
+
+  // unit scales are the same as the fixed radius
+  PointCloudPtr fixed_keypoints(new PointCloud(*keypoints));
+  PointCloudPtr unit_keypoints(new PointCloud(*keypoints));
+  LocalDescriptorsPtr fixed = computeLocalDescriptors(
+      cloud, normals, fixed_keypoints, Descriptor::FAST_FPFH,
+      params.descriptor_radius);
+  LocalDescriptorsPtr unit = computeLocalDescriptors(
+      cloud, normals, unit_keypoints, Descriptor::FAST_FPFH,
+      params.descriptor_radius, 1,
+      std::vector<float>(unit_keypoints->size(), 1.f));
+  EXPECT_EQ(unit->data, fixed->data);
+
+  // keypoints are grouped by scale
+  std::vector<float> scales;
+  for (size_t i = 0; i < keypoints->size(); ++i) {
+    scales.push_back(i % 2 ? 2.f : 1.f);
+  }
+  PointCloudPtr scaled_keypoints(new PointCloud(*keypoints));
+  LocalDescriptorsPtr scaled = computeLocalDescriptors(
+      cloud, normals, scaled_keypoints, Descriptor::FAST_FPFH,
+      params.descriptor_radius, 1, scales);
+  EXPECT_EQ(scaled_keypoints->size(), keypoints->size());
+  EXPECT_EQ(size_t(scaled->width * scaled->height), keypoints->size());
+  EXPECT_THROW(computeLocalDescriptors(cloud, normals, scaled_keypoints,
+                                       Descriptor::FAST_FPFH,
+                                       params.descriptor_radius, 1, {1.f}),
+               std::invalid_argument);
+}
+
+TEST(TiledMap, changedTiles)
+{
+  PointCloud map;
+  map.push_back(pointAt(0.5f, 0.5f, 0.f));
+  map.push_back(pointAt(1.5f, 0.5f, 0.f));
+  map.push_back(pointAt(-0.5f, 0.5f, 1.f));
+
+  TiledMap tiled_map(1.0);
+  EXPECT_EQ(tiled_map.update(map).size(), 3);
+  EXPECT_TRUE(tiled_map.update(map).empty());
+
+  map.push_back(pointAt(1.7f, 0.2f, 0.f));
+  std::vector<TiledMap::TileKey> changed = tiled_map.update(map);
+  ASSERT_EQ(changed.size(), 1);
+  EXPECT_EQ(changed[0], TiledMap::TileKey(1, 0));
+  EXPECT_EQ(tiled_map.tile({1, 0})->size(), 2);
+  EXPECT_EQ(tiled_map.tile({-1, 0})->size(), 1);
+  EXPECT_EQ(tiled_map.tile({5, 5}), nullptr);
+
+  // removed tiles are reported too
+  map.erase(map.begin() + 2);
+  changed = tiled_map.update(map);
+  ASSERT_EQ(changed.size(), 1);
+  EXPECT_EQ(changed[0], TiledMap::TileKey(-1, 0));
+  EXPECT_EQ(tiled_map.tile({-1, 0}), nullptr);
+}
+
+TEST(TiledMap, changedRegion)
+{
+  PointCloud map;
+  map.push_back(pointAt(0.5f, 0.5f, 0.f));
+  map.push_back(pointAt(5.5f, 0.5f, 0.f));
+
+  TiledMap tiled_map(1.0);
+  tiled_map.update(map);
+  EXPECT_TRUE(tiled_map.update(map, Eigen::AlignedBox3f()).empty());
+
+  // tiles outside of the region are kept
+  map.push_back(pointAt(0.7f, 0.5f, 0.f));
+  map.erase(map.begin() + 1);
+  Eigen::AlignedBox3f region(Eigen::Vector3f(0.f, 0.f, -1.f),
+                             Eigen::Vector3f(1.f, 1.f, 1.f));
+  std::vector<TiledMap::TileKey> changed = tiled_map.update(map, region);
+  ASSERT_EQ(changed.size(), 1);
+  EXPECT_EQ(changed[0], TiledMap::TileKey(0, 0));
+  EXPECT_EQ(tiled_map.tile({0, 0})->size(), 2);
+  EXPECT_EQ(tiled_map.tile({5, 0})->size(), 1);
+}
+
+TEST(TiledMap, regionOfInterest)
+{
+  PointCloud map;
+  for (int i = -10; i <= 10; ++i) {
+    map.push_back(pointAt(float(i), 0.f, 0.f));
+  }
+
+  TiledMap tiled_map(2.0);
+  tiled_map.update(map);
+  PointCloudPtr roi = tiled_map.regionOfInterest({0.f, 0.f, 5.f}, 3.0);
+  EXPECT_EQ(roi->size(), 7);
+  for (const auto& point : *roi) {
+    EXPECT_LE(std::abs(point.x), 3.f);
+  }
+}
+
+TEST(MultiResolutionMap, levels)
+{
+  PointCloudPtr map(new PointCloud);
+  for (int x = 0; x < 40; ++x) {
+    for (int y = 0; y < 40; ++y) {
+      map->push_back(pointAt(0.025f + 0.05f * x, 0.025f + 0.05f * y, 0.f));
+    }
+  }
+
+  MultiResolutionMap lod_map(0.05, 3);
+  EXPECT_DOUBLE_EQ(lod_map.resolution(2), 0.2);
+  EXPECT_EQ(lod_map.levelForResolution(0.1), 1);
+  EXPECT_EQ(lod_map.levelForResolution(1.0), 2);
+
+  lod_map.update(map);
+  EXPECT_EQ(lod_map.level(0)->size(), 1600);
+  EXPECT_EQ(lod_map.level(1)->size(), 400);
+  EXPECT_EQ(lod_map.level(2)->size(), 100);
+  PointCloudPtr found = lod_map.radiusSearch({1.f, 1.f, 0.f}, 0.5, 2);
+  EXPECT_GT(found->size(), 0);
+  EXPECT_LT(found->size(), 100);
+}
+
+TEST(StateStore, saveRestore)
+{
+  PointCloudPtr map1(new PointCloud);
+  map1->push_back(pointAt(0.f, 0.f, 0.f));
+  map1->push_back(pointAt(1.f, 0.f, 0.f));
+  PointCloudPtr map2(new PointCloud);
+  map2->push_back(pointAt(0.f, 1.f, 0.f));
+  EstimationContext context;
+  for (const PointCloudPtr& map : {map1, map2}) {
+    MapFeatures features;
+    features.source = map;
+    features.hash = cloudHash(*map);
+    features.cloud.reset(new PointCloud(*map));
+    features.normals.reset(new SurfaceNormals);
+    features.normals->resize(map->size());
+    features.keypoints.reset(new PointCloud(*map));
+    context.features.push_back(features);
+  }
+  context.features[0].descriptors.reset(new LocalDescriptors);
+  context.features[0].descriptors->data = {1, 2, 3};
+  context.pairwise_estimates.emplace_back(0, 1);
+  context.pairwise_estimates[0].transform = Matrix4f::Identity();
+  context.pairwise_estimates[0].transform(0, 3) = 2.f;
+
+  MapMergingParams params;
+  const std::string path = "/tmp/map_merge_3d_test_state";
+  StateStore::save(path, params, context);
+  StateStore store(path, params);
+  EXPECT_EQ(store.size(), 2);
+
+  // maps are received again as new objects in different order
+  std::vector<PointCloudConstPtr> clouds = {
+      PointCloudPtr(new PointCloud(*map2)),
+      PointCloudPtr(new PointCloud(*map1))};
+  EstimationContext restored;
+  EXPECT_EQ(store.restore(clouds, restored), 2);
+  ASSERT_EQ(restored.features.size(), 2);
+  EXPECT_EQ(restored.features[0].source, clouds[0]);
+  EXPECT_EQ(restored.features[1].cloud->size(), map1->size());
+  EXPECT_EQ(restored.features[0].descriptors, nullptr);
+  ASSERT_NE(restored.features[1].descriptors, nullptr);
+  EXPECT_EQ(restored.features[1].descriptors->data,
+            context.features[0].descriptors->data);
+  ASSERT_EQ(restored.pairwise_estimates.size(), 1);
+  EXPECT_EQ(restored.pairwise_estimates[0].source_idx, 0);
+  EXPECT_EQ(restored.pairwise_estimates[0].target_idx, 1);
+  EXPECT_FLOAT_EQ(restored.pairwise_estimates[0].transform(0, 3), -2.f);
+
+  // parameters not affecting features and estimates keep the state valid
+  params.feature_threads = 3;
+  params.output_resolution = 1.0;
+  params.pose_graph_iterations = 0;
+  params.transform_translation_tolerance = 1.0;
+  EXPECT_NO_THROW(StateStore(path, params));
+
+  // features are not valid for different parameters
+  params.resolution = 1.0;
+  EXPECT_THROW(StateStore(path, params), std::runtime_error);
+  std::remove(path.c_str());
+}
+
+static inline Matrix4f planarPose(float x, float y, float yaw)
+{
+  Eigen::Affine3f pose = Eigen::Translation3f(x, y, 0.f) *
+                         Eigen::AngleAxisf(yaw, Eigen::Vector3f::UnitZ());
+  return pose.matrix();
+}
+
+TEST(MapCompositor, matchesComposeMaps)
+{
+  // chunks share voxels, old points must keep their weight in centroids
+  std::vector<PointCloudConstPtr> chunks;
+  PointCloudPtr all(new PointCloud);
+  for (int c = 0; c < 3; ++c) {
+    PointCloudPtr chunk(new PointCloud);
+    for (int i = 0; i < 50; ++i) {
+      chunk->push_back(pointAt(0.013f * float(i + c), 0.007f * float(c * i),
+                               0.01f * float(c)));
+    }
+    *all += *chunk;
+    chunks.push_back(chunk);
+  }
+  const Matrix4f transform = planarPose(0.3f, -0.2f, 0.4f);
+
+  MapCompositor compositor(0.05);
+  PointCloudPtr result;
+  for (size_t c = 1; c <= chunks.size(); ++c) {
+    result = compositor.compose(
+        std::vector<MapCompositor::MapChunks>{
+            MapCompositor::MapChunks(chunks.begin(), chunks.begin() + c)},
+        {transform});
+  }
+  PointCloudPtr expected = composeMaps({all}, {transform}, 0.05);
+  ASSERT_EQ(result->size(), expected->size());
+  auto less = [](const PointT& a, const PointT& b) {
+    return std::make_tuple(a.x, a.y, a.z) < std::make_tuple(b.x, b.y, b.z);
+  };
+  std::sort(result->begin(), result->end(), less);
+  std::sort(expected->begin(), expected->end(), less);
+  for (size_t i = 0; i < result->size(); ++i) {
+    EXPECT_NEAR((*result)[i].x, (*expected)[i].x, 1e-5);
+    EXPECT_NEAR((*result)[i].y, (*expected)[i].y, 1e-5);
+    EXPECT_NEAR((*result)[i].z, (*expected)[i].z, 1e-5);
+  }
+
+  // nothing changed, the previous result is returned
+  EXPECT_EQ(compositor.compose(std::vector<MapCompositor::MapChunks>{chunks},
+                               {transform}),
+            result);
+}
+
+TEST(optimizePoseGraph, distributesLoopError)
+{
+  std::vector<Matrix4f> ground_truth = {
+      planarPose(0.f, 0.f, 0.f), planarPose(5.f, 0.f, 0.3f),
+      planarPose(5.f, 5.f, 0.6f), planarPose(0.f, 5.f, -0.2f)};
+  std::vector<TransformEstimate> estimates;
+  for (size_t i = 0; i < ground_truth.size(); ++i) {
+    size_t j = (i + 1) % ground_truth.size();
+    estimates.emplace_back(i, j);
+    estimates.back().transform = ground_truth[j].inverse() * ground_truth[i];
+  }
+  // one wrong edge in the loop
+  estimates[2].transform =
+      planarPose(0.3f, 0.f, 0.02f) * estimates[2].transform;
+
+  // chain along 0 -> 1 -> 2 -> 3
+  std::vector<Matrix4f> transforms(ground_truth.size());
+  transforms[0] = Matrix4f::Identity();
+  for (size_t i = 1; i < transforms.size(); ++i) {
+    transforms[i] = transforms[i - 1] * estimates[i - 1].transform.inverse();
+  }
+  auto error = [&](size_t i) {
+    return (transforms[i].block<3, 1>(0, 3) - ground_truth[i].block<3, 1>(0, 3))
+        .norm();
+  };
+  const float chained_error = error(3);
+
+  EXPECT_GT(optimizePoseGraph(estimates, transforms, 0, 20, 0.5), 0);
+  EXPECT_EQ(transforms[0], Matrix4f::Identity());
+  EXPECT_LT(error(3), chained_error);
+}
+
+TEST(optimizePoseGraph, weightsByConfidence)
+{
+  std::vector<Matrix4f> ground_truth = {
+      planarPose(0.f, 0.f, 0.f), planarPose(5.f, 0.f, 0.3f),
+      planarPose(5.f, 5.f, 0.6f), planarPose(0.f, 5.f, -0.2f)};
+  std::vector<TransformEstimate> estimates;
+  for (size_t i = 0; i < ground_truth.size(); ++i) {
+    size_t j = (i + 1) % ground_truth.size();
+    estimates.emplace_back(i, j);
+    estimates.back().transform = ground_truth[j].inverse() * ground_truth[i];
+    estimates.back().confidence = 1.0;
+  }
+  // wrong edge has low confidence
+  estimates[2].transform =
+      planarPose(0.3f, 0.f, 0.02f) * estimates[2].transform;
+  estimates[2].confidence = 0.01;
+
+  std::vector<Matrix4f> uniform(ground_truth.size());
+  uniform[0] = Matrix4f::Identity();
+  for (size_t i = 1; i < uniform.size(); ++i) {
+    uniform[i] = uniform[i - 1] * estimates[i - 1].transform.inverse();
+  }
+  std::vector<Matrix4f> weighted = uniform;
+  optimizePoseGraph(estimates, weighted, 0, 20, 0.5);
+  for (auto &est : estimates) {
+    est.confidence = 1.0;
+  }
+  optimizePoseGraph(estimates, uniform, 0, 20, 0.5);
+
+  auto error = [&](const std::vector<Matrix4f> &transforms, size_t i) {
+    return (transforms[i].block<3, 1>(0, 3) - ground_truth[i].block<3, 1>(0, 3))
+        .norm();
+  };
+  EXPECT_LT(error(weighted, 3), error(uniform, 3));
+}
+
+TEST(LoopConsistency, rejectsWrongEstimate)
+{
+  std::vector<Matrix4f> ground_truth = {
+      planarPose(0.f, 0.f, 0.f), planarPose(5.f, 0.f, 0.3f),
+      planarPose(5.f, 5.f, 0.6f), planarPose(0.f, 5.f, -0.2f)};
+  LoopConsistency loops(ground_truth.size(), 0.5, 0.1);
+  for (size_t i = 0; i < ground_truth.size(); ++i) {
+    for (size_t j = i + 1; j < ground_truth.size(); ++j) {
+      TransformEstimate estimate(i, j);
+      estimate.transform = ground_truth[j].inverse() * ground_truth[i];
+      estimate.confidence = 1.0;
+      if (i == 0 && j == 2) {
+        // wrong estimate with high confidence
+        estimate.transform = planarPose(2.f, 0.f, 0.5f) * estimate.transform;
+        estimate.confidence = 10.0;
+      }
+      loops.addEstimate(estimate);
+    }
+  }
+  EXPECT_TRUE(loops.isImplied(1, 3));
+
+  size_t rejected = 0;
+  std::vector<TransformEstimate> consistent =
+      loops.consistentEstimates(rejected);
+  EXPECT_EQ(rejected, 1);
+  ASSERT_EQ(consistent.size(), 5);
+  for (const auto& estimate : consistent) {
+    EXPECT_FALSE(estimate.source_idx == 0 && estimate.target_idx == 2);
+  }
+}
+
+TEST(findMaxSpanningTree, pathCenters)
+{
+  // path 1 - 2 - 3 - 4 - 5 with weaker shortcut 1 - 5, node 0 is not used
+  std::vector<TransformEstimate> estimates;
+  for (size_t i = 1; i < 5; ++i) {
+    estimates.emplace_back(i, i + 1);
+    estimates.back().confidence = 2.0;
+  }
+  estimates.emplace_back(1, 5);
+  estimates.back().confidence = 1.0;
+
+  Graph span_tree;
+  std::vector<size_t> centers;
+  findMaxSpanningTree(estimates, span_tree, centers);
+  ASSERT_EQ(centers.size(), 1);
+  EXPECT_EQ(centers[0], 3);
+  EXPECT_EQ(span_tree.numVertices(), 6);
+  EXPECT_EQ(span_tree.numEdges(), 8);
+  EXPECT_EQ(span_tree.degree(0), 0);
+  span_tree.forEach([&estimates](const GraphEdge& edge) {
+    const TransformEstimate& estimate = estimates[edge.index];
+    EXPECT_EQ(std::min(edge.from, edge.to), estimate.source_idx);
+    EXPECT_EQ(std::max(edge.from, edge.to), estimate.target_idx);
+  });
+
+  // even path has two centers
+  estimates.pop_back();
+  estimates.pop_back();
+  findMaxSpanningTree(estimates, span_tree, centers);
+  EXPECT_EQ(centers, std::vector<size_t>({2, 3}));
+}
+
+TEST(partitionToSubmaps, overlappingSubmaps)
+{
+  PointCloudPtr cloud(new PointCloud);
+  for (int x = 0; x < 40; ++x) {
+    for (int y = 0; y < 10; ++y) {
+      cloud->push_back(pointAt(0.05f + 0.1f * x, 0.05f + 0.1f * y, 0.f));
+    }
+  }
+  PointCloudPtr keypoints(new PointCloud);
+  for (int x = 0; x < 4; ++x) {
+    keypoints->push_back(pointAt(0.5f + x, 1.f, 0.f));
+  }
+  // one byte descriptor with the index of the keypoint
+  LocalDescriptorsPtr descriptors(new LocalDescriptors);
+  descriptors->height = 1;
+  descriptors->width = 4;
+  descriptors->point_step = 1;
+  descriptors->row_step = 4;
+  descriptors->data = {0, 1, 2, 3};
+
+  std::vector<Submap> submaps =
+      partitionToSubmaps(keypoints, descriptors, 2.0, 0.6, 2);
+  // keypoints at 1.5 and 2.5 fall to both submaps, submaps with only the
+  // first or the last keypoint are dropped
+  ASSERT_EQ(submaps.size(), 2);
+  EXPECT_EQ(submaps[0].keypoints->size(), 3);
+  EXPECT_EQ(submaps[1].keypoints->size(), 3);
+  EXPECT_EQ(submaps[1].keypoint_indices, std::vector<size_t>({1, 2, 3}));
+  EXPECT_EQ(submaps[1].descriptors->width, 3);
+  EXPECT_EQ(submaps[1].descriptors->data, std::vector<uint8_t>({1, 2, 3}));
+  EXPECT_EQ(extractSubmapCloud(cloud, submaps[0], 2.0, 0.6)->size() +
+                extractSubmapCloud(cloud, submaps[1], 2.0, 0.6)->size(),
+            cloud->size() + 120);
+
+  EXPECT_TRUE(partitionToSubmaps(keypoints, descriptors, 2.0, 0.6, 4).empty());
+}
+
+TEST(selectSubmapPairs, mostVoted)
+{
+  std::vector<Submap> source(2);
+  source[0].keypoint_indices = {0, 1, 2};
+  source[1].keypoint_indices = {2, 3, 4, 5};
+  std::vector<Submap> target(2);
+  target[0].keypoint_indices = {0, 1, 2, 3};
+  target[1].keypoint_indices = {4, 5, 6};
+  Correspondences correspondences;
+  // source submap 1 matches target submap 0 the most
+  for (int i : {2, 3, 4, 5}) {
+    correspondences.emplace_back(i, i - 2, 0.f);
+  }
+  correspondences.emplace_back(0, 4, 0.f);
+
+  auto pairs = selectSubmapPairs(source, target, correspondences, 1);
+  EXPECT_EQ(pairs, (std::vector<std::pair<size_t, size_t>>{{1, 0}}));
+  // single votes can't determine a transform
+  pairs = selectSubmapPairs(source, target, correspondences, 10);
+  EXPECT_EQ(pairs, (std::vector<std::pair<size_t, size_t>>{{1, 0}}));
+  pairs = selectSubmapPairs(source, target, correspondences, 10, 1);
+  EXPECT_EQ(pairs.size(), 3);
+  EXPECT_EQ(pairs[0], std::make_pair(size_t(1), size_t(0)));
+}
+
+TEST(aggregateSubmapEstimates, largestSupport)
+{
+  std::vector<TransformEstimate> estimates;
+  const float xs[] = {1.f, 1.05f, 0.98f, 5.f};
+  const double scores[] = {0.01, 0.02, 0.03, 0.001};
+  for (size_t i = 0; i < 4; ++i) {
+    estimates.emplace_back(0, 1);
+    estimates.back().transform = planarPose(xs[i], 0.f, 0.f);
+    // wrong match has the most inliers and the best score alone
+    estimates.back().registration.inliers = xs[i] == 5.f ? 25 : 10;
+    estimates.back().registration.score = scores[i];
+  }
+  estimates.emplace_back(1, 0);
+  estimates.back().transform = Matrix4f::Zero();
+  estimates.back().registration.inliers = 100;
+  // submaps without overlap
+  estimates.emplace_back(1, 1);
+  estimates.back().transform = planarPose(1.f, 0.f, 0.f);
+  estimates.back().registration.inliers = 100;
+  estimates.back().registration.score = std::numeric_limits<double>::max();
+
+  TransformEstimate result = aggregateSubmapEstimates(estimates, 0.1, 0.1);
+  EXPECT_NEAR(result.transform(0, 3), 1.f, 0.1f);
+  // supporting estimates are aggregated
+  EXPECT_EQ(result.registration.inliers, 30);
+  EXPECT_DOUBLE_EQ(result.registration.score, 0.02);
+  EXPECT_DOUBLE_EQ(result.confidence, 1. / 0.02);
+
+  result = aggregateSubmapEstimates({}, 0.1, 0.1);
+  EXPECT_TRUE(result.transform.isZero());
+  EXPECT_EQ(result.confidence, 0.0);
+}
+
+TEST(evaluateTransforms, relativeToReference)
+{
+  std::vector<Matrix4f> ground_truth;
+  for (int i = 0; i < 3; ++i) {
+    Eigen::Affine3f transform =
+        Eigen::Translation3f(float(i), 2.f * i, 0.f) *
+        Eigen::AngleAxisf(0.2f * i, Eigen::Vector3f::UnitZ());
+    ground_truth.emplace_back(transform.matrix());
+  }
+  // estimated relative to the second map, first map is not merged
+  std::vector<Matrix4f> estimated;
+  for (const auto& transform : ground_truth) {
+    estimated.emplace_back(ground_truth[1].inverse() * transform);
+  }
+  estimated[0].setZero();
+
+  TransformsError error = evaluateTransforms(estimated, ground_truth);
+  EXPECT_EQ(error.merged, 2);
+  EXPECT_NEAR(error.max_rotation, 0.0, 1e-5);
+  EXPECT_NEAR(error.max_translation, 0.0, 1e-5);
+
+  EXPECT_ANY_THROW(evaluateTransforms({}, ground_truth));
+}
+
+TEST(generatePartialMaps, groundTruth)
+{
+  PartialMapsParams maps_params;
+  maps_params.maps = 4;
+  maps_params.noise = 0.0;
+  SceneParams scene_params;
+  scene_params.points = 20000;
+  scene_params = sceneForPartialMaps(scene_params, maps_params);
+  PointCloudPtr scene = generateScene(scene_params);
+  EXPECT_EQ(scene->size(), scene_params.points);
+
+  PartialMaps maps = generatePartialMaps(scene, maps_params);
+  ASSERT_EQ(maps.maps.size(), maps_params.maps);
+  ASSERT_EQ(maps.ground_truth.size(), maps_params.maps);
+  for (size_t i = 0; i < maps.maps.size(); ++i) {
+    EXPECT_GT(maps.maps[i]->size(), 0);
+    // maps transformed by the ground truth must lie in the scene
+    for (const auto& point : *maps.maps[i]) {
+      Eigen::Vector4f p =
+          maps.ground_truth[i] * point.getVector4fMap();
+      EXPECT_GT(p.x(), -1e-3);
+      EXPECT_LT(p.x(), scene_params.size_x + 1e-3);
+      EXPECT_GT(p.y(), -1e-3);
+      EXPECT_LT(p.y(), scene_params.size_y + 1e-3);
+    }
+  }
+
+  // the same seed produces the same maps
+  PartialMaps maps2 = generatePartialMaps(scene, maps_params);
+  EXPECT_EQ(maps2.maps[1]->size(), maps.maps[1]->size());
+  EXPECT_EQ(maps2.ground_truth[1], maps.ground_truth[1]);
+}
+
+/* number of maps can be scaled with MAP_MERGE_TEST_MAPS environment variable
+ */
+TEST(estimateMapsTransforms, synthetic)
+{
+  size_t maps_count = 3;
+  if (const char* maps_env = std::getenv("MAP_MERGE_TEST_MAPS")) {
+    maps_count = size_t(std::atoi(maps_env));
+  }
+  PartialMaps maps = smallPartialMaps(maps_count);
+  std::vector<PointCloudConstPtr> clouds(maps.maps.begin(), maps.maps.end());
+
+  MapMergingParams params;
+  std::vector<Matrix4f> result = estimateMapsTransforms(clouds, params);
+  ASSERT_EQ(result.size(), maps_count);
+  // one of the maps is the reference frame
+  EXPECT_TRUE(std::any_of(result.begin(), result.end(), [](const Matrix4f& t) {
+    return t.isIdentity();
+  }));
+  TransformsError error = evaluateTransforms(result, maps.ground_truth);
+  EXPECT_EQ(error.merged, maps_count);
+  EXPECT_LT(error.max_translation, params.inlier_threshold);
+  EXPECT_LT(error.max_rotation, 0.05);
+}
+
+TEST(estimateMapsTransforms, tracking)
+{
+  PartialMaps maps = smallPartialMaps(2);
+  std::vector<PointCloudConstPtr> clouds(maps.maps.begin(), maps.maps.end());
+
+  MapMergingParams params;
+  params.tracking = true;
+  EstimationContext context;
+  std::vector<Matrix4f> result =
+      estimateMapsTransforms(clouds, params, context);
+  ASSERT_EQ(result.size(), maps.maps.size());
+  EXPECT_EQ(context.transforms, result);
+  ASSERT_EQ(context.pairwise_estimates.size(), 1);
+  const TransformEstimate global = context.pairwise_estimates[0];
+  EXPECT_GT(global.registration.correspondences, 0);
+  EXPECT_EQ(global.global_score, global.registration.score);
+
+  // updated map is tracked from the previous transforms
+  clouds[1] = PointCloudConstPtr(new PointCloud(*clouds[1]));
+  result = estimateMapsTransforms(clouds, params, context);
+  ASSERT_EQ(result.size(), maps.maps.size());
+  ASSERT_EQ(context.pairwise_estimates.size(), 1);
+  EXPECT_EQ(context.features[1].source, clouds[1]);
+  // refined by ICP only, features of the updated map were not computed
+  const TransformEstimate& tracked = context.pairwise_estimates[0];
+  EXPECT_EQ(tracked.registration.correspondences, 0);
+  EXPECT_GT(tracked.registration.icp_iterations, 0);
+  EXPECT_FALSE(context.features[1].descriptors);
+  // tracking is compared with the global registration it started from
+  EXPECT_EQ(tracked.global_score, global.global_score);
+}
+
+TEST(estimateMapsTransforms, pinnedReference)
+{
+  PartialMaps maps = smallPartialMaps(2);
+  std::vector<PointCloudConstPtr> clouds(maps.maps.begin(), maps.maps.end());
+
+  MapMergingParams params;
+  // registration of the copied map may differ slightly
+  params.transform_translation_tolerance = 0.1;
+  params.transform_rotation_tolerance = 0.01;
+  EstimationContext context;
+  context.pinned_reference_frame = 1;
+  std::vector<Matrix4f> result =
+      estimateMapsTransforms(clouds, params, context);
+  ASSERT_EQ(result.size(), maps.maps.size());
+  ASSERT_FALSE(result[0].isZero());
+  EXPECT_EQ(context.reference_frame, 1);
+  EXPECT_EQ(result[1], Matrix4f::Identity());
+
+  // the same transforms are returned for the same map
+  clouds[0] = PointCloudConstPtr(new PointCloud(*clouds[0]));
+  std::vector<Matrix4f> updated =
+      estimateMapsTransforms(clouds, params, context);
+  EXPECT_EQ(context.reference_frame, 1);
+  EXPECT_EQ(updated, result);
+}
+
+TEST(estimateMapsTransforms, distributed)
+{
+  PartialMaps maps = smallPartialMaps(3);
+  std::vector<PointCloudConstPtr> clouds(maps.maps.begin(), maps.maps.end());
+
+  MapMergingParams params;
+  EstimationContext context;
+  context.workers = std::make_shared<RegistrationWorkers>(
+      std::vector<std::string>(), 2, 60., MAP_MERGE_WORKER);
+  ASSERT_EQ(context.workers->size(), 2);
+  std::vector<Matrix4f> result =
+      estimateMapsTransforms(clouds, params, context);
+  ASSERT_EQ(result.size(), maps.maps.size());
+  EXPECT_TRUE(std::any_of(result.begin(), result.end(), [](const Matrix4f& t) {
+    return t.isIdentity();
+  }));
+  // all pairs were registered by workers that stayed alive
+  EXPECT_EQ(context.pairwise_estimates.size(), 3);
+  EXPECT_EQ(context.workers->size(), 2);
+
+  // workers estimate the same transforms as the local registration
+  for (const auto& estimate : context.pairwise_estimates) {
+    TransformEstimate local = estimatePairTransform(
+        context.features[estimate.source_idx],
+        context.features[estimate.target_idx], params);
+    EXPECT_FALSE(transformChanged(local.transform, estimate.transform,
+                                  params.inlier_threshold, 0.05));
+  }
+}
+
+TEST(RegistrationWorkers, failingWorkers)
+{
+  PartialMaps maps = smallPartialMaps(2);
+  std::vector<PointCloudConstPtr> clouds(maps.maps.begin(), maps.maps.end());
+  MapMergingParams params;
+  EstimationContext context;
+  estimateMapsTransforms(clouds, params, context);
+
+  // unreachable socket is not a worker, local workers die right after start
+  RegistrationWorkers workers({"/nonexistent/worker.sock"}, 2, 1.,
+                              "/nonexistent/map_merge_worker");
+  EXPECT_EQ(workers.size(), 2);
+  std::vector<TransformEstimate> estimates =
+      workers.registerPairs(context.features, {{0, 1}}, params);
+  // the pair was retried and finally registered locally
+  ASSERT_EQ(estimates.size(), 1);
+  EXPECT_EQ(estimates[0].source_idx, 0);
+  EXPECT_EQ(estimates[0].target_idx, 1);
+  EXPECT_FALSE(estimates[0].transform.isZero());
+  EXPECT_EQ(workers.size(), 0);
+}
+
+TEST(transformChanged, tolerances)
+{
+  const Matrix4f pose = planarPose(1.f, 2.f, 0.5f);
+  EXPECT_FALSE(transformChanged(pose, pose, 0.01, 0.001));
+  EXPECT_FALSE(transformChanged(Matrix4f::Zero(), Matrix4f::Zero(), 0., 0.));
+  EXPECT_TRUE(transformChanged(Matrix4f::Zero(), pose, 0.01, 0.001));
+  EXPECT_TRUE(transformChanged(pose, Matrix4f::Zero(), 0.01, 0.001));
+
+  const Matrix4f moved = pose * planarPose(0.005f, 0.f, 0.f);
+  EXPECT_FALSE(transformChanged(pose, moved, 0.01, 0.001));
+  EXPECT_TRUE(transformChanged(pose, moved, 0.001, 0.001));
+  const Matrix4f rotated = pose * planarPose(0.f, 0.f, 0.01f);
+  EXPECT_FALSE(transformChanged(pose, rotated, 0.01, 0.1));
+  EXPECT_TRUE(transformChanged(pose, rotated, 0.01, 0.001));
+}
+
 int main(int argc, char** argv)
 {
   ros::Time::init();